@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "BotConfig.h"
+#include "StringHelpers.h"
+
+namespace IRCOptotron
+{
+
+bool BotConfig::load(const std::string& path)
+{
+	std::ifstream file(path.c_str());
+	if(!file)
+	{
+		std::cerr << "Could not open config file " << path << std::endl;
+		return false;
+	}
+
+	calc_db = "calc.db";
+	hostmask_db = "hostmasks.db";
+	networks.clear();
+
+	std::string line;
+	unsigned line_number = 0;
+
+	while(std::getline(file, line))
+	{
+		line_number++;
+		MiscStringHelpers::trim(line);
+
+		if(line.empty() || line[0] == '#')
+			continue;
+
+		if(line[0] == '[' && line[line.size() - 1] == ']')
+		{
+			NetworkConfig network;
+			network.name = line.substr(1, line.size() - 2);
+			MiscStringHelpers::trim(network.name);
+			networks.push_back(network);
+			continue;
+		}
+
+		size_t equals = line.find('=');
+		if(equals == std::string::npos)
+		{
+			std::cerr << path << ":" << line_number << ": expected key = value" << std::endl;
+			return false;
+		}
+
+		std::string key = line.substr(0, equals);
+		std::string value = line.substr(equals + 1);
+		MiscStringHelpers::trim(key);
+		MiscStringHelpers::trim(value);
+
+		if(networks.empty())
+		{
+			if(key == "calc_db")
+				calc_db = value;
+			else if(key == "hostmask_db")
+				hostmask_db = value;
+			else
+				std::cerr << path << ":" << line_number << ": unknown setting " << key << std::endl;
+
+			continue;
+		}
+
+		NetworkConfig& network = networks.back();
+
+		if(key == "server")
+			network.server = value;
+		else if(key == "port")
+			network.port = (unsigned short) atoi(value.c_str());
+		else if(key == "nick")
+			network.nick = value;
+		else if(key == "flood_burst")
+			network.flood_burst = atof(value.c_str());
+		else if(key == "flood_rate")
+			network.flood_rate = atof(value.c_str());
+		else if(key == "channels")
+		{
+			std::vector<std::string> channels = MiscStringHelpers::tokenizeString(value, ' ');
+			for(unsigned i = 0; i < channels.size(); i++)
+			{
+				if(!channels[i].empty())
+					network.channels.push_back(channels[i]);
+			}
+		}
+		else
+			std::cerr << path << ":" << line_number << ": unknown setting " << key << std::endl;
+	}
+
+	for(unsigned i = 0; i < networks.size(); i++)
+	{
+		if(networks[i].server.empty())
+		{
+			std::cerr << path << ": network " << networks[i].name << " has no server" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+ConfigWatcher::ConfigWatcher()
+{
+	_modified = 0;
+	_size = -1;
+}
+
+bool ConfigWatcher::stat(time_t& modified, long long& size) const
+{
+	struct ::stat info;
+	if(::stat(_path.c_str(), &info) != 0)
+		return false;
+
+	modified = info.st_mtime;
+	size = (long long) info.st_size;
+	return true;
+}
+
+void ConfigWatcher::watch(const std::string& path)
+{
+	_path = path;
+	_modified = 0;
+	_size = -1;
+	stat(_modified, _size);
+}
+
+/* Modification times only have a second's resolution on some filesystems, so the
+   size is compared too. A file that is missing (e.g. mid-rename by an editor)
+   counts as unchanged until it comes back. */
+bool ConfigWatcher::changed()
+{
+	time_t modified;
+	long long size;
+
+	if(_path.empty() || !stat(modified, size))
+		return false;
+
+	if(modified == _modified && size == _size)
+		return false;
+
+	_modified = modified;
+	_size = size;
+	return true;
+}
+
+bool ConfigWatcher::isWatching() const
+{
+	return !_path.empty();
+}
+
+const std::string& ConfigWatcher::getPath() const
+{
+	return _path;
+}
+
+}
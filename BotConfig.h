@@ -0,0 +1,74 @@
+#pragma once
+
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "OutboundQueue.h"
+
+namespace IRCOptotron
+{
+
+struct NetworkConfig
+{
+	std::string name;
+	std::string server;
+	unsigned short port;
+	std::string nick;
+	std::vector<std::string> channels;
+	double flood_burst;
+	double flood_rate;
+
+	NetworkConfig() : port(6667), nick("bot"), flood_burst(DEFAULT_FLOOD_BURST), flood_rate(DEFAULT_FLOOD_RATE) {}
+};
+
+/* BotConfig is what the bot reads from its config file: the two database paths
+   and the networks to sit on. The file is plain key = value lines, with a
+   [name] line starting each network:
+
+       calc_db = calc.db
+       hostmask_db = hostmasks.db
+
+       [efnet]
+       server = 208.51.40.2
+       port = 6667
+       nick = bot
+       channels = #chan1 #chan2
+       flood_burst = 4
+       flood_rate = 0.5
+
+   flood_burst and flood_rate (lines per second) are optional and default to the
+   RFC 1459 limits; raise them only for a server known to allow more. Blank lines and lines starting with # are ignored. */
+struct BotConfig
+{
+	std::string calc_db;
+	std::string hostmask_db;
+	std::vector<NetworkConfig> networks;
+
+	bool load(const std::string& path);
+
+	BotConfig() : calc_db("calc.db"), hostmask_db("hostmasks.db") {}
+};
+
+/* ConfigWatcher tells whether a file has changed since it was last looked at, by
+   polling its modification time and size. */
+class ConfigWatcher
+{
+private:
+	std::string _path;
+	time_t _modified;
+	long long _size;
+
+	bool stat(time_t& modified, long long& size) const;
+
+public:
+	void watch(const std::string& path);
+	bool changed();
+	bool isWatching() const;
+	const std::string& getPath() const;
+
+	ConfigWatcher();
+};
+
+}
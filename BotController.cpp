@@ -1,5 +1,10 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#include <fstream>
+#include <thread>
 
 #include "BotController.h"
 #include "StringHelpers.h"
@@ -7,27 +12,59 @@
 namespace IRCOptotron
 {
 
-typedef struct 
-{
-	char * channel;
-	char * nick;
-} irc_ctx_t;
+// RPL_ISUPPORT (005), which libircclient only knows by its old RFC name RPL_BOUNCE.
+static const unsigned int RPL_ISUPPORT = 5;
+
+// The RFC 1459 replies we act on, defined here so neither session needs libircclient's list.
+static const unsigned int RPL_ENDOFWHO = 315;
+static const unsigned int RPL_WHOREPLY = 352;
+static const unsigned int RPL_NAMREPLY = 353;
+static const unsigned int RPL_ENDOFNAMES = 366;
+
+// Cap used when the server advertises MODES without a value (i.e. unlimited).
+static const unsigned int MAX_MODES_PER_LINE = 12;
+
+// Calc edits are committed together, at most this many or this long after the first.
+static const unsigned int GROUP_COMMIT_MAX_WRITES = 64;
+static const unsigned int GROUP_COMMIT_WINDOW_MS = 10;
+
+// Rate limits, in command cost: a burst of this much, then this much per second.
+static const double USER_RATE_BURST = 20;
+static const double USER_RATE_PER_SECOND = 0.5;
+static const double CHANNEL_RATE_BURST = 40;
+static const double CHANNEL_RATE_PER_SECOND = 2;
+
+// How often outbound queue stats are written to the log, in seconds.
+static const int OUTBOUND_STATS_INTERVAL = 60;
 
-// Static member initialization
-bool BotController::_init = false;
+// How often the metrics file is rewritten, in seconds.
+static const int STATS_FILE_INTERVAL = 10;
 
-CalcDB* BotController::_calc_db = new CalcDB("calc.db");
-HostmaskAuthorizer* BotController::_hostmask_db = new HostmaskAuthorizer("hostmasks.db");
+// How often the channel snapshot is saved, if it changed, in seconds.
+static const int SNAPSHOT_INTERVAL = 60;
 
-irc_session_t* BotController::_session = 0;
-irc_callbacks_t BotController::_callbacks;
-std::string BotController::_server;
-std::string BotController::_nick;
-std::string BotController::_last_chan;
-std::vector<std::string> BotController::_chanlist;
+// How often the config file is checked for changes, in seconds.
+static const int CONFIG_POLL_INTERVAL = 2;
 
+// During a replay, DB completions are picked up after this many events.
+static const unsigned REPLAY_COMPLETION_INTERVAL = 64;
+
+
+// Event handler prototypes; ctx is the IrcNetwork the event came in on
+void on_connect(void * ctx, const char * event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count);
+void on_channel(void * ctx, const char * event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count);
+void on_join(void * ctx, const char * event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count);
+void on_numeric(void * ctx, unsigned int event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count);
 
-// Event handler prototypes
+#ifndef IRCOPTOTRON_NATIVE_IRC
 void event_connect(irc_session_t * session, const char * event, 
 				   const char * origin, const char ** params, 
 				   unsigned int count);
@@ -40,255 +77,1070 @@ void event_join(irc_session_t * session, const char * event,
 void event_numeric(irc_session_t * session, unsigned int event, 
 				   const char * origin, const char ** params, 
 				   unsigned int count);
+#endif
+
+/* With db_threads above one, calc lookups from different channels run side by
+   side, each worker thread reading through its own connection. */
+BotController::BotController(const std::string& calc_db_filename, const std::string& hostmask_db_filename, unsigned db_threads)
+	: _stats_file("ircoptotron.prom"), _snapshot_file("ircoptotron.snapshot"), _user_limiter(USER_RATE_BURST, USER_RATE_PER_SECOND), _channel_limiter(CHANNEL_RATE_BURST, CHANNEL_RATE_PER_SECOND)
+{
+	describeMetrics();
+
+	_running = false;
+	_reconnect = true;
+	_calc_db_filename = calc_db_filename;
+	_hostmask_db_filename = hostmask_db_filename;
+
+	_calc_db = new CalcDB(calc_db_filename);
+	_calc_db->setMetrics(&_metrics);
+	_hostmask_db = new HostmaskAuthorizer(hostmask_db_filename);
+	_hostmask_db->setMetrics(&_metrics);
+
+	_db_worker = new DbWorker(db_threads);
+	if(_db_worker->threadCount() > 1)
+		openReaders(calc_db_filename, _calc_readers);
+
+	// Readers find out what a batch changed through the calc DB's change log.
+	_db_worker->setGroupCommit(
+		[this]{ _calc_db->beginBatch(); },
+		[this]{ return _calc_db->commitBatch() == CALC_RESPONSE_OK; },
+		GROUP_COMMIT_MAX_WRITES, GROUP_COMMIT_WINDOW_MS);
+
+	// Register IRC Event Callbacks
+	memset(&_callbacks, 0, sizeof(_callbacks));
+#ifdef IRCOPTOTRON_NATIVE_IRC
+	_callbacks.event_connect = on_connect;
+	_callbacks.event_channel = on_channel;
+	_callbacks.event_join = on_join;
+	_callbacks.event_numeric = on_numeric;
+#else
+	_callbacks.event_connect = event_connect;
+	_callbacks.event_channel = event_channel;
+	_callbacks.event_join = event_join;
+	_callbacks.event_numeric = event_numeric;
+#endif
+
+	registerCommands();
+}
+
+BotController::~BotController()
+{
+	// The worker goes first: its jobs still use the DBs, and any completions
+	// left over would reply on networks that are about to go away.
+	delete _db_worker;
+
+	for(unsigned i = 0; i < _networks.size(); i++)
+		delete _networks[i];
+
+	delete _hostmask_db;
+	closeReaders(_calc_readers);
+	delete _calc_db;
+}
+
+/* Opens one read-only connection per worker thread. All of them must open, or
+   none is kept. */
+bool BotController::openReaders(const std::string& calc_db_filename, std::vector<CalcDB*>& readers)
+{
+	for(unsigned i = 0; i < _db_worker->threadCount(); i++)
+	{
+		CalcDB* reader = new CalcDB(calc_db_filename, 256, CALC_ACCESS_READ_ONLY);
+		readers.push_back(reader);
+
+		if(!reader->isOpen())
+		{
+			std::cerr << "Could not open a read connection to " << calc_db_filename << std::endl;
+			closeReaders(readers);
+			return false;
+		}
+
+		reader->setMetrics(&_metrics);
+	}
+
+	return true;
+}
+
+void BotController::closeReaders(std::vector<CalcDB*>& readers)
+{
+	for(unsigned i = 0; i < readers.size(); i++)
+		delete readers[i];
+
+	readers.clear();
+}
+
+/* The calc DB a read query should use: the calling worker thread's own read
+   connection, or _calc_db when there are none (or in a job that runs alone). */
+CalcDB* BotController::readDb()
+{
+	int thread = DbWorker::currentThread();
+	if(thread < 0 || (unsigned) thread >= _calc_readers.size())
+		return _calc_db;
+
+	return _calc_readers[thread];
+}
+
+/* addNetwork sets up another connection; it is made when run() is called. */
+IrcNetwork* BotController::addNetwork(const std::string& name, const std::string& nick, const std::string& server,
+	const std::vector<std::string>& chanlist, unsigned short port)
+{
+	IrcNetwork* network = new IrcNetwork(this, &_callbacks, &_metrics, name, nick, server, port, chanlist);
+	_networks.push_back(network);
+
+	return network;
+}
+
+bool BotController::run()
+{
+	bool connected = false;
+
+	loadSnapshot();
+
+	for(unsigned i = 0; i < _networks.size(); i++)
+	{
+		if(_networks[i]->connect())
+			connected = true;
+	}
+
+	if(!connected && !_reconnect)
+		return false;
+
+	_running = true;
+
+	// NOTE: Anything after runLoop will not be processed until every connection closes
+	bool result = runLoop();
+	writeSnapshot();
 
-bool BotController::start(const std::string& nick, const std::string& server, const std::vector<std::string>& chanlist)
+	return result;
+}
+
+/* Our own version of irc_run: one poll loop over the sockets of every
+   network, waking up regularly so queued mode changes can be flushed on time and
+   finished DB work can be replied to. While DB work is in flight we poll faster,
+   and while lines are waiting on flood control we wake up when the next may go.
+   A network that drops is reconnected with backoff; with reconnecting turned off
+   it is left out instead, and the loop ends once all have dropped. */
+bool BotController::runLoop()
 {
-	if(_init == false)
+	time_t last_stats = time(0);
+	time_t last_stats_file = time(0);
+	time_t last_config_poll = time(0);
+	time_t last_snapshot = time(0);
+	std::vector<IrcNetwork*> active;
+
+	while(true)
 	{
-		_chanlist = chanlist;
-		_init = true;
+		long timeout_ms = _db_worker->busy() ? 10 : 250;
+
+		_poller.begin();
+
+		active.clear();
+		for(unsigned i = 0; i < _networks.size(); i++)
+		{
+			if(!_networks[i]->isConnected() && _reconnect)
+			{
+				_networks[i]->scheduleReconnect();
+				if(_networks[i]->reconnectDue() && !_networks[i]->reconnect())
+					_networks[i]->scheduleReconnect();
+			}
+
+			if(!_networks[i]->isConnected())
+				continue;
+
+			active.push_back(_networks[i]);
+			_networks[i]->watch(_poller);
+
+			long send_ms = _networks[i]->timeUntilNextSend();
+			if(send_ms >= 0 && send_ms < timeout_ms)
+				timeout_ms = send_ms;
+		}
+
+		if(active.empty() && !_reconnect)
+			break;
+
+		if(active.empty())
+		{
+			// Everyone is waiting to reconnect, and select() won't wait on nothing under winsock.
+			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+		}
+		else if(_poller.wait(timeout_ms) < 0)
+		{
+			std::cout << "poll failed, giving up on all networks." << std::endl;
+			return false;
+		}
+
+		for(unsigned i = 0; i < active.size(); i++)
+		{
+			if(!active[i]->process(_poller))
+				std::cout << "[" << active[i]->getName() << "] i/o error: " << active[i]->getLastError() << std::endl;
+		}
+
+		_db_worker->runCompletions();
+
+		// Nothing is sent on a dead session; its queue is dropped when the reconnect is scheduled.
+		for(unsigned i = 0; i < _networks.size(); i++)
+		{
+			if(!_networks[i]->isConnected())
+				continue;
+
+			_networks[i]->flushModes();
+			_networks[i]->flushOutbound();
+		}
+
+		if(time(0) - last_stats >= OUTBOUND_STATS_INTERVAL)
+		{
+			for(unsigned i = 0; i < _networks.size(); i++)
+				_networks[i]->reportOutboundStats();
+			last_stats = time(0);
+		}
 
-		// Register IRC Event Callbacks
-		memset(&_callbacks, 0, sizeof(_callbacks));
-		_callbacks.event_connect = event_connect;
-		_callbacks.event_channel = event_channel;
-		_callbacks.event_join = event_join;
-		_callbacks.event_numeric = event_numeric;
-		_session = irc_create_session(&_callbacks);
+		if(!_stats_file.empty() && time(0) - last_stats_file >= STATS_FILE_INTERVAL)
+		{
+			writeStats();
+			last_stats_file = time(0);
+		}
 
-		std::cout << "Attempting to connect to server " << server << "." << std::endl;
-		if(irc_connect(_session, server.c_str() ,6667, NULL, nick.c_str(), NULL, NULL))
+		if(_config_watcher.isWatching() && time(0) - last_config_poll >= CONFIG_POLL_INTERVAL)
 		{
-			std::cout << "Could not connect" << irc_strerror(irc_errno(_session)) << std::endl;
+			if(_config_watcher.changed())
+				reloadConfig();
+			last_config_poll = time(0);
 		}
 
-		// NOTE: Anything after irc_run will not be processed until irc_run returns controll
-		if(irc_run(_session))
+		if(time(0) - last_snapshot >= SNAPSHOT_INTERVAL)
+		{
+			writeSnapshot();
+			last_snapshot = time(0);
+		}
+	}
+
+	return true;
+}
+
+/* watchConfig applies the networks in a config file (see BotConfig.h) and keeps
+   checking it while the bot runs. Edits are picked up without reconnecting:
+   channels are joined or parted as the lists change, new networks connect, and
+   changed DB paths are swapped in behind the commands already queued. */
+bool BotController::watchConfig(const std::string& path)
+{
+	BotConfig config;
+	if(!config.load(path))
+		return false;
+
+	_config_watcher.watch(path);
+	applyConfig(config);
+
+	return true;
+}
+
+// A config that fails to load leaves everything as it was.
+void BotController::reloadConfig()
+{
+	std::cout << "Config file " << _config_watcher.getPath() << " changed, reloading." << std::endl;
+
+	BotConfig config;
+	if(config.load(_config_watcher.getPath()))
+		applyConfig(config);
+}
+
+void BotController::applyConfig(const BotConfig& config)
+{
+	std::set<std::string> configured;
+
+	for(unsigned i = 0; i < config.networks.size(); i++)
+	{
+		const NetworkConfig& settings = config.networks[i];
+		configured.insert(settings.name);
+
+		IrcNetwork* network = findNetwork(settings.name);
+		if(!network)
 		{
-			std::cout << "Could not connect or i/o error: " << irc_strerror(irc_errno(_session));
+			network = addNetwork(settings.name, settings.nick, settings.server, settings.channels, settings.port);
+			network->setFloodControl(settings.flood_burst, settings.flood_rate);
+			if(_running)
+				network->connect();
+			continue;
 		}
 
-		return true;
+		if(network->getServer() != settings.server || network->getPort() != settings.port || network->getNick() != settings.nick)
+			std::cout << "[" << settings.name << "] Server and nick changes need a restart to take effect." << std::endl;
+
+		network->setFloodControl(settings.flood_burst, settings.flood_rate);
+		network->setChannels(settings.channels);
+	}
+
+	// Networks can't be removed while completions may still reply on them, so a
+	// network dropped from the config just leaves all its channels.
+	for(unsigned i = 0; i < _networks.size(); i++)
+	{
+		if(!configured.count(_networks[i]->getName()) && !_networks[i]->getChanList().empty())
+		{
+			std::cout << "[" << _networks[i]->getName() << "] No longer configured, leaving all channels." << std::endl;
+			_networks[i]->setChannels(std::vector<std::string>());
+		}
 	}
 
-	return false;
+	if(config.calc_db != _calc_db_filename || config.hostmask_db != _hostmask_db_filename)
+		swapDatabases(config.calc_db, config.hostmask_db);
 }
 
-void BotController::parseMessage(const std::string& chan, const std::string& host, const std::string& msg)
+/* Opens the new databases on the worker, queued behind every command already
+   posted, so each command runs against exactly one set of DBs and none is
+   dropped. Both must open or neither is used. The calc DB and its readers are
+   swapped right there on the worker, which is the only place they are used, in a
+   job that runs alone. The hostmask DB is also
+   read on the IRC thread, so it is swapped by the completion; jobs captured the
+   old pointer when they were posted, so it is deleted by a job queued after them.
+   The filenames only change once the swap has happened, so after a failed open
+   the same paths still count as a change and are tried again on the next reload. */
+void BotController::swapDatabases(const std::string& calc_db_filename, const std::string& hostmask_db_filename)
 {
-	if(!_hostmask_db->isAuthorized(host))
+	std::cout << "Switching to databases " << calc_db_filename << " and " << hostmask_db_filename << std::endl;
+
+	_coalescer.invalidate();
+
+	std::shared_ptr<HostmaskAuthorizer*> opened(new HostmaskAuthorizer*(0));
+
+	_db_worker->post(
+		[this, calc_db_filename, hostmask_db_filename, opened]
+		{
+			CalcDB* calc_db = new CalcDB(calc_db_filename);
+			HostmaskAuthorizer* hostmask_db = new HostmaskAuthorizer(hostmask_db_filename);
+			std::vector<CalcDB*> readers;
+
+			bool readers_open = !calc_db->isOpen() || _calc_readers.empty() || openReaders(calc_db_filename, readers);
+
+			if(!calc_db->isOpen() || !hostmask_db->isOpen() || !readers_open)
+			{
+				std::cerr << "Could not open the new databases, keeping the old ones." << std::endl;
+				closeReaders(readers);
+				delete calc_db;
+				delete hostmask_db;
+				return;
+			}
+
+			calc_db->setMetrics(&_metrics);
+			hostmask_db->setMetrics(&_metrics);
+
+			std::swap(_calc_db, calc_db);
+			_calc_readers.swap(readers);
+			closeReaders(readers);
+			delete calc_db;
+
+			*opened = hostmask_db;
+		},
+		[this, opened, calc_db_filename, hostmask_db_filename]
+		{
+			if(!*opened)
+				return;
+
+			_calc_db_filename = calc_db_filename;
+			_hostmask_db_filename = hostmask_db_filename;
+
+			HostmaskAuthorizer* old_db = _hostmask_db;
+			_hostmask_db = *opened;
+			_db_worker->post([old_db]{ delete old_db; });
+		});
+}
+
+void BotController::describeMetrics()
+{
+	_metrics.describe("ircoptotron_commands_total", METRIC_COUNTER, "Commands dispatched, by command.");
+	_metrics.describe("ircoptotron_commands_limited_total", METRIC_COUNTER, "Commands dropped by the rate limiter, by command.");
+	_metrics.describe("ircoptotron_commands_coalesced_total", METRIC_COUNTER, "Commands answered by an identical request's query, by command.");
+	_metrics.describe("ircoptotron_command_dispatch_seconds", METRIC_SUMMARY, "Time spent in parseMessage on the IRC thread, by command.");
+	_metrics.describe("ircoptotron_command_seconds", METRIC_SUMMARY, "Time from dispatch until the reply is queued, by command.");
+	_metrics.describe("ircoptotron_db_queue_seconds", METRIC_SUMMARY, "Time DB jobs wait for the worker.");
+	_metrics.describe("ircoptotron_db_in_flight", METRIC_GAUGE, "DB jobs queued or running.");
+	_metrics.describe("ircoptotron_calcdb_seconds", METRIC_SUMMARY, "CalcDB call latency, by method.");
+	_metrics.describe("ircoptotron_calcdb_cache_hits_total", METRIC_COUNTER, "Latest-version cache hits.");
+	_metrics.describe("ircoptotron_calcdb_cache_misses_total", METRIC_COUNTER, "Latest-version cache misses.");
+	_metrics.describe("ircoptotron_calcdb_busy_retries_total", METRIC_COUNTER, "Times the calc DB was locked and we waited or retried.");
+	_metrics.describe("ircoptotron_calcdb_cache_invalidations_total", METRIC_COUNTER, "Cached calcs dropped because another connection or process changed them.");
+	_metrics.describe("ircoptotron_hostmaskdb_seconds", METRIC_SUMMARY, "HostmaskAuthorizer call latency, by method.");
+	_metrics.describe("ircoptotron_hostmask_cache_hits_total", METRIC_COUNTER, "Hostmask decision cache hits.");
+	_metrics.describe("ircoptotron_hostmask_cache_misses_total", METRIC_COUNTER, "Hostmask decision cache misses.");
+	_metrics.describe("ircoptotron_outbound_delay_seconds", METRIC_SUMMARY, "Time lines wait in the outbound queue, by network.");
+	_metrics.describe("ircoptotron_outbound_queue_depth", METRIC_GAUGE, "Lines waiting in the outbound queue, by network.");
+	_metrics.describe("ircoptotron_lines_sent_total", METRIC_COUNTER, "Lines sent, by network.");
+	_metrics.describe("ircoptotron_lines_merged_total", METRIC_COUNTER, "Messages folded into an already queued line, by network.");
+	_metrics.describe("ircoptotron_connected", METRIC_GAUGE, "1 while the network is connected.");
+}
+
+/* Samples what isn't recorded as it happens and rewrites the stats file. CalcDB's
+   counters belong to the worker thread, so they are copied over by a job there
+   and show up in the next file. */
+void BotController::writeStats()
+{
+	for(unsigned i = 0; i < _networks.size(); i++)
+		_networks[i]->updateMetrics();
+
+	_metrics.setGauge("ircoptotron_db_in_flight", "", (double) _db_worker->inFlight());
+	_metrics.setCounter("ircoptotron_hostmask_cache_hits_total", "", (double) _hostmask_db->getCacheHits());
+	_metrics.setCounter("ircoptotron_hostmask_cache_misses_total", "", (double) _hostmask_db->getCacheMisses());
+
+	_db_worker->post([this]
+	{
+		unsigned long hits = _calc_db->getCacheHits();
+		unsigned long misses = _calc_db->getCacheMisses();
+		unsigned long retries = _calc_db->getBusyRetries();
+		unsigned long invalidations = _calc_db->getInvalidations();
+
+		for(unsigned i = 0; i < _calc_readers.size(); i++)
+		{
+			hits += _calc_readers[i]->getCacheHits();
+			misses += _calc_readers[i]->getCacheMisses();
+			retries += _calc_readers[i]->getBusyRetries();
+			invalidations += _calc_readers[i]->getInvalidations();
+		}
+
+		_metrics.setCounter("ircoptotron_calcdb_cache_hits_total", "", (double) hits);
+		_metrics.setCounter("ircoptotron_calcdb_cache_misses_total", "", (double) misses);
+		_metrics.setCounter("ircoptotron_calcdb_busy_retries_total", "", (double) retries);
+		_metrics.setCounter("ircoptotron_calcdb_cache_invalidations_total", "", (double) invalidations);
+	});
+
+	if(!_metrics.writeFile(_stats_file))
+		std::cerr << "Could not write stats file " << _stats_file << std::endl;
+}
+
+/* Metrics are written to path every few seconds in the Prometheus text format, for
+   node_exporter's textfile collector or anything else that can read a file. An
+   empty path turns the file off. */
+void BotController::setStatsFile(const std::string& path)
+{
+	_stats_file = path;
+}
+
+/* The channel snapshot (see ChannelSnapshot.h) is loaded from path when run() starts
+   and saved every minute it has changed, so ops can be given back straight after
+   a restart as well as a reconnect. An empty path keeps it in memory only. */
+void BotController::setSnapshotFile(const std::string& path)
+{
+	_snapshot_file = path;
+}
+
+/* Identical lookups in a channel within window_ms share one query. With
+   suppress_repeats off, each duplicate still gets its own copy of the reply. */
+void BotController::setCoalescing(unsigned window_ms, bool suppress_repeats)
+{
+	_coalescer.setWindow(window_ms);
+	_coalescer.setSuppressRepeats(suppress_repeats);
+}
+
+// On by default. Without it, a network that drops stays down.
+void BotController::setReconnect(bool reconnect)
+{
+	_reconnect = reconnect;
+}
+
+void BotController::loadSnapshot()
+{
+	if(_snapshot_file.empty())
 		return;
 
-	std::vector<std::string> tokens = MiscStringHelpers::tokenizeString(msg,' ');
-	std::string cmd = tokens.at(0);
+	std::ifstream file(_snapshot_file.c_str());
+	if(!file)
+		return;
 
-	for(unsigned i = 0; i < cmd.length(); i++)
-		cmd[i] = tolower(cmd[i]);
+	std::string line, network_name, chan;
+	SnapshotMember member;
+	unsigned long loaded = 0;
 
-	if(cmd == "calc")                             
+	while(std::getline(file, line))
 	{
-		doCalc(chan, host, tokens);
+		if(!ChannelSnapshot::parseLine(line, network_name, chan, member))
+			continue;
+
+		IrcNetwork* network = findNetwork(network_name);
+		if(!network)
+			continue;
+
+		network->getSnapshot().update(chan, member.nick, member.host, member.decision);
+		loaded++;
 	}
-	else if(cmd == "chcalc")
+
+	std::cout << "Loaded " << loaded << " channel members from " << _snapshot_file << std::endl;
+}
+
+/* Written next to the snapshot file and renamed over it, like the stats file. */
+void BotController::writeSnapshot()
+{
+	if(_snapshot_file.empty())
+		return;
+
+	bool dirty = false;
+	for(unsigned i = 0; i < _networks.size(); i++)
+		dirty = dirty || _networks[i]->getSnapshot().isDirty();
+
+	if(!dirty)
+		return;
+
+	std::string temp_path = _snapshot_file + ".tmp";
+
 	{
-		std::vector<std::string> chcalc_params = MiscStringHelpers::tokenizeString(msg,'=');
-		doChangeCalc(chan, host, chcalc_params);
+		std::ofstream file(temp_path.c_str(), std::ios::out | std::ios::trunc);
+		for(unsigned i = 0; i < _networks.size(); i++)
+			_networks[i]->getSnapshot().write(file, _networks[i]->getName());
+
+		if(!file)
+		{
+			std::cerr << "Could not write snapshot file " << temp_path << std::endl;
+			return;
+		}
 	}
-	else if(cmd == "rmcalc")
+
+#ifdef _WIN32
+	remove(_snapshot_file.c_str());
+#endif
+
+	if(rename(temp_path.c_str(), _snapshot_file.c_str()) != 0)
+		std::cerr << "Could not replace snapshot file " << _snapshot_file << std::endl;
+}
+
+Metrics& BotController::getMetrics()
+{
+	return _metrics;
+}
+
+IrcNetwork* BotController::findNetwork(const std::string& name)
+{
+	for(unsigned i = 0; i < _networks.size(); i++)
 	{
-		doCalcRemove(chan, host, tokens);
+		if(_networks[i]->getName() == name)
+			return _networks[i];
 	}
-	else if(cmd == "mkcalc")
+
+	return 0;
+}
+
+/* Appends every event the callbacks see, on every network, to path (see
+   TrafficLog.h for the format), so it can be fed back through replayTraffic. */
+bool BotController::recordTraffic(const std::string& path)
+{
+	if(!_recorder.open(path))
 	{
-		std::vector<std::string> mkcalc_params = MiscStringHelpers::tokenizeString(msg,'=');
-		doMakeCalc(chan, host, mkcalc_params);
+		std::cerr << "Could not open traffic log " << path << std::endl;
+		return false;
 	}
-	else if(cmd == "version")
+
+	return true;
+}
+
+void BotController::recordEvent(IrcNetwork& network, const char* event, const char* origin, const char** params, unsigned int count)
+{
+	if(_recorder.isOpen())
+		_recorder.record(network.getName(), event, origin, params, count);
+}
+
+/* replayTraffic feeds a recorded log through the same callbacks a live session
+   uses, as fast as they will take it. Each network in the log gets a session that
+   is never connected, so everything we would send is dropped by libircclient,
+   and flood control and rate limits are lifted so they don't hold the replay
+   back. DB work really runs: replay against a copy of the databases. Prints
+   events per second and per-command latency when the log is done. */
+bool BotController::replayTraffic(const std::string& path)
+{
+	std::vector<TrafficEvent> events;
+	if(!TrafficReader::readAll(path, events))
 	{
-		doCalcVersion(chan, host, tokens);
+		std::cerr << "Could not read traffic log " << path << std::endl;
+		return false;
 	}
-	else if(cmd == "apropos")
+
+	setRateLimits(1e9, 1e9, 1e9, 1e9);
+
+	std::vector<const char*> params;
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+	for(unsigned i = 0; i < events.size(); i++)
 	{
-		doCalcApropos(chan, host, tokens);
+		const TrafficEvent& event = events[i];
+
+		IrcNetwork* network = findNetwork(event.network);
+		if(!network)
+		{
+			network = addNetwork(event.network, "replay", "", std::vector<std::string>());
+			network->setFloodControl(1e9, 1e9);
+		}
+
+		params.clear();
+		for(unsigned p = 0; p < event.params.size(); p++)
+			params.push_back(event.params[p].c_str());
+
+		const char* origin = event.origin.c_str();
+		const char** param_array = params.empty() ? 0 : &params[0];
+		unsigned int count = params.size();
+
+		if(event.event == "CHANNEL")
+			on_channel(network, event.event.c_str(), origin, param_array, count);
+		else if(event.event == "JOIN")
+			on_join(network, event.event.c_str(), origin, param_array, count);
+		else if(event.event == "CONNECT")
+			on_connect(network, event.event.c_str(), origin, param_array, count);
+		else if(isdigit(event.event[0]))
+			on_numeric(network, atoi(event.event.c_str()), origin, param_array, count);
+
+		if(i % REPLAY_COMPLETION_INTERVAL == 0)
+		{
+			_db_worker->runCompletions();
+			for(unsigned n = 0; n < _networks.size(); n++)
+			{
+				_networks[n]->flushModes();
+				_networks[n]->flushOutbound();
+			}
+		}
 	}
-	else if(cmd == "apropos_all")
+
+	// Wait out whatever DB work the tail of the log started.
+	while(_db_worker->busy())
 	{
-		doCalcAproposAll(chan, host, tokens);
+		_db_worker->runCompletions();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	}
-	else if(cmd == "view_hostmasks_for")   
+
+	for(unsigned n = 0; n < _networks.size(); n++)
 	{
-		viewHostmasksFor(chan, host, tokens);
+		_networks[n]->flushModes();
+		_networks[n]->flushOutbound();
 	}
-	else if(cmd == "rm_hostmask")
+
+	reportReplay(events.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+
+	return true;
+}
+
+void BotController::reportReplay(size_t events, double seconds)
+{
+	std::cout << "Replayed " << events << " events in " << seconds * 1000 << "ms ("
+		<< (seconds > 0 ? events / seconds : 0) << " events/s)" << std::endl;
+
+	std::vector<std::string> commands = _metrics.getLabels("ircoptotron_command_dispatch_seconds");
+	for(unsigned i = 0; i < commands.size(); i++)
 	{
-		rmHostmask(chan, host, tokens);
+		unsigned long count, total_count;
+		double p50, p99, max, total_p50, total_p99, total_max;
+
+		if(!_metrics.getSummary("ircoptotron_command_dispatch_seconds", commands[i], count, p50, p99, max))
+			continue;
+
+		std::cout << "  " << commands[i] << ": " << count << " dispatched"
+			<< ", dispatch p50 " << p50 * 1000 << "ms p99 " << p99 * 1000 << "ms max " << max * 1000 << "ms";
+
+		if(_metrics.getSummary("ircoptotron_command_seconds", commands[i], total_count, total_p50, total_p99, total_max))
+		{
+			std::cout << ", to reply p50 " << total_p50 * 1000 << "ms p99 " << total_p99 * 1000
+				<< "ms max " << total_max * 1000 << "ms";
+		}
+
+		std::cout << std::endl;
 	}
-	else if(cmd == "add_hostmask")
+}
+
+CommandHandler BotController::bindHandler(MemberHandler handler)
+{
+	return [this, handler](IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 	{
-		addHostmask(chan, host, tokens);
+		(this->*handler)(network, chan, host, params);
+	};
+}
+
+void BotController::registerCommands()
+{
+	_commands.add("calc", Command(bindHandler(&BotController::doCalc), 2, PERMISSION_AUTHORIZED, ' ', "Usage: calc keyword"));
+	_commands.add("chcalc", Command(bindHandler(&BotController::doChangeCalc), 2, PERMISSION_AUTHORIZED, '=', "Usage: chcalc keyword = newcalc", 2));
+	_commands.add("rmcalc", Command(bindHandler(&BotController::doCalcRemove), 2, PERMISSION_AUTHORIZED, ' ', "Usage: rmcalc keyword", 2));
+	_commands.add("mkcalc", Command(bindHandler(&BotController::doMakeCalc), 2, PERMISSION_AUTHORIZED, '=', "Usage: mkcalc keyword = newcalc", 2));
+	_commands.add("version", Command(bindHandler(&BotController::doCalcVersion), 3, PERMISSION_AUTHORIZED, ' ', "Usage: version [-]version keyword"));
+	_commands.add("apropos", Command(bindHandler(&BotController::doCalcApropos), 2, PERMISSION_AUTHORIZED, ' ', "Usage: apropos search_term", 10));
+	_commands.add("apropos_all", Command(bindHandler(&BotController::doCalcAproposAll), 2, PERMISSION_AUTHORIZED, ' ', "Usage: apropos search_term", 10));
+	_commands.add("view_hostmasks_for", Command(bindHandler(&BotController::viewHostmasksFor), 3, PERMISSION_AUTHORIZED, ' ', "Usage: view_hostmasks_for [nick] [authorized|banned]", 5));
+	_commands.add("rm_hostmask", Command(bindHandler(&BotController::rmHostmask), 3, PERMISSION_AUTHORIZED, ' ', "Usage: rm_hostmask [id] [authorized|banned]", 2));
+	_commands.add("add_hostmask", Command(bindHandler(&BotController::addHostmask), 4, PERMISSION_AUTHORIZED, ' ', "Usage: add_hostmask [nick] [mask] [authorized|banned]", 2));
+}
+
+/* Registers an extra command, either everywhere or (with chan) for one channel,
+   where it overrides a global command of the same name. */
+void BotController::registerCommand(const std::string& name, const Command& command, const std::string& chan)
+{
+	if(chan.empty())
+		_commands.add(name, command);
+	else
+		_commands.addForChannel(chan, name, command);
+}
+
+/* parseMessage works straight on the buffers libircclient hands to event_channel.
+   Lines that aren't commands are turned away after looking at their first word,
+   without copying anything; commands are split into slices over msg, reusing
+   _params, so the only copies made are the ones a handler keeps. */
+void BotController::parseMessage(IrcNetwork& network, const char* chan, const char* host, const char* msg)
+{
+	const char* start = msg;
+	while(*start == ' ')
+		start++;
+
+	if(*start == '\0')
+		return;
+
+	const char* end = start;
+	while(*end != '\0' && *end != ' ')
+		end++;
+
+	size_t length = end - start;
+	if(length > _commands.longestName())
+		return;
+
+	// Command names are short enough for the small string buffer, so this doesn't allocate.
+	std::string cmd(start, length);
+
+	for(unsigned i = 0; i < cmd.length(); i++)
+		cmd[i] = tolower(cmd[i]);
+
+	const Command* command = _commands.find(chan, cmd);
+	if(!command)
+		return;
+
+	std::string host_str = host;
+
+	if(command->permission == PERMISSION_AUTHORIZED && _hostmask_db->getDecision(host_str) != HOSTMASK_DECISION_AUTHORIZED)
+		return;
+
+	// DB jobs posted by the handler pick this up to label their own timings.
+	_current_command = Metrics::label("command", cmd);
+	ScopedTimer timer(&_metrics, "ircoptotron_command_dispatch_seconds", _current_command.c_str());
+
+	std::string chan_str = chan;
+
+	// Charged before the usage check too, since a usage reply costs us a line as well.
+	if(!checkRateLimits(network, chan_str, host_str, *command))
+	{
+		_metrics.increment("ircoptotron_commands_limited_total", _current_command);
+		return;
 	}
+
+	MiscStringHelpers::tokenizeString(StringSlice(msg, strlen(msg)), command->delimiter, _params);
+	if(_params.size() < command->min_params)
+	{
+		network.sendMessageToNick(chan_str, command->usage);
+		return;
+	}
+
+	_metrics.increment("ircoptotron_commands_total", _current_command);
+	command->handler(network, chan_str, host_str, _params);
+}
+
+/* checkRateLimits holds a command against both its sender's and its channel's
+   budget, and only charges them if both allow it. Users are keyed by user@host
+   so changing nick doesn't buy a fresh budget. A refused command is dropped;
+   only the first refusal in a row gets a notice, so the notice can't be used to
+   flood either. */
+bool BotController::checkRateLimits(IrcNetwork& network, const std::string& chan, const std::string& host, const Command& command)
+{
+	size_t bang = host.find('!');
+	std::string user_key = network.getName() + " " + (bang == std::string::npos ? host : host.substr(bang + 1));
+	std::string channel_key = network.getName() + " " + chan;
+
+	RateDecision user = _user_limiter.check(user_key, command.cost);
+	if(user != RATE_ALLOWED)
+	{
+		if(user == RATE_LIMITED)
+			network.sendMessageToHost(host, "You're sending commands too fast, slow down a little.");
+		return false;
+	}
+
+	RateDecision channel = _channel_limiter.check(channel_key, command.cost);
+	if(channel != RATE_ALLOWED)
+	{
+		if(channel == RATE_LIMITED)
+			network.sendMessageToNick(chan, "Too many commands in " + chan + " right now, try again shortly.");
+		return false;
+	}
+
+	_user_limiter.charge(user_key, command.cost);
+	_channel_limiter.charge(channel_key, command.cost);
+
+	return true;
 }
 
+/* Limits are in command cost: calc costs 1, apropos 10. */
+void BotController::setRateLimits(double user_burst, double user_rate, double channel_burst, double channel_rate)
+{
+	_user_limiter.setLimits(user_burst, user_rate);
+	_channel_limiter.setLimits(channel_burst, channel_rate);
+}
 
-std::vector<std::string> BotController::getChanList()
+/* queryDb runs work on the DB worker. Once the IRC thread picks up the
+   completion, reply says what to answer and those lines are sent to chan, on the
+   network the command came from. Handlers don't call this directly but await a
+   DbAwait from readCalc(), writeCalc() or useHostmasks(). How long the job queued and how long the whole command took
+   are recorded against the command being dispatched. With coalesced, the replies
+   are also kept there for identical requests (see queryDbCoalesced). A read_only
+   query only touches the calc DB, through readDb(), and may run alongside
+   queries from other channels; those from the same channel still run, and are
+   answered, in order. If it finds another process changed calcs, answers kept
+   for coalescing are dropped too. */
+void BotController::queryDb(IrcNetwork& network, const std::string& chan, const DbWork& work, const DbReply& reply, OutboundPriority priority,
+	const std::shared_ptr<CoalescedRequest>& coalesced, bool read_only)
 {
-	return _chanlist;
+	std::shared_ptr<std::vector<std::string> > replies(new std::vector<std::string>());
+	IrcNetwork* reply_network = &network;
+	Metrics* metrics = &_metrics;
+	ResponseCoalescer* coalescer = &_coalescer;
+	std::string labels = _current_command;
+	std::chrono::steady_clock::time_point posted = std::chrono::steady_clock::now();
+	std::shared_ptr<bool> outside_change(new bool(false));
+
+	DbWorker::Task job = [this, work, metrics, posted, read_only, outside_change]
+	{
+		metrics->observe("ircoptotron_db_queue_seconds", "", std::chrono::duration<double>(std::chrono::steady_clock::now() - posted).count());
+
+		// Only calc lookups can notice an outside change; hostmask jobs never look.
+		if(!read_only)
+		{
+			work();
+			return;
+		}
+
+		CalcDB* calc_db = readDb();
+		unsigned long invalidations = calc_db->getInvalidations();
+
+		work();
+
+		*outside_change = calc_db->getInvalidations() != invalidations;
+	};
+
+	DbWorker::Task done = [reply_network, chan, reply, replies, priority, metrics, labels, posted, coalescer, coalesced, outside_change]
+	{
+		reply(*replies);
+
+		if(*outside_change)
+			coalescer->invalidate();
+
+		unsigned copies = 1;
+		if(coalesced)
+		{
+			coalescer->finish(*coalesced, *replies);
+			if(!coalescer->suppressesRepeats())
+				copies += coalesced->waiters;
+		}
+
+		for(unsigned copy = 0; copy < copies; copy++)
+			reply_network->sendReplyToNick(chan, *replies, priority);
+
+		metrics->observe("ircoptotron_command_seconds", labels, std::chrono::duration<double>(std::chrono::steady_clock::now() - posted).count());
+	};
+
+	if(read_only)
+		_db_worker->postRead(network.getName() + " " + chan, job, done);
+	else
+		_db_worker->post(job, done);
 }
 
-void BotController::sendMessageToHost(const std::string& host, const std::string& msg)
+/* queryDbCoalesced is queryDb for read-only lookups that people tend to repeat
+   all at once, e.g. a calc for a link that was just pasted. args is whatever the
+   handler will look up; together with the network, channel and command it says
+   whether two requests are the same. Only the first of a burst reaches the DB. */
+void BotController::queryDbCoalesced(IrcNetwork& network, const std::string& chan, const std::string& args, const DbWork& work, const DbReply& reply)
 {
-	char true_nick[256];
-	irc_target_get_nick(host.c_str(), true_nick, 256);
-	irc_cmd_msg(_session, true_nick, msg.c_str());
+	std::string key = ResponseCoalescer::makeKey(network.getName(), chan, _current_command, args);
+
+	std::shared_ptr<CoalescedRequest> request = _coalescer.find(key);
+	if(!request)
+	{
+		queryDb(network, chan, work, reply, PRIORITY_REPLY, _coalescer.start(key), true);
+		return;
+	}
+
+	_metrics.increment("ircoptotron_commands_coalesced_total", _current_command);
+
+	if(!request->done)
+	{
+		request->waiters++;
+		return;
+	}
+
+	if(_coalescer.suppressesRepeats())
+		return;
+
+	network.sendReplyToNick(chan, request->replies);
 }
 
-void BotController::sendMessageToNick(const std::string& nick, const std::string& msg)
+/* writeDb is queryDb for calc edits. The edit joins the current group commit and
+   its replies are only sent once the batch is on disk. Lookups already answered
+   or in flight may not see it, so none of them are reused after this. */
+void BotController::writeDb(IrcNetwork& network, const std::string& chan, const DbWork& work, const DbReply& reply)
 {
-	irc_cmd_msg(_session, nick.c_str(), msg.c_str());
+	_coalescer.invalidate();
+
+	std::shared_ptr<std::vector<std::string> > replies(new std::vector<std::string>());
+	IrcNetwork* reply_network = &network;
+	Metrics* metrics = &_metrics;
+	std::string labels = _current_command;
+	std::chrono::steady_clock::time_point posted = std::chrono::steady_clock::now();
+
+	_db_worker->postWrite(
+		[work, metrics, posted]
+		{
+			metrics->observe("ircoptotron_db_queue_seconds", "", std::chrono::duration<double>(std::chrono::steady_clock::now() - posted).count());
+			work();
+		},
+		[reply_network, chan, reply, replies, metrics, labels, posted]
+		{
+			reply(*replies);
+			reply_network->sendReplyToNick(chan, *replies);
+
+			metrics->observe("ircoptotron_command_seconds", labels, std::chrono::duration<double>(std::chrono::steady_clock::now() - posted).count());
+		},
+		[reply_network, chan]{ reply_network->sendMessageToNick(chan, "CalcDB could not lock DB for writing, busy."); });
 }
 
 
 // COMMAND IMPLEMENTATIONS  ----------------------------------------------------
 
 /* doUserJoined is called when a user joins a channel. It checks our sqlite database to 
-   see if that users hostmask is authorized, and if he is, he's auto-oped. */
-void BotController::doUserJoined(const std::string& chan, const std::string& host)
+   see if that users hostmask is authorized, and if so, queues them to be auto-oped.
+   Queued modes go out packed into as few MODE lines as the server allows. */
+void BotController::doUserJoined(IrcNetwork& network, const std::string& chan, const std::string& host)
 {
-	char nick[32];
-	irc_target_get_nick(host.c_str(), nick, 32);
+	std::string nick = MiscStringHelpers::nickFromHost(host);
+
+	HostmaskDecision decision = _hostmask_db->getDecision(host);
+	network.getSnapshot().update(chan, nick, host, decision);
 
-	if(_hostmask_db->isAuthorized(host))
+	applyDecision(network, chan, nick, decision);
+}
+
+void BotController::applyDecision(IrcNetwork& network, const std::string& chan, const std::string& nick, HostmaskDecision decision)
+{
+	if(decision == HOSTMASK_DECISION_AUTHORIZED)
 	{
-		std::string opcmd = "+o " + std::string(nick);
-		irc_cmd_channel_mode(_session, chan.c_str(), opcmd.c_str());
+		network.queueMode(chan, 'o', nick);
 	}
-	else if(_hostmask_db->isBanned(host))
+	else if(decision == HOSTMASK_DECISION_BANNED)
 	{
-		std::string opcmd = "+b " + std::string(nick);
-		irc_cmd_channel_mode(_session, chan.c_str(), opcmd.c_str());
+		network.queueMode(chan, 'b', nick);
 	}
 }
 
-void BotController::doCalc(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doCalc(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	std::string response;
-	std::string msg;
 	std::string keyword = MiscStringHelpers::detokenizeString(params, ' ', 1);
 
-	if(params.size() == 1)
+	readCalc<CalcAnswer>(network, chan, keyword, [keyword](CalcDB& calc_db)
 	{
-		msg = "Usage: calc keyword";
-	}
-	else if(params.size() >= 2)
+		CalcAnswer answer;
+		answer.response = calc_db.getCalc(keyword, answer.calc);
+		return answer;
+	})
+	.then([keyword](const CalcAnswer& answer, std::vector<std::string>& replies)
 	{
-		if(_calc_db->getCalc(keyword, response) == CALC_RESPONSE_OK)
+		std::string msg;
+
+		if(answer.response == CALC_RESPONSE_OK)
 		{
-			msg = keyword + " = " + response;
+			msg = keyword + " = " + answer.calc;
 		}
 		else 
 		{
 			msg = "Calc '" + keyword + "' not found.";
 		}
-	}
 
-	sendMessageToNick(chan, msg);
+		replies.push_back(msg);
+	});
 }
 
-void BotController::doCalcVersion(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doCalcVersion(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	std::string response;
-	std::string msg1, msg2;
 	std::string keyword = MiscStringHelpers::detokenizeString(params, ' ', 2);
+	std::string str_version = params[1].str();
+	int version = atoi(str_version.c_str());
 
-	int version = atoi(params[1].c_str());
-	
-	if(params.size() == 1 || params.size() == 2)
+	// The calc and its version info come back from one query (see CalcDB::getCalcVersion).
+	readCalc<CalcAnswer>(network, chan, str_version + " " + keyword, [keyword, version](CalcDB& calc_db)
 	{
-		msg1 = "Usage: version [-]version keyword";
-	}
-	else if(params.size() > 2)
+		CalcAnswer answer;
+		answer.response = calc_db.getCalcVersion(keyword, version, answer.calc, answer.info);
+		return answer;
+	})
+	.then([keyword, str_version](const CalcAnswer& answer, std::vector<std::string>& replies)
 	{
-		if(_calc_db->getVersionInfo(keyword, version, response) == CALC_RESPONSE_OK)
+		if(answer.response == CALC_RESPONSE_OK)
 		{
-			msg1 = response;
-			if(_calc_db->getCalc(keyword, version, response) == CALC_RESPONSE_OK)
-			{
-				msg2 = keyword + " v" + params[1] + " = " + response;
-			}
+			replies.push_back(answer.info);
+			replies.push_back(keyword + " v" + str_version + " = " + answer.calc);
 		}
 		else
 		{
-			msg1 = "Calc '" + keyword + "' v" + params[1] + " not found.";
+			replies.push_back("Calc '" + keyword + "' v" + str_version + " not found.");
 		}
-	}
-
-	sendMessageToNick(chan, msg1);
-	if(msg2.size() > 0) sendMessageToNick(chan, msg2);
+	});
 }
 
-void BotController::doCalcApropos(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doCalcApropos(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	std::string response;
-	std::string msg;
 	std::string searchterm = MiscStringHelpers::detokenizeString(params, ' ', 1);
 
-	if(params.size() == 1)
+	readCalc<CalcAnswer>(network, chan, searchterm, [searchterm](CalcDB& calc_db)
 	{
-		msg = "Usage: apropos search_term";
-	}
-	else if(params.size() >= 2)
+		CalcAnswer answer;
+		answer.response = calc_db.apropos(searchterm, answer.calc);
+		return answer;
+	})
+	.then([searchterm](const CalcAnswer& answer, std::vector<std::string>& replies)
 	{
-		if(_calc_db->apropos(searchterm, response) != CALC_RESPONSE_NOSEARCHMATCHES)
+		std::string msg;
+
+		if(answer.response != CALC_RESPONSE_NOSEARCHMATCHES)
 		{
-			msg = "Search results for '"+searchterm+"': "+response;
+			msg = "Search results for '"+searchterm+"': "+answer.calc;
 		}
 		else
 		{
 			msg = "No matches found for '"+searchterm+"'.";
 		}
-	}
 	
-	sendMessageToNick(chan, msg);
+		replies.push_back(msg);
+	});
 }
 
-void BotController::doCalcAproposAll(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doCalcAproposAll(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	std::string response;
-	std::string msg;
 	std::string searchterm = MiscStringHelpers::detokenizeString(params, ' ', 1);
 
-	if(params.size() == 1)
+	readCalc<CalcAnswer>(network, chan, searchterm, [searchterm](CalcDB& calc_db)
 	{
-		msg = "Usage: apropos search_term";
-	}
-	else if(params.size() >= 2)
+		CalcAnswer answer;
+		answer.response = calc_db.apropos_all(searchterm, answer.calc);
+		return answer;
+	})
+	.then([searchterm](const CalcAnswer& answer, std::vector<std::string>& replies)
 	{
-		if(_calc_db->apropos_all(searchterm, response) != CALC_RESPONSE_NOSEARCHMATCHES)
+		std::string msg;
+
+		if(answer.response != CALC_RESPONSE_NOSEARCHMATCHES)
 		{
-			msg = "Search results for '"+searchterm+"': "+response;
+			msg = "Search results for '"+searchterm+"': "+answer.calc;
 		}
 		else
 		{
 			msg = "No matches found for '"+searchterm+"'.";
 		}
-	}
 	
-	sendMessageToNick(chan, msg);
+		replies.push_back(msg);
+	});
 }
 
-void BotController::doCalcRemove(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doCalcRemove(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	std::string response;
-	std::string msg;
 	std::string keyword = MiscStringHelpers::detokenizeString(params, ' ', 1);
 
-	if(params.size() == 1)
+	writeCalc<CalcResponse>(network, chan, [keyword](CalcDB& calc_db)
 	{
-		msg = "Usage: rmcalc keyword";
-	}
-	else if(params.size() >= 2)
+		return calc_db.removeCalc(keyword);
+	})
+	.then([keyword](const CalcResponse& r, std::vector<std::string>& replies)
 	{
-		if(_calc_db->removeCalc(keyword) != CALC_RESPONSE_NOCALC)
+		std::string msg;
+
+		if(r != CALC_RESPONSE_NOCALC)
 		{
 			msg = "Calc '" + keyword + "' has been deleted.";
 		}
@@ -296,34 +1148,38 @@ void BotController::doCalcRemove(const std::string& chan, const std::string& hos
 		{
 			msg = "Calc '" + keyword + "' not found.";
 		}
-	}
 
-	sendMessageToNick(chan, msg);
+		replies.push_back(msg);
+	});
 }
 
-void BotController::doChangeCalc(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doChangeCalc(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	char nick[256];
-	irc_target_get_nick(host.c_str(), nick, 256);
-
-	std::string response;
-	std::string msg;
-	std::string keyword;
-	std::string newcalc;
+	std::string nick = MiscStringHelpers::nickFromHost(host);
 
 	if(params.size() != 2)
 	{
-		msg = "Usage: chcalc keyword = newcalc";
+		network.sendMessageToNick(chan, "Usage: chcalc keyword = newcalc");
+		return;
 	}
-	else
+
+	std::vector<StringSlice> words;
+	MiscStringHelpers::tokenizeString(params[0], ' ', words);
+
+	std::string keyword = MiscStringHelpers::detokenizeString(words, ' ', 1);
+	std::string newcalc = params[1].str();
+
+	writeCalc<CalcResponse>(network, chan, [nick, keyword, newcalc](CalcDB& calc_db)
+	{
+		return calc_db.changeCalc(keyword, newcalc, nick);
+	})
+	.then([nick, keyword](const CalcResponse& r, std::vector<std::string>& replies)
 	{
-		keyword = MiscStringHelpers::detokenizeString(MiscStringHelpers::tokenizeString(params[0], ' '), ' ', 1);
-		newcalc = params[1];
+		std::string msg;
 
-		CalcResponse r = _calc_db->changeCalc(keyword, newcalc, std::string(nick));
 		if(r == CALC_RESPONSE_CALCCHANGED)
 		{
-			msg = "Calc " + keyword + " changed by " + std::string(nick);
+			msg = "Calc " + keyword + " changed by " + nick;
 		}
 		else if(r == CALC_RESPONSE_DBBUSY)
 		{
@@ -333,34 +1189,38 @@ void BotController::doChangeCalc(const std::string& chan, const std::string& hos
 		{
 			msg = "Calc " + keyword + " does not exist";
 		}
-	}
 
-	sendMessageToNick(chan, msg);
+		replies.push_back(msg);
+	});
 }
 
-void BotController::doMakeCalc(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::doMakeCalc(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
-	char nick[256];
-	irc_target_get_nick(host.c_str(), nick, 256);
-
-	std::string response;
-	std::string msg;
-	std::string keyword;
-	std::string newcalc;
+	std::string nick = MiscStringHelpers::nickFromHost(host);
 
 	if(params.size() != 2)
 	{
-		msg = "Usage: mkcalc keyword = newcalc";
+		network.sendMessageToNick(chan, "Usage: mkcalc keyword = newcalc");
+		return;
 	}
-	else
+
+	std::vector<StringSlice> words;
+	MiscStringHelpers::tokenizeString(params[0], ' ', words);
+
+	std::string keyword = MiscStringHelpers::detokenizeString(words, ' ', 1);
+	std::string newcalc = params[1].str();
+
+	writeCalc<CalcResponse>(network, chan, [nick, keyword, newcalc](CalcDB& calc_db)
+	{
+		return calc_db.makeCalc(keyword, newcalc, nick);
+	})
+	.then([nick, keyword](const CalcResponse& r, std::vector<std::string>& replies)
 	{
-		keyword = MiscStringHelpers::detokenizeString(MiscStringHelpers::tokenizeString(params[0], ' '), ' ', 1);
-		newcalc = params[1];
+		std::string msg;
 
-		CalcResponse r = _calc_db->makeCalc(keyword, newcalc, std::string(nick));
 		if(r == CALC_RESPONSE_CALCCHANGED)
 		{
-			msg = "Calc " + keyword + " added by " + std::string(nick);
+			msg = "Calc " + keyword + " added by " + nick;
 		}
 		else if(r == CALC_RESPONSE_DBBUSY)
 		{
@@ -370,26 +1230,17 @@ void BotController::doMakeCalc(const std::string& chan, const std::string& host,
 		{
 			msg = "Calc " + keyword + " already exists (use chcalc)";
 		}
-	}
 
-	sendMessageToNick(chan, msg);
+		replies.push_back(msg);
+	});
 }
 
-void BotController::viewHostmasksFor(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::viewHostmasksFor(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
 	std::string msg;
 	
-	if(params.size() < 3)
-	{
-		msg = "Usage: view_hostmasks_for [nick] [authorized|banned]";
-		sendMessageToNick(chan, msg);
-		return;
-	}
-
-	std::string nick = params[1];
-	std::string type = params[2];
-	
-	std::vector<std::string> hostmasks;
+	std::string nick = params[1].str();
+	std::string type = params[2].str();
 	
 	HostmaskType hostmask_type = HOSTMASK_AUTHORIZED;
 
@@ -400,47 +1251,41 @@ void BotController::viewHostmasksFor(const std::string& chan, const std::string&
 	else
 	{
 		msg = type + " is not a valid hostmask type.";
-		sendMessageToNick(chan, msg);
+		network.sendMessageToNick(chan, msg);
 		return;
 	}
 
-	_hostmask_db->getHostmasksByNick(nick, hostmask_type, hostmasks);
-
-	if(hostmasks.size() == 0)
+	useHostmasks<std::vector<std::string> >(network, chan, [nick, hostmask_type](HostmaskAuthorizer& hostmask_db)
 	{
-		msg = "Nick '"+nick+"' has no "+type+" hostmasks.";
-		sendMessageToNick(chan,msg);
-		return;
-	}
-	else
+		std::vector<std::string> hostmasks;
+		hostmask_db.getHostmasksByNick(nick, hostmask_type, hostmasks);
+		return hostmasks;
+	}, PRIORITY_BULK)
+	.then([nick, type](const std::vector<std::string>& hostmasks, std::vector<std::string>& replies)
 	{
-		msg = "Displaying "+type+" hostmasks for '"+nick+"': ";
-		sendMessageToNick(chan, msg);
+		if(hostmasks.size() == 0)
+		{
+			replies.push_back("Nick '"+nick+"' has no "+type+" hostmasks.");
+			return;
+		}
+
+		replies.push_back("Displaying "+type+" hostmasks for '"+nick+"': ");
 
 		for(unsigned i = 0; i < hostmasks.size(); i++)
 		{
-			msg = "  "+hostmasks[i];
-			sendMessageToNick(chan, msg);
+			replies.push_back("  "+hostmasks[i]);
 		}
 
-		msg = "Use rm_hostmask [id] [authorized|banned] to remove a hostmask.";
-		sendMessageToNick(chan, msg);
-	}
+		replies.push_back("Use rm_hostmask [id] [authorized|banned] to remove a hostmask.");
+	});
 }
 
-void BotController::rmHostmask(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::rmHostmask(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
 	std::string msg;
 	
-	if(params.size() < 3)
-	{
-		msg = "Usage: rm_hostmask [id] [authorized|banned]";
-		sendMessageToNick(chan, msg);
-		return;
-	}
-
-	std::string id = params[1];
-	std::string type = params[2];
+	std::string id = params[1].str();
+	std::string type = params[2].str();
 		
 	HostmaskType hostmask_type = HOSTMASK_AUTHORIZED;
 
@@ -451,36 +1296,34 @@ void BotController::rmHostmask(const std::string& chan, const std::string& host,
 	else
 	{
 		msg = type + " is not a valid hostmask type.";
-		sendMessageToNick(chan, msg);
+		network.sendMessageToNick(chan, msg);
 		return;
 	}
 
-	if(_hostmask_db->removeHostmaskByID(atoi(id.c_str()), hostmask_type) == HOSTMASK_RESPONSE_OK)
+	useHostmasks<HostmaskResponse>(network, chan, [id, hostmask_type](HostmaskAuthorizer& hostmask_db)
 	{
-		msg = "Hostmask removed.";
-	}
-	else
+		return hostmask_db.removeHostmaskByID(atoi(id.c_str()), hostmask_type);
+	})
+	.then([](const HostmaskResponse& r, std::vector<std::string>& replies)
 	{
-		msg = "Hostmask not removed (are you sure that id exists?)";
-	}
-
-	sendMessageToNick(chan, msg);
+		if(r == HOSTMASK_RESPONSE_OK)
+		{
+			replies.push_back("Hostmask removed.");
+		}
+		else
+		{
+			replies.push_back("Hostmask not removed (are you sure that id exists?)");
+		}
+	});
 }
 
-void BotController::addHostmask(const std::string& chan, const std::string& host, const std::vector<std::string>& params)
+void BotController::addHostmask(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)
 {
 	std::string msg;
-	
-	if(params.size() < 4)
-	{
-		msg = "Usage: add_hostmask [nick] [mask] [authorized|banned]";
-		sendMessageToNick(chan, msg);
-		return;
-	}
 
-	std::string nick = params[1];
-	std::string mask = params[2];
-	std::string type = params[3];
+	std::string nick = params[1].str();
+	std::string mask = params[2].str();
+	std::string type = params[3].str();
 
 	HostmaskType hostmask_type = HOSTMASK_AUTHORIZED;
 
@@ -491,97 +1334,199 @@ void BotController::addHostmask(const std::string& chan, const std::string& host
 	else
 	{
 		msg = type + " is not a valid hostmask type.";
-		sendMessageToNick(chan, msg);
+		network.sendMessageToNick(chan, msg);
 		return;
 	}
 
-	if(_hostmask_db->addHostmask(nick, mask, hostmask_type) == HOSTMASK_RESPONSE_OK)
+	useHostmasks<HostmaskResponse>(network, chan, [nick, mask, hostmask_type](HostmaskAuthorizer& hostmask_db)
 	{
-		msg = "Hostmask added.";
-	}
-
-	sendMessageToNick(chan, msg);
+		return hostmask_db.addHostmask(nick, mask, hostmask_type);
+	})
+	.then([](const HostmaskResponse& r, std::vector<std::string>& replies)
+	{
+		if(r == HOSTMASK_RESPONSE_OK)
+		{
+			replies.push_back("Hostmask added.");
+		}
+		else
+		{
+			replies.push_back("Hostmask not added, hostmask DB busy.");
+		}
+	});
 }
 
-void BotController::doWhoisNicklist(const std::string& chan, const std::string& nicklist)
+void BotController::doWhoReceivedCheckAuth(IrcNetwork& network, const std::string& chan, const std::string& host, const std::string& flags)
 {
-	_last_chan = chan;
+	std::string nick = MiscStringHelpers::nickFromHost(host);
 
-	std::vector<std::string> nicks = MiscStringHelpers::tokenizeString(nicklist, ' ');
-	for(unsigned i = 0; i < nicks.size(); i++)
+	HostmaskDecision decision = _hostmask_db->getDecision(host);
+	network.getSnapshot().update(chan, nick, host, decision);
+
+	// Someone opped from the snapshot may not be who we remember under that nick.
+	if(network.takeUnverifiedOp(chan, nick) && decision != HOSTMASK_DECISION_AUTHORIZED)
 	{
-		irc_cmd_whois(_session, nicks[i].c_str());
+		network.removeMode(chan, 'o', nick);
 	}
+
+	// Already opped users don't need another +o.
+	if(flags.find('@') != std::string::npos && decision == HOSTMASK_DECISION_AUTHORIZED)
+		return;
+
+	applyDecision(network, chan, nick, decision);
 }
 
-void BotController::doWhoisReceivedCheckAuth(const std::string& host)
+/* doNamesReceived gives ops back, as soon as NAMES lists them, to everyone the
+   snapshot says was authorized last time we saw them here. The WHO that follows
+   NAMES checks each of them properly and takes back any op that was wrong. */
+void BotController::doNamesReceived(IrcNetwork& network, const std::string& chan, const std::string& names)
 {
-	doUserJoined(_last_chan, host);
+	std::vector<std::string> nicks = MiscStringHelpers::tokenizeString(names, ' ');
+
+	for(unsigned i = 0; i < nicks.size(); i++)
+	{
+		const std::string& name = nicks[i];
+
+		// Anyone with a status prefix of op or above already has what we'd give them.
+		size_t start = name.find_first_not_of("~&@%+");
+		if(start == std::string::npos || name.find_first_of("~&@") < start)
+			continue;
+
+		std::string nick = name.substr(start);
+
+		const SnapshotMember* member = network.getSnapshot().find(chan, nick);
+		if(!member || member->decision != HOSTMASK_DECISION_AUTHORIZED)
+			continue;
+
+		network.queueMode(chan, 'o', nick);
+		network.markUnverifiedOp(chan, nick);
+	}
 }
 
 // EVENT CALLBACKS  ------------------------------------------------------
-void event_connect(irc_session_t * session, const char * event, 
+void on_connect(void * ctx, const char * event, 
 				   const char * origin, const char ** params, 
 				   unsigned int count)
 {
-	std::cout << "Connected to server.\n";
-
-	irc_ctx_t * ctx = (irc_ctx_t *) irc_get_ctx(session);
+	IrcNetwork* network = (IrcNetwork*) ctx;
+	network->getController()->recordEvent(*network, event, origin, params, count);
 
-	std::vector<std::string> chanlist = BotController::getChanList();
+	std::cout << "[" << network->getName() << "] Connected to server.\n";
 
-	for(unsigned i = 0; i < chanlist.size(); i++)
-	{
-		std::cout << "Attempting to join channel: " << chanlist[i].c_str() << std::endl;
-		irc_cmd_join(session, chanlist[i].c_str() , 0);
-	}
+	network->joinChannels();
 }
 
-void event_channel(irc_session_t * session, const char * event, 
+void on_channel(void * ctx, const char * event, 
 				   const char * origin, const char ** params, 
 				   unsigned int count)
 {
-	std::string chan = params[0];
-	std::string msg = params[1];
-	std::string host = origin;
+	IrcNetwork* network = (IrcNetwork*) ctx;
+	network->getController()->recordEvent(*network, event, origin, params, count);
 
-	BotController::parseMessage(chan, host, msg);
+	if(count < 2 || !origin)
+		return;
+
+	network->getController()->parseMessage(*network, params[0], origin, params[1]);
 }
 
-void event_join(irc_session_t * session, const char * event, 
+void on_join(void * ctx, const char * event, 
 				   const char * origin, const char ** params, 
 				   unsigned int count)
 {
+	IrcNetwork* network = (IrcNetwork*) ctx;
+	network->getController()->recordEvent(*network, event, origin, params, count);
+
+	if(count < 1 || !origin)
+		return;
+
 	std::string chan = params[0];
 	std::string host = origin;
 
-	BotController::doUserJoined(chan, host);
+	network->getController()->doUserJoined(*network, chan, host);
 }
-void event_numeric( irc_session_t * session, unsigned int event,
+void on_numeric(void * ctx, unsigned int event,
 				 const char * origin, const char ** params,
 				 unsigned int count)
 {
+	IrcNetwork* network = (IrcNetwork*) ctx;
+
+	char code[16];
+	sprintf(code, "%u", event);
+	network->getController()->recordEvent(*network, code, origin, params, count);
+
 	if(count > 0)
 	{
-		// Odds are we just joined a channel and they've 
-		// sent us a list of names. We need to determine who of these
-		// people are authorized
-		if(event == LIBIRC_RFC_RPL_NAMREPLY)
+		// Odds are we just joined a channel and the server has finished
+		// sending us its names. Resolve everyone's host in one go.
+		if(event == RPL_NAMREPLY && count > 3)
 		{
-			std::string chan((char*) params[2]);
-			std::string nicklist((char*) params[3]);
-
-			//Annoyingly they send the nicklist with +s and @'s in the names.
-			nicklist.erase(std::remove(nicklist.begin(), nicklist.end(), '+'), nicklist.end());
-			nicklist.erase(std::remove(nicklist.begin(), nicklist.end(), '@'), nicklist.end());
+			// params: me, channel type, channel, names
+			network->getController()->doNamesReceived(*network, params[2], params[3]);
+		}
+		else if(event == RPL_ENDOFNAMES && count > 1)
+		{
+			network->doWhoChannel(params[1]);
+		}
+		else if(event == RPL_WHOREPLY && count > 6)
+		{
+			// params: me, channel, user, host, server, nick, flags, hops realname
+			std::string chan = params[1];
+			std::string host = std::string(params[5]) + "!" + params[2] + "@" + params[3];
 
-			BotController::doWhoisNicklist(chan, nicklist);
+			network->getController()->doWhoReceivedCheckAuth(*network, chan, host, params[6]);
 		}
-		else if(event == LIBIRC_RFC_RPL_WHOISUSER)
+		else if(event == RPL_ENDOFWHO && count > 1)
 		{
-			BotController::doWhoisReceivedCheckAuth(params[3]);
+			network->doWhoFinished(params[1]);
+		}
+		else if(event == RPL_ISUPPORT)
+		{
+			// params: me, TOKEN[=value]..., "are supported by this server"
+			for(unsigned i = 1; i + 1 < count; i++)
+			{
+				std::string token = params[i];
+				if(token == "MODES")
+				{
+					network->setModesPerLine(MAX_MODES_PER_LINE);
+				}
+				else if(token.compare(0, 6, "MODES=") == 0)
+				{
+					unsigned modes = atoi(token.c_str() + 6);
+					network->setModesPerLine(modes < MAX_MODES_PER_LINE ? modes : MAX_MODES_PER_LINE);
+				}
+			}
 		}
 	}
 }
 
+#ifndef IRCOPTOTRON_NATIVE_IRC
+// libircclient hands us its session; our ctx on it is the IrcNetwork.
+void event_connect(irc_session_t * session, const char * event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count)
+{
+	on_connect(irc_get_ctx(session), event, origin, params, count);
+}
+
+void event_channel(irc_session_t * session, const char * event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count)
+{
+	on_channel(irc_get_ctx(session), event, origin, params, count);
+}
+
+void event_join(irc_session_t * session, const char * event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count)
+{
+	on_join(irc_get_ctx(session), event, origin, params, count);
+}
+
+void event_numeric(irc_session_t * session, unsigned int event, 
+				   const char * origin, const char ** params, 
+				   unsigned int count)
+{
+	on_numeric(irc_get_ctx(session), event, origin, params, count);
+}
+#endif
+
 }
\ No newline at end of file
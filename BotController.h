@@ -1,66 +1,194 @@
 #pragma once
 
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <set>
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <libircclient\libircclient.h>
-#include <libircclient\libirc_rfcnumeric.h>
 #include <sqlite\sqlite3.h>
 
+#include "BotConfig.h"
 #include "CalcDB.h"
+#include "CommandRegistry.h"
+#include "DbAwait.h"
+#include "DbWorker.h"
 #include "HostmaskAuthorizer.h"
+#include "IrcNetwork.h"
+#include "IrcPoller.h"
+#include "Metrics.h"
+#include "OutboundQueue.h"
+#include "RateLimiter.h"
+#include "ResponseCoalescer.h"
+#include "TrafficLog.h"
 
 namespace IRCOptotron
 {
 
+// What a calc lookup or edit found: its outcome, the calc and, for a version, who wrote it when.
+struct CalcAnswer
+{
+	CalcResponse response;
+	std::string calc;
+	std::string info;
+
+	CalcAnswer() : response(CALC_RESPONSE_NOCALC) {}
+};
+
+/* BotController owns any number of IrcNetworks and drives them all from one poll
+   loop. The calc and hostmask DBs, their worker thread and the command registry
+   are shared by every network, so each extra network costs a socket and its
+   per-channel state rather than another process with its own cold caches. */
 class BotController
 {
-	static bool _init;
+	typedef std::function<void()> DbWork;
+	typedef std::function<void(std::vector<std::string>& replies)> DbReply;
+	typedef void (BotController::*MemberHandler)(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
 
-	static irc_callbacks_t _callbacks;
-	static irc_session_t* _session;
+	IrcCallbacks _callbacks;
+	IrcPoller _poller;
 
-	static CalcDB* _calc_db;
-	static HostmaskAuthorizer* _hostmask_db;
+	// Declared first so it outlives everything that reports to it.
+	Metrics _metrics;
+	std::string _stats_file;
+	std::string _current_command;
 
-	static std::string _server;
-	static std::string _nick;
-	static std::string _last_chan;
-	static std::vector<std::string> _chanlist;
-	
-	static void doCalc(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void doCalcVersion(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void doCalcApropos(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void doCalcAproposAll(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void doCalcRemove(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void doChangeCalc(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void doMakeCalc(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-
-	static void viewHostmasksFor(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void rmHostmask(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-	static void addHostmask(const std::string& chan, const std::string& host, const std::vector<std::string>& params);
-
-	static void sendMessageToHost(const std::string& host, const std::string& msg);
-	static void sendMessageToNick(const std::string& nick, const std::string& msg);
+	// _calc_db is only touched on the worker thread once the worker is running;
+	// _hostmask_db only ever changes on the IRC thread (see swapDatabases).
+	// With more than one worker thread, each has a read-only connection in
+	// _calc_readers for lookups (see readDb).
+	CalcDB* _calc_db;
+	std::vector<CalcDB*> _calc_readers;
+	HostmaskAuthorizer* _hostmask_db;
+	std::string _calc_db_filename;
+	std::string _hostmask_db_filename;
+	DbWorker* _db_worker;
+
+	ConfigWatcher _config_watcher;
+	bool _running;
+	bool _reconnect;
+	std::string _snapshot_file;
+
+	std::vector<IrcNetwork*> _networks;
+	CommandRegistry _commands;
+	std::vector<StringSlice> _params;
+	RateLimiter _user_limiter;
+	RateLimiter _channel_limiter;
+	ResponseCoalescer _coalescer;
+	TrafficRecorder _recorder;
+
+	void registerCommands();
+	CommandHandler bindHandler(MemberHandler handler);
+
+	void doCalc(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void doCalcVersion(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void doCalcApropos(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void doCalcAproposAll(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void doCalcRemove(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void doChangeCalc(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void doMakeCalc(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
 	
-	BotController(){}
-	~BotController(){}
-public:
-	static void doUserJoined(const std::string& chan, const std::string& host); 
-	static void doWhoisNicklist(const std::string& chan, const std::string& nicklist);
-	static void doWhoisReceivedCheckAuth(const std::string& host);
+	void viewHostmasksFor(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void rmHostmask(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+	void addHostmask(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params);
+
+	bool checkRateLimits(IrcNetwork& network, const std::string& chan, const std::string& host, const Command& command);
+	void queryDb(IrcNetwork& network, const std::string& chan, const DbWork& work, const DbReply& reply, OutboundPriority priority = PRIORITY_REPLY,
+		const std::shared_ptr<CoalescedRequest>& coalesced = std::shared_ptr<CoalescedRequest>(), bool read_only = false);
+	void queryDbCoalesced(IrcNetwork& network, const std::string& chan, const std::string& args, const DbWork& work, const DbReply& reply);
+	void writeDb(IrcNetwork& network, const std::string& chan, const DbWork& work, const DbReply& reply);
+
+	template <typename T>
+	DbAwait<T> readCalc(IrcNetwork& network, const std::string& chan, const std::string& args, const std::function<T(CalcDB& calc_db)>& lookup);
+	template <typename T>
+	DbAwait<T> writeCalc(IrcNetwork& network, const std::string& chan, const std::function<T(CalcDB& calc_db)>& edit);
+	template <typename T>
+	DbAwait<T> useHostmasks(IrcNetwork& network, const std::string& chan, const std::function<T(HostmaskAuthorizer& hostmask_db)>& query,
+		OutboundPriority priority = PRIORITY_REPLY);
+
+	void applyDecision(IrcNetwork& network, const std::string& chan, const std::string& nick, HostmaskDecision decision);
+
+	bool runLoop();
+	void loadSnapshot();
+	void writeSnapshot();
+	void reloadConfig();
+	void applyConfig(const BotConfig& config);
+	void swapDatabases(const std::string& calc_db_filename, const std::string& hostmask_db_filename);
+	bool openReaders(const std::string& calc_db_filename, std::vector<CalcDB*>& readers);
+	static void closeReaders(std::vector<CalcDB*>& readers);
+	CalcDB* readDb();
+	IrcNetwork* findNetwork(const std::string& name);
+	void reportReplay(size_t events, double seconds);
+	void describeMetrics();
+	void writeStats();
 
-	static void parseMessage(const std::string& chan, const std::string& host, const std::string& msg);
+	BotController(const BotController&);
+	BotController& operator=(const BotController&);
+public:
+	void doUserJoined(IrcNetwork& network, const std::string& chan, const std::string& host); 
+	void doWhoReceivedCheckAuth(IrcNetwork& network, const std::string& chan, const std::string& host, const std::string& flags);
+	void doNamesReceived(IrcNetwork& network, const std::string& chan, const std::string& names);
 	
-	static bool start(const std::string& nick, const std::string& server, const std::vector<std::string>& chanlist);
+	void registerCommand(const std::string& name, const Command& command, const std::string& chan = "");
+	void parseMessage(IrcNetwork& network, const char* chan, const char* host, const char* msg);
+	void setRateLimits(double user_burst, double user_rate, double channel_burst, double channel_rate);
+	void setStatsFile(const std::string& path);
+	void setSnapshotFile(const std::string& path);
+	void setReconnect(bool reconnect);
+	void setCoalescing(unsigned window_ms, bool suppress_repeats);
+
+	bool recordTraffic(const std::string& path);
+	void recordEvent(IrcNetwork& network, const char* event, const char* origin, const char** params, unsigned int count);
+	bool replayTraffic(const std::string& path);
+	Metrics& getMetrics();
 
-	static std::vector<std::string> getChanList();
+	bool watchConfig(const std::string& path);
+
+	IrcNetwork* addNetwork(const std::string& name, const std::string& nick, const std::string& server,
+		const std::vector<std::string>& chanlist, unsigned short port = 6667);
+	bool run();
+	
+	BotController(const std::string& calc_db_filename = "calc.db", const std::string& hostmask_db_filename = "hostmasks.db", unsigned db_threads = 1);
+	~BotController();
 };
 
-}
\ No newline at end of file
+/* readCalc awaits a calc lookup on a reader connection (see queryDbCoalesced);
+   args is what it looks up, for telling repeats apart. */
+template <typename T>
+DbAwait<T> BotController::readCalc(IrcNetwork& network, const std::string& chan, const std::string& args, const std::function<T(CalcDB& calc_db)>& lookup)
+{
+	IrcNetwork* reply_network = &network;
+
+	return DbAwait<T>([this, lookup]{ return lookup(*readDb()); },
+		[this, reply_network, chan, args](const DbWork& work, const DbReply& reply){ queryDbCoalesced(*reply_network, chan, args, work, reply); });
+}
+
+// writeCalc awaits a calc edit, made as part of a group commit (see writeDb).
+template <typename T>
+DbAwait<T> BotController::writeCalc(IrcNetwork& network, const std::string& chan, const std::function<T(CalcDB& calc_db)>& edit)
+{
+	IrcNetwork* reply_network = &network;
+
+	return DbAwait<T>([this, edit]{ return edit(*_calc_db); },
+		[this, reply_network, chan](const DbWork& work, const DbReply& reply){ writeDb(*reply_network, chan, work, reply); });
+}
+
+// useHostmasks awaits work on the hostmask DB that is open when it is called.
+template <typename T>
+DbAwait<T> BotController::useHostmasks(IrcNetwork& network, const std::string& chan, const std::function<T(HostmaskAuthorizer& hostmask_db)>& query,
+	OutboundPriority priority)
+{
+	IrcNetwork* reply_network = &network;
+	HostmaskAuthorizer* hostmask_db = _hostmask_db;
+
+	return DbAwait<T>([hostmask_db, query]{ return query(*hostmask_db); },
+		[this, reply_network, chan, priority](const DbWork& work, const DbReply& reply){ queryDb(*reply_network, chan, work, reply, priority); });
+}
+
+}
@@ -6,93 +6,338 @@
 namespace IRCOptotron
 {
 
-CalcDB::CalcDB(const std::string& db_filename)
+static const int BUSY_TIMEOUT_MS = 2000;
+static const int BUSY_SLEEP_MS = 10;
+static const unsigned COMMIT_ATTEMPTS = 3;
+
+// Entries kept in calc_changes. A connection that falls further behind than this
+// can't tell what changed and drops its whole cache instead.
+static const int CHANGE_LOG_KEEP = 1024;
+
+CalcDB::CalcDB(const std::string& db_filename, size_t cache_capacity, CalcAccess access) : _latest_cache(cache_capacity)
 {
 	_db = 0;
+	_search_index = false;
+	_cache_hits = 0;
+	_cache_misses = 0;
+	_busy_retries = 0;
+	_invalidations = 0;
+	_metrics = 0;
+	_change_log = false;
+	_data_version = 0;
+	_last_change = 0;
 
 	// Initialize sqlite calc db  
 	if(sqlite3_open(db_filename.c_str(), &_db) != SQLITE_OK)
 	{
 		std::cerr << "Error loading calc database: " << sqlite3_errmsg(_db) << std::endl;
+		sqlite3_close(_db);
+		_db = 0;
+	}
+	else if(access == CALC_ACCESS_READ_ONLY)
+	{
+		// query_only keeps writes, ours or a trigger's, off this connection.
+		sqlite3_busy_handler(_db, busyHandler, this);
+		sqlite3_exec(_db, "PRAGMA query_only=1;", 0, 0, 0);
+		findSearchIndex();
+		prepareStatements();
+		startChangeLog();
 	}
 	else 
 	{
-		std::cout << "Calc database opened. " << std::endl;
+		std::cout << "Calc database " << db_filename << " opened." << std::endl;
+		configureJournal();
+		createSchema();
+		createSearchIndex();
+		prepareStatements();
+		startChangeLog();
 	}
 }
 
 CalcDB::~CalcDB()
 {
+	// Statements have to go before the handle they were prepared on.
+	_statements.finalizeAll();
+
 	if(_db)
 	{
 		sqlite3_close(_db);
 	}
 }
 
-CalcResponse CalcDB::getLatestVersionNumber(const std::string& keyword, int& version)
+bool CalcDB::isOpen() const
 {
-	if(!_db)
-		return CALC_RESPONSE_NODB;
+	return _db != 0;
+}
 
-	std::string response;
-	if(getCalc(keyword, response) == CALC_RESPONSE_NOCALC)
-		return CALC_RESPONSE_NOCALC;
+void CalcDB::prepareStatements()
+{
+	_statements.attach(_db);
+
+	_statements.prepare(STMT_APROPOS, "SELECT keyword FROM calcs WHERE keyword LIKE ? or calc LIKE ? GROUP BY keyword ORDER BY keyword");
+	_statements.prepare(STMT_APROPOS_ALL, "SELECT keyword, version FROM calcs WHERE keyword LIKE ? or calc LIKE ? GROUP BY keyword, version ORDER BY keyword, version");
+	_statements.prepare(STMT_GET_LATEST, "SELECT calc FROM calcs WHERE keyword = ? ORDER BY version DESC LIMIT 0,1");
+
+	// Negative versions count back from the latest one (-1 is the latest).
+	_statements.prepare(STMT_RESOLVE_VERSION,
+		"SELECT calc, author, added FROM calcs WHERE keyword = ?1 AND version = "
+		"CASE WHEN ?2 < 0 THEN (SELECT MAX(version) FROM calcs WHERE keyword = ?1) + ?2 + 1 ELSE ?2 END");
+
+	// Both inserts check for the calc and pick the version in the same statement;
+	// no row is inserted (sqlite3_changes() == 0) if the precondition fails.
+	_statements.prepare(STMT_INSERT_VERSION,
+		"INSERT INTO calcs (calc, keyword, author, version, added) "
+		"SELECT ?1, ?2, ?3, MAX(version) + 1, strftime('%Y-%m-%d %H:%M:%S','now') FROM calcs WHERE keyword = ?2 HAVING COUNT(*) > 0");
+	_statements.prepare(STMT_INSERT_NEW,
+		"INSERT INTO calcs (calc, keyword, author, version, added) "
+		"SELECT ?1, ?2, ?3, 0, strftime('%Y-%m-%d %H:%M:%S','now') WHERE NOT EXISTS (SELECT 1 FROM calcs WHERE keyword = ?2)");
+	_statements.prepare(STMT_REMOVE, "DELETE FROM calcs WHERE keyword = ?");
+
+	_statements.prepare(STMT_BEGIN, "BEGIN IMMEDIATE");
+	_statements.prepare(STMT_COMMIT, "COMMIT");
+	_statements.prepare(STMT_ROLLBACK, "ROLLBACK");
+
+	_statements.prepare(STMT_DATA_VERSION, "PRAGMA data_version");
+	_change_log = _statements.prepare(STMT_CHANGES_SINCE, "SELECT seq, keyword FROM calc_changes WHERE seq > ? ORDER BY seq");
+	if(_change_log)
+	{
+		_statements.prepare(STMT_PRUNE_CHANGES, "DELETE FROM calc_changes WHERE seq <= (SELECT MAX(seq) FROM calc_changes) - ?");
+		_statements.prepare(STMT_LAST_CHANGE, "SELECT MAX(seq) FROM calc_changes");
+	}
 
-	std::string query = "SELECT MAX(version) FROM calcs WHERE keyword = ?";
-	sqlite3_stmt* stmt = 0;
+	if(_search_index)
+	{
+		_statements.prepare(STMT_SEARCH, "SELECT keyword FROM calcs_fts WHERE calcs_fts MATCH ? GROUP BY keyword ORDER BY MIN(rank), keyword");
+		_statements.prepare(STMT_SEARCH_ALL, "SELECT c.keyword, c.version FROM calcs_fts JOIN calcs c ON c.rowid = calcs_fts.rowid WHERE calcs_fts MATCH ? GROUP BY c.keyword, c.version ORDER BY c.keyword, c.version");
+	}
+}
+
+/* WAL lets readers carry on while a batch is being written, and the busy handler
+   makes a locked database wait briefly instead of failing the edit outright. */
+void CalcDB::configureJournal()
+{
+	sqlite3_busy_handler(_db, busyHandler, this);
 
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	char* error = 0;
+	if(sqlite3_exec(_db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL;", 0, 0, &error) != SQLITE_OK)
 	{
-		sqlite3_bind_text(stmt, 1, keyword.c_str(), keyword.size(), SQLITE_STATIC);
+		std::cerr << "Could not switch calc database to WAL: " << (error ? error : "") << std::endl;
+	}
 
-		if(sqlite3_step(stmt) == SQLITE_ROW)
-		{
-			version = sqlite3_column_int(stmt, 0);	
-		}
+	sqlite3_free(error);
+}
+
+/* Our own take on sqlite3_busy_timeout, which can't tell us how often it waited:
+   retry every BUSY_SLEEP_MS until BUSY_TIMEOUT_MS has passed, counting each wait. */
+int CalcDB::busyHandler(void* calc_db, int attempts)
+{
+	if(attempts * BUSY_SLEEP_MS >= BUSY_TIMEOUT_MS)
+		return 0;
+
+	((CalcDB*) calc_db)->_busy_retries++;
+	sqlite3_sleep(BUSY_SLEEP_MS);
+
+	return 1;
+}
+
+/* Creates the calcs table when we are pointed at an empty or missing database, and
+   makes sure every lookup by keyword (and version) is served by an index. */
+void CalcDB::createSchema()
+{
+	std::string query =
+		"CREATE TABLE IF NOT EXISTS calcs ("
+		"  id INTEGER PRIMARY KEY,"
+		"  keyword TEXT NOT NULL,"
+		"  calc TEXT NOT NULL,"
+		"  author TEXT,"
+		"  version INTEGER NOT NULL,"
+		"  added TEXT"
+		");"
+		"CREATE INDEX IF NOT EXISTS calcs_keyword_version ON calcs (keyword, version);"
+		"CREATE TABLE IF NOT EXISTS calc_changes ("
+		"  seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"  keyword TEXT NOT NULL"
+		");"
+		"CREATE TRIGGER IF NOT EXISTS calc_changes_insert AFTER INSERT ON calcs BEGIN"
+		"  INSERT INTO calc_changes (keyword) VALUES (new.keyword);"
+		"END;"
+		"CREATE TRIGGER IF NOT EXISTS calc_changes_delete AFTER DELETE ON calcs BEGIN"
+		"  INSERT INTO calc_changes (keyword) VALUES (old.keyword);"
+		"END;"
+		"CREATE TRIGGER IF NOT EXISTS calc_changes_update AFTER UPDATE ON calcs BEGIN"
+		"  INSERT INTO calc_changes (keyword) VALUES (old.keyword);"
+		"  INSERT INTO calc_changes (keyword) VALUES (new.keyword);"
+		"END;";
+
+	char* error = 0;
+	if(sqlite3_exec(_db, query.c_str(), 0, 0, &error) != SQLITE_OK)
+	{
+		std::cerr << "Error creating calc schema: " << (error ? error : "") << std::endl;
+	}
+
+	sqlite3_free(error);
+}
+
+/* apropos used to be a LIKE '%term%' scan over every version of every calc. We keep
+   an FTS5 trigram index over (keyword, calc) instead, which answers the same
+   substring question from the index. Triggers keep it in step with any write to
+   calcs, ours or anyone else's. If this SQLite has no FTS5 we fall back to LIKE. */
+void CalcDB::createSearchIndex()
+{
+	findSearchIndex();
+
+	if(_search_index)
+		return;
+
+	std::string query =
+		"BEGIN;"
+		"CREATE VIRTUAL TABLE calcs_fts USING fts5(keyword, calc, content='calcs', tokenize='trigram');"
+		"CREATE TRIGGER calcs_fts_insert AFTER INSERT ON calcs BEGIN"
+		"  INSERT INTO calcs_fts(rowid, keyword, calc) VALUES (new.rowid, new.keyword, new.calc);"
+		"END;"
+		"CREATE TRIGGER calcs_fts_delete AFTER DELETE ON calcs BEGIN"
+		"  INSERT INTO calcs_fts(calcs_fts, rowid, keyword, calc) VALUES ('delete', old.rowid, old.keyword, old.calc);"
+		"END;"
+		"CREATE TRIGGER calcs_fts_update AFTER UPDATE ON calcs BEGIN"
+		"  INSERT INTO calcs_fts(calcs_fts, rowid, keyword, calc) VALUES ('delete', old.rowid, old.keyword, old.calc);"
+		"  INSERT INTO calcs_fts(rowid, keyword, calc) VALUES (new.rowid, new.keyword, new.calc);"
+		"END;"
+		"INSERT INTO calcs_fts(calcs_fts) VALUES ('rebuild');"
+		"COMMIT;";
+
+	char* error = 0;
+	if(sqlite3_exec(_db, query.c_str(), 0, 0, &error) == SQLITE_OK)
+	{
+		std::cout << "Calc search index built." << std::endl;
+		_search_index = true;
 	}
 	else
 	{
-		std::cerr << "Error with query: " << query << std::endl;
+		std::cerr << "Could not build calc search index, apropos will scan: " << (error ? error : "") << std::endl;
+		sqlite3_exec(_db, "ROLLBACK", 0, 0, 0);
 	}
 
+	sqlite3_free(error);
+}
+
+void CalcDB::findSearchIndex()
+{
+	sqlite3_stmt* stmt = 0;
+	if(sqlite3_prepare_v2(_db, "SELECT 1 FROM sqlite_master WHERE name = 'calcs_fts'", -1, &stmt, 0) == SQLITE_OK)
+	{
+		_search_index = sqlite3_step(stmt) == SQLITE_ROW;
+	}
 	sqlite3_finalize(stmt);
+}
+
+/* Starts following calc_changes from its current end; the cache is empty, so
+   nothing before that matters. Without the table (a read-only connection to a
+   database no writer has upgraded yet) any commit elsewhere empties the cache. */
+void CalcDB::startChangeLog()
+{
+	_data_version = readDataVersion();
 
-	return CALC_RESPONSE_VERSIONOK;
+	if(!_change_log)
+	{
+		std::cerr << "No calc_changes table, calc cache will be dropped on every outside write." << std::endl;
+		return;
+	}
+
+	sqlite3_stmt* stmt = 0;
+	if(sqlite3_prepare_v2(_db, "SELECT MAX(seq) FROM calc_changes", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		_last_change = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
 }
 
-CalcResponse CalcDB::getWrapAroundVersion(const std::string& keyword, int version, char* str_version)
+sqlite3_int64 CalcDB::readDataVersion()
 {
-	if(!_db)
-		return CALC_RESPONSE_NODB;
-	
-	int max_version = 0;
-	
-	CalcResponse ret = getLatestVersionNumber(keyword, max_version);
-	
-	itoa(max_version + version + 1, str_version, 10);
+	ScopedStatement stmt(_statements.get(STMT_DATA_VERSION));
 
-	if(max_version + version + 1 < 0)
-		ret = CALC_RESPONSE_NOCALC;
+	if(stmt && sqlite3_step(stmt) == SQLITE_ROW)
+		return sqlite3_column_int64(stmt, 0);
 
-	return ret;
+	return 0;
+}
+
+/* Drops whatever another connection changed from the cache. data_version is
+   per connection and doesn't move for our own commits, so when nobody else has
+   written (nearly always) this costs one pragma and no reads. */
+void CalcDB::syncChanges()
+{
+	sqlite3_int64 data_version = readDataVersion();
+	if(data_version == _data_version)
+		return;
+
+	_data_version = data_version;
+
+	if(!_change_log)
+	{
+		_latest_cache.clear();
+		_invalidations++;
+		return;
+	}
+
+	ScopedStatement stmt(_statements.get(STMT_CHANGES_SINCE));
+	if(!stmt)
+		return;
+
+	sqlite3_bind_int64(stmt, 1, _last_change);
+
+	while(sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		sqlite3_int64 seq = sqlite3_column_int64(stmt, 0);
+
+		// The entries we hadn't seen yet were pruned; there's no telling what they were.
+		if(seq > _last_change + 1)
+			_latest_cache.clear();
+
+		_latest_cache.erase(std::string((char*) sqlite3_column_text(stmt, 1)));
+		_invalidations++;
+		_last_change = seq;
+	}
+}
+
+// Trigrams need at least three characters; shorter terms go through LIKE.
+bool CalcDB::useSearchIndex(const std::string& searchterm) const
+{
+	return _search_index && searchterm.size() >= 3;
+}
+
+// Quotes the term as a single FTS5 string so it is matched literally.
+std::string CalcDB::toSearchPhrase(const std::string& searchterm)
+{
+	std::string phrase = "\"";
+	for(unsigned i = 0; i < searchterm.size(); i++)
+	{
+		if(searchterm[i] == '"')
+			phrase += '"';
+		phrase += searchterm[i];
+	}
+	phrase += "\"";
+
+	return phrase;
 }
 
 CalcResponse CalcDB::apropos(const std::string& searchterm, std::string& response)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"apropos\"");
+
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
 	CalcResponse ret = CALC_RESPONSE_NOSEARCHMATCHES;
 
-	std::string term = "%"+searchterm+"%";
-	std::string query = "SELECT keyword FROM calcs WHERE keyword LIKE ? or calc LIKE ? GROUP BY keyword ORDER BY keyword";
+	bool indexed = useSearchIndex(searchterm);
+	std::string term = indexed ? toSearchPhrase(searchterm) : "%"+searchterm+"%";
+	ScopedStatement stmt(_statements.get(indexed ? STMT_SEARCH : STMT_APROPOS));
 	
-	sqlite3_stmt* stmt = 0;
-
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, term.c_str(), term.size(), SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, term.c_str(), term.size(), SQLITE_STATIC);
+		if(!indexed)
+			sqlite3_bind_text(stmt, 2, term.c_str(), term.size(), SQLITE_STATIC);
 
 		if(sqlite3_step(stmt) == SQLITE_ROW)
 		{
@@ -105,32 +350,28 @@ CalcResponse CalcDB::apropos(const std::string& searchterm, std::string& respons
 			response += ", " + std::string((char*) sqlite3_column_text(stmt, 0));
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
-
-	sqlite3_finalize(stmt);
 
 	return ret;
 }
 
 CalcResponse CalcDB::apropos_all(const std::string& searchterm, std::string& response)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"apropos_all\"");
+
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
 	CalcResponse ret = CALC_RESPONSE_NOSEARCHMATCHES;
 
-	std::string term = "%"+searchterm+"%";
-	std::string query = "SELECT keyword, version FROM calcs WHERE keyword LIKE ? or calc LIKE ? GROUP BY keyword, version ORDER BY keyword, version";
+	bool indexed = useSearchIndex(searchterm);
+	std::string term = indexed ? toSearchPhrase(searchterm) : "%"+searchterm+"%";
+	ScopedStatement stmt(_statements.get(indexed ? STMT_SEARCH_ALL : STMT_APROPOS_ALL));
 	
-	sqlite3_stmt* stmt = 0;
-
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, term.c_str(), term.size(), SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, term.c_str(), term.size(), SQLITE_STATIC);
+		if(!indexed)
+			sqlite3_bind_text(stmt, 2, term.c_str(), term.size(), SQLITE_STATIC);
 
 		if(sqlite3_step(stmt) == SQLITE_ROW)
 		{
@@ -143,48 +384,34 @@ CalcResponse CalcDB::apropos_all(const std::string& searchterm, std::string& res
 			response += ", (v" + std::string((char*) sqlite3_column_text(stmt, 1)) + " " + std::string((char*) sqlite3_column_text(stmt, 0)) + ")";
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
-
-	sqlite3_finalize(stmt);
 
 	return ret;
 }
 
 CalcResponse CalcDB::changeCalc(const std::string& keyword, const std::string& newcalc, const std::string& author)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"changeCalc\"");
+
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
-	int latest_version = 0;
-	char str_version[32];
-
-	if(getLatestVersionNumber(keyword, latest_version) == CALC_RESPONSE_NOCALC)
-		return CALC_RESPONSE_NOCALC;
-
-	itoa(latest_version+1, str_version, 10);
-
 	CalcResponse ret = CALC_RESPONSE_NOCALC;
 
 	std::string calc = newcalc;
 	calc = MiscStringHelpers::trim(calc);
 
-	std::string query = "INSERT INTO calcs (calc, keyword, author, version, added) VALUES (?,?, ?,?, strftime(\"%Y-%m-%d %H:%M:%S\",\"now\"))";
+	ScopedStatement stmt(_statements.get(STMT_INSERT_VERSION));
 
-	sqlite3_stmt* stmt = 0;
-	
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, calc.c_str(), calc.size(), SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 2, keyword.c_str(), keyword.size(), SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 3, author.c_str(), author.size(), SQLITE_STATIC);
-		sqlite3_bind_int(stmt, 4, atoi(str_version));
 
 		int step = sqlite3_step(stmt);
-		if(step == SQLITE_DONE)
+		if(step == SQLITE_DONE && sqlite3_changes(_db) > 0)
 		{
+			_latest_cache.put(keyword, calc);
 			ret = CALC_RESPONSE_CALCCHANGED;
 		}
 		else if(step == SQLITE_BUSY)
@@ -192,151 +419,131 @@ CalcResponse CalcDB::changeCalc(const std::string& keyword, const std::string& n
 			ret = CALC_RESPONSE_DBBUSY;
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
-
-	sqlite3_finalize(stmt);
 
 	return ret;
 }
 
 CalcResponse CalcDB::getCalc(const std::string& keyword, std::string& response)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"getCalc\"");
+
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
-	CalcResponse ret = CALC_RESPONSE_NOCALC;
-
-	std::string query = "SELECT calc FROM calcs WHERE keyword = ? ORDER BY version DESC LIMIT 0,1";
-	
-	sqlite3_stmt* stmt = 0;
+	syncChanges();
 
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
-	{
-		sqlite3_bind_text(stmt, 1, keyword.c_str(), keyword.size(), SQLITE_STATIC);
+	bool cached = false;
+	CalcResponse ret = lookupLatest(keyword, response, cached);
 
-		if(sqlite3_step(stmt) == SQLITE_ROW)
-		{
-			const unsigned char* calc = sqlite3_column_text(stmt, 0);
-			response = std::string((char*) calc);
-			ret = CALC_RESPONSE_OK;
-		}
-	}
+	if(cached)
+		_cache_hits++;
 	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
+		_cache_misses++;
 
-	sqlite3_finalize(stmt);
 	return ret;
 }
 
-CalcResponse CalcDB::getCalc(const std::string& keyword, int version, std::string& response)
+/* The latest version of keyword, from the cache if it's there. Doesn't count
+   towards the hit ratio, so our own lookups (e.g. in removeCalc) don't skew it. */
+CalcResponse CalcDB::lookupLatest(const std::string& keyword, std::string& response, bool& cached)
 {
-	if(!_db)
-		return CALC_RESPONSE_NODB;
+	cached = _latest_cache.get(keyword, response);
+	if(cached)
+		return CALC_RESPONSE_OK;
 
 	CalcResponse ret = CALC_RESPONSE_NOCALC;
-	
-	char str_version[32];
-	itoa(version, str_version, 10);
-
-	if(version < 0)
-	{
-		if(getWrapAroundVersion(keyword, version, str_version) != CALC_RESPONSE_VERSIONOK)
-		{
-			return CALC_RESPONSE_NOCALC;
-		}
-	}
 
-	std::string query = "SELECT calc FROM calcs WHERE keyword = ? AND version = ? LIMIT 0,1";
-
-	sqlite3_stmt* stmt = 0;
-
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	ScopedStatement stmt(_statements.get(STMT_GET_LATEST));
+	
+	if(stmt)
 	{
-		sqlite3_bind_text(stmt, 1,  keyword.c_str(), keyword.size(), SQLITE_STATIC);
-		sqlite3_bind_int(stmt, 2, atoi(str_version));
+		sqlite3_bind_text(stmt, 1, keyword.c_str(), keyword.size(), SQLITE_STATIC);
 
 		if(sqlite3_step(stmt) == SQLITE_ROW)
 		{
 			const unsigned char* calc = sqlite3_column_text(stmt, 0);
 			response = std::string((char*) calc);
+			_latest_cache.put(keyword, response);
 			ret = CALC_RESPONSE_OK;
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
 
-	sqlite3_finalize(stmt);
 	return ret;
 }
 
-CalcResponse CalcDB::getVersionInfo(const std::string& keyword, int version, std::string& response)
+/* Looks up one version of a calc, resolving negative versions, in a single query.
+   Either output may be null if the caller doesn't want it. */
+CalcResponse CalcDB::resolveVersion(const std::string& keyword, int version, std::string* calc, std::string* info)
 {
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
 	CalcResponse ret = CALC_RESPONSE_NOCALC;
 
-	char str_version[32];
-	itoa(version, str_version, 10);
-
-	if(version < 0)
-	{
-		if(getWrapAroundVersion(keyword, version, str_version) != CALC_RESPONSE_VERSIONOK)
-		{
-			return CALC_RESPONSE_NOCALC;
-		}
-	}
-
-	std::string query = "SELECT author, added FROM calcs WHERE keyword = ? AND version = ?";
-	sqlite3_stmt* stmt = 0;
+	ScopedStatement stmt(_statements.get(STMT_RESOLVE_VERSION));
 
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, keyword.c_str(), keyword.size(), SQLITE_STATIC);
-		sqlite3_bind_int(stmt, 2, atoi(str_version));
+		sqlite3_bind_int(stmt, 2, version);
 
 		if(sqlite3_step(stmt) == SQLITE_ROW)
 		{
-			std::string author = std::string((char*)sqlite3_column_text(stmt, 0));
-			std::string added = std::string((char*)sqlite3_column_text(stmt, 1));
-			response = "Calc '" + keyword + "' changed at " + added + " by " + author;
+			if(calc)
+			{
+				*calc = std::string((char*) sqlite3_column_text(stmt, 0));
+			}
+
+			if(info)
+			{
+				std::string author = std::string((char*)sqlite3_column_text(stmt, 1));
+				std::string added = std::string((char*)sqlite3_column_text(stmt, 2));
+				*info = "Calc '" + keyword + "' changed at " + added + " by " + author;
+			}
+
 			ret = CALC_RESPONSE_OK;
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
 
 	return ret;
 }
 
+CalcResponse CalcDB::getCalc(const std::string& keyword, int version, std::string& response)
+{
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"getCalcByVersion\"");
+
+	return resolveVersion(keyword, version, &response, 0);
+}
+
+CalcResponse CalcDB::getVersionInfo(const std::string& keyword, int version, std::string& response)
+{
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"getVersionInfo\"");
+
+	return resolveVersion(keyword, version, 0, &response);
+}
+
+CalcResponse CalcDB::getCalcVersion(const std::string& keyword, int version, std::string& calc, std::string& info)
+{
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"getCalcVersion\"");
+
+	return resolveVersion(keyword, version, &calc, &info);
+}
+
 CalcResponse CalcDB::makeCalc(const std::string& keyword, const std::string& newcalc, const std::string& author)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"makeCalc\"");
+
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
-	std::string response;
-	if(getCalc(keyword, response) == CALC_RESPONSE_OK)
-		return CALC_RESPONSE_CALCALREADYEXISTS;
-
 	CalcResponse ret = CALC_RESPONSE_CALCALREADYEXISTS;
 
 	std::string calc = newcalc;
 	calc = MiscStringHelpers::trim(calc);
 
-	std::string query = "INSERT INTO calcs (calc, keyword, author, version, added) VALUES (?,?,?,'0', strftime(\"%Y-%m-%d %H:%M:%S\",\"now\"))";
-
-	sqlite3_stmt* stmt = 0;
+	ScopedStatement stmt(_statements.get(STMT_INSERT_NEW));
 	
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, calc.c_str(), calc.size(), SQLITE_STATIC);
 		sqlite3_bind_text(stmt, 2, keyword.c_str(), keyword.size(), SQLITE_STATIC);
@@ -344,8 +551,9 @@ CalcResponse CalcDB::makeCalc(const std::string& keyword, const std::string& new
 		
 		int step = sqlite3_step(stmt);
 		
-		if(step == SQLITE_DONE)
+		if(step == SQLITE_DONE && sqlite3_changes(_db) > 0)
 		{
+			_latest_cache.put(keyword, calc);
 			ret = CALC_RESPONSE_CALCCHANGED;
 		}
 		else if(step == SQLITE_BUSY)
@@ -353,32 +561,30 @@ CalcResponse CalcDB::makeCalc(const std::string& keyword, const std::string& new
 			ret = CALC_RESPONSE_DBBUSY;
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
-
-	sqlite3_finalize(stmt);
 
 	return ret;
 }
 
 CalcResponse CalcDB::removeCalc(const std::string& keyword)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"removeCalc\"");
+
 	if(!_db)
 		return CALC_RESPONSE_NODB;
 
 	CalcResponse ret = CALC_RESPONSE_NOCALC;
 
 	// First we need to know the calc exists.
+	syncChanges();
+
 	std::string response;
-	if(getCalc(keyword, response) == CALC_RESPONSE_NOCALC)
+	bool cached;
+	if(lookupLatest(keyword, response, cached) == CALC_RESPONSE_NOCALC)
 		return ret;
 
-	std::string query = "DELETE FROM calcs WHERE keyword = ?";
-	sqlite3_stmt* stmt = 0;
+	ScopedStatement stmt(_statements.get(STMT_REMOVE));
 
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, keyword.c_str(), keyword.size(), SQLITE_STATIC);
 
@@ -387,12 +593,132 @@ CalcResponse CalcDB::removeCalc(const std::string& keyword)
 			ret = CALC_RESPONSE_OK;
 		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
+
+	_latest_cache.erase(keyword);
 	
 	return ret;
 }
 
+/* beginBatch/commitBatch wrap a group of edits in one transaction, so a burst of
+   mkcalc/chcalc costs one fsync. If the transaction can't be started the edits
+   simply autocommit one by one and commitBatch has nothing left to do.
+
+   The batch also keeps our own edits out of what syncChanges() replays. BEGIN
+   IMMEDIATE holds the write lock until the commit, so once everything other
+   connections logged before it has been read, every later entry up to the
+   commit is ours, and _last_change can skip straight past them. */
+CalcResponse CalcDB::beginBatch()
+{
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"beginBatch\"");
+
+	if(!_db)
+		return CALC_RESPONSE_NODB;
+
+	{
+		ScopedStatement stmt(_statements.get(STMT_BEGIN));
+
+		if(!stmt || sqlite3_step(stmt) != SQLITE_DONE)
+			return CALC_RESPONSE_DBBUSY;
+	}
+
+	syncChanges();
+
+	return CALC_RESPONSE_OK;
+}
+
+CalcResponse CalcDB::commitBatch()
+{
+	ScopedTimer timer(_metrics, "ircoptotron_calcdb_seconds", "method=\"commitBatch\"");
+
+	if(!_db)
+		return CALC_RESPONSE_NODB;
+
+	if(sqlite3_get_autocommit(_db))
+		return CALC_RESPONSE_OK;
+
+	// Trimming the change log rides along in the batch rather than costing a commit of its own.
+	{
+		ScopedStatement prune(_statements.get(STMT_PRUNE_CHANGES));
+		if(prune)
+		{
+			sqlite3_bind_int(prune, 1, CHANGE_LOG_KEEP);
+			sqlite3_step(prune);
+		}
+	}
+
+	// The end of the log is our last edit; see beginBatch.
+	sqlite3_int64 own_last_change = _last_change;
+	{
+		ScopedStatement last(_statements.get(STMT_LAST_CHANGE));
+		if(last && sqlite3_step(last) == SQLITE_ROW && sqlite3_column_type(last, 0) != SQLITE_NULL)
+			own_last_change = sqlite3_column_int64(last, 0);
+	}
+
+	for(unsigned attempt = 0; attempt < COMMIT_ATTEMPTS; attempt++)
+	{
+		if(attempt > 0)
+			_busy_retries++;
+
+		ScopedStatement stmt(_statements.get(STMT_COMMIT));
+
+		if(stmt && sqlite3_step(stmt) == SQLITE_DONE)
+		{
+			if(own_last_change > _last_change)
+				_last_change = own_last_change;
+
+			return CALC_RESPONSE_OK;
+		}
+	}
+
+	// The batch is gone, and with it anything we cached from it.
+	ScopedStatement stmt(_statements.get(STMT_ROLLBACK));
+	if(stmt)
+		sqlite3_step(stmt);
+
+	_latest_cache.clear();
+
+	return CALC_RESPONSE_DBBUSY;
+}
+
+void CalcDB::setCacheCapacity(size_t capacity)
+{
+	_latest_cache.setCapacity(capacity);
+}
+
+unsigned long CalcDB::getCacheHits() const
+{
+	return _cache_hits;
+}
+
+unsigned long CalcDB::getCacheMisses() const
+{
+	return _cache_misses;
+}
+
+double CalcDB::getCacheHitRatio() const
+{
+	unsigned long lookups = _cache_hits + _cache_misses;
+	if(lookups == 0)
+		return 0.0;
+
+	return (double) _cache_hits / lookups;
+}
+
+unsigned long CalcDB::getBusyRetries() const
+{
+	return _busy_retries;
+}
+
+// Cache entries dropped because another connection changed their calc.
+unsigned long CalcDB::getInvalidations() const
+{
+	return _invalidations;
+}
+
+// Metrics must outlive the CalcDB; null turns timing off.
+void CalcDB::setMetrics(Metrics* metrics)
+{
+	_metrics = metrics;
+}
+
 }
\ No newline at end of file
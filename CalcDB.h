@@ -3,6 +3,10 @@
 #include <string>
 #include <sqlite\sqlite3.h>
 
+#include "LruCache.h"
+#include "Metrics.h"
+#include "StatementCache.h"
+
 namespace IRCOptotron
 {
 
@@ -18,13 +22,79 @@ enum CalcResponse
 	CALC_RESPONSE_DBBUSY
 };
 
+enum CalcAccess
+{
+	CALC_ACCESS_READ_WRITE,
+	CALC_ACCESS_READ_ONLY   // an extra connection for lookups; the schema is left to the writer
+};
+
+/* CalcDB is not thread safe; BotController only ever touches it from its DB
+   worker. To look calcs up from several threads at once, give each thread its
+   own read-only CalcDB on the same file: WAL lets them all read while the one
+   read-write CalcDB writes.
+
+   Any number of connections, in this process or others, may share the file. A
+   trigger logs every keyword written to calc_changes, and before trusting its
+   cache a CalcDB checks PRAGMA data_version, which only moves when some other
+   connection has committed. When it has, only the keywords logged since we last
+   looked are dropped from the cache. */
 class CalcDB
 {
 private:
+	enum CalcStatement
+	{
+		STMT_APROPOS,
+		STMT_APROPOS_ALL,
+		STMT_INSERT_VERSION,
+		STMT_GET_LATEST,
+		STMT_RESOLVE_VERSION,
+		STMT_INSERT_NEW,
+		STMT_REMOVE,
+		STMT_SEARCH,
+		STMT_SEARCH_ALL,
+		STMT_BEGIN,
+		STMT_COMMIT,
+		STMT_ROLLBACK,
+		STMT_DATA_VERSION,
+		STMT_CHANGES_SINCE,
+		STMT_PRUNE_CHANGES,
+		STMT_LAST_CHANGE
+	};
+
 	sqlite3* _db;
+	StatementCache _statements;
+
+	// keyword -> text of its latest version
+	LruCache<std::string, std::string> _latest_cache;
+	unsigned long _cache_hits;
+	unsigned long _cache_misses;
+	unsigned long _busy_retries;
+	unsigned long _invalidations;
+
+	// Where we are in the other connections' writes; see syncChanges.
+	bool _change_log;
+	sqlite3_int64 _data_version;
+	sqlite3_int64 _last_change;
 
-	CalcResponse getLatestVersionNumber(const std::string& keyword, int& version);
-	CalcResponse getWrapAroundVersion(const std::string& keyword, int version, char *str_version);
+	Metrics* _metrics;
+
+	// True when the calcs_fts trigram index exists and apropos can use it.
+	bool _search_index;
+
+	void configureJournal();
+	void createSchema();
+	void prepareStatements();
+	void createSearchIndex();
+	void findSearchIndex();
+	void startChangeLog();
+	void syncChanges();
+	sqlite3_int64 readDataVersion();
+	bool useSearchIndex(const std::string& searchterm) const;
+	static std::string toSearchPhrase(const std::string& searchterm);
+	static int busyHandler(void* calc_db, int attempts);
+
+	CalcResponse lookupLatest(const std::string& keyword, std::string& response, bool& cached);
+	CalcResponse resolveVersion(const std::string& keyword, int version, std::string* calc, std::string* info);
 
 public:
 	CalcResponse apropos(const std::string& searchterm, std::string& response);
@@ -33,10 +103,25 @@ public:
 	CalcResponse getCalc(const std::string& keyword, std::string& response);
 	CalcResponse getCalc(const std::string& keyword, int version, std::string& response);
 	CalcResponse getVersionInfo(const std::string& keyword, int version, std::string& response);
+	CalcResponse getCalcVersion(const std::string& keyword, int version, std::string& calc, std::string& info);
 	CalcResponse makeCalc(const std::string& keyword, const std::string& newcalc, const std::string& author);
 	CalcResponse removeCalc(const std::string& keyword);
 
-	CalcDB(const std::string& db_filename);
+	bool isOpen() const;
+
+	CalcResponse beginBatch();
+	CalcResponse commitBatch();
+
+	void setCacheCapacity(size_t capacity);
+	unsigned long getCacheHits() const;
+	unsigned long getCacheMisses() const;
+	double getCacheHitRatio() const;
+	unsigned long getBusyRetries() const;
+	unsigned long getInvalidations() const;
+
+	void setMetrics(Metrics* metrics);
+
+	CalcDB(const std::string& db_filename, size_t cache_capacity = 256, CalcAccess access = CALC_ACCESS_READ_WRITE);
 	~CalcDB();
 };
 
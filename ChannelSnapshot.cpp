@@ -0,0 +1,154 @@
+#include <vector>
+
+#include "ChannelSnapshot.h"
+#include "StringHelpers.h"
+
+namespace IRCOptotron
+{
+
+ChannelSnapshot::ChannelSnapshot()
+{
+	_dirty = false;
+}
+
+std::string ChannelSnapshot::key(const std::string& name)
+{
+	return MiscStringHelpers::ircLower(name);
+}
+
+const char* ChannelSnapshot::decisionName(HostmaskDecision decision)
+{
+	if(decision == HOSTMASK_DECISION_AUTHORIZED)
+		return "authorized";
+	else if(decision == HOSTMASK_DECISION_BANNED)
+		return "banned";
+	else
+		return "none";
+}
+
+void ChannelSnapshot::update(const std::string& chan, const std::string& nick, const std::string& host, HostmaskDecision decision)
+{
+	SnapshotMember member;
+	member.nick = nick;
+	member.host = host;
+	member.decision = decision;
+
+	std::string chan_key = key(chan);
+	std::string nick_key = key(nick);
+
+	_channels[chan_key][nick_key] = member;
+
+	std::map<std::string, Members>::iterator it = _refreshing.find(chan_key);
+	if(it != _refreshing.end())
+		it->second[nick_key] = member;
+
+	_dirty = true;
+}
+
+/* Starts collecting chan's members afresh; until endRefresh the old members are
+   still what find() sees. */
+void ChannelSnapshot::beginRefresh(const std::string& chan)
+{
+	_refreshing[key(chan)].clear();
+}
+
+void ChannelSnapshot::endRefresh(const std::string& chan)
+{
+	std::map<std::string, Members>::iterator it = _refreshing.find(key(chan));
+	if(it == _refreshing.end())
+		return;
+
+	_channels[it->first].swap(it->second);
+	_refreshing.erase(it);
+	_dirty = true;
+}
+
+void ChannelSnapshot::removeChannel(const std::string& chan)
+{
+	std::string chan_key = key(chan);
+
+	_refreshing.erase(chan_key);
+	if(_channels.erase(chan_key) > 0)
+		_dirty = true;
+}
+
+const SnapshotMember* ChannelSnapshot::find(const std::string& chan, const std::string& nick) const
+{
+	std::map<std::string, Members>::const_iterator chan_it = _channels.find(key(chan));
+	if(chan_it == _channels.end())
+		return 0;
+
+	Members::const_iterator it = chan_it->second.find(key(nick));
+	if(it == chan_it->second.end())
+		return 0;
+
+	return &it->second;
+}
+
+size_t ChannelSnapshot::size() const
+{
+	size_t members = 0;
+
+	std::map<std::string, Members>::const_iterator it;
+	for(it = _channels.begin(); it != _channels.end(); ++it)
+		members += it->second.size();
+
+	return members;
+}
+
+bool ChannelSnapshot::isDirty() const
+{
+	return _dirty;
+}
+
+/* One member per line: network, channel, nick, host and decision, tab separated.
+   None of them can hold a tab or newline on IRC, so nothing needs escaping. */
+void ChannelSnapshot::write(std::ostream& out, const std::string& network)
+{
+	std::map<std::string, Members>::const_iterator chan_it;
+	for(chan_it = _channels.begin(); chan_it != _channels.end(); ++chan_it)
+	{
+		Members::const_iterator it;
+		for(it = chan_it->second.begin(); it != chan_it->second.end(); ++it)
+		{
+			out << network << '\t' << chan_it->first << '\t' << it->second.nick << '\t'
+				<< it->second.host << '\t' << decisionName(it->second.decision) << '\n';
+		}
+	}
+
+	_dirty = false;
+}
+
+bool ChannelSnapshot::parseLine(const std::string& line, std::string& network, std::string& chan, SnapshotMember& member)
+{
+	std::vector<std::string> fields;
+
+	size_t start = 0;
+	for(size_t i = 0; i <= line.size(); i++)
+	{
+		if(i == line.size() || line[i] == '\t')
+		{
+			fields.push_back(line.substr(start, i - start));
+			start = i + 1;
+		}
+	}
+
+	if(fields.size() != 5)
+		return false;
+
+	network = fields[0];
+	chan = fields[1];
+	member.nick = fields[2];
+	member.host = fields[3];
+
+	if(fields[4] == "authorized")
+		member.decision = HOSTMASK_DECISION_AUTHORIZED;
+	else if(fields[4] == "banned")
+		member.decision = HOSTMASK_DECISION_BANNED;
+	else
+		member.decision = HOSTMASK_DECISION_NONE;
+
+	return true;
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+
+#include "HostmaskAuthorizer.h"
+
+namespace IRCOptotron
+{
+
+struct SnapshotMember
+{
+	std::string nick;
+	std::string host;             // nick!user@host as last resolved
+	HostmaskDecision decision;    // what the hostmask DB said about host then
+};
+
+/* ChannelSnapshot remembers who was in each of a network's channels, their host
+   and whether they were authorized, as of the last WHO or JOIN. It outlives the
+   connection (and is saved to disk by BotController), so after a reconnect ops
+   can go back out as soon as NAMES arrives instead of after the WHO.
+
+   Each channel's members are replaced wholesale when a WHO of it completes, so
+   people who left while we weren't looking don't pile up. Channel names and
+   nicks are matched case-insensitively. */
+class ChannelSnapshot
+{
+private:
+	typedef std::map<std::string, SnapshotMember> Members;
+
+	std::map<std::string, Members> _channels;
+	std::map<std::string, Members> _refreshing;
+	bool _dirty;
+
+	static std::string key(const std::string& name);
+	static const char* decisionName(HostmaskDecision decision);
+
+public:
+	void update(const std::string& chan, const std::string& nick, const std::string& host, HostmaskDecision decision);
+	void beginRefresh(const std::string& chan);
+	void endRefresh(const std::string& chan);
+	void removeChannel(const std::string& chan);
+	const SnapshotMember* find(const std::string& chan, const std::string& nick) const;
+
+	size_t size() const;
+	bool isDirty() const;
+
+	void write(std::ostream& out, const std::string& network);
+	static bool parseLine(const std::string& line, std::string& network, std::string& chan, SnapshotMember& member);
+
+	ChannelSnapshot();
+};
+
+}
@@ -0,0 +1,57 @@
+#include "CommandRegistry.h"
+
+namespace IRCOptotron
+{
+
+CommandRegistry::CommandRegistry()
+{
+	_longest_name = 0;
+}
+
+void CommandRegistry::add(const std::string& name, const Command& command)
+{
+	_commands.erase(name);
+	_commands.insert(std::make_pair(name, command));
+
+	if(name.size() > _longest_name)
+		_longest_name = name.size();
+}
+
+void CommandRegistry::addForChannel(const std::string& chan, const std::string& name, const Command& command)
+{
+	CommandMap& commands = _channel_commands[chan];
+	commands.erase(name);
+	commands.insert(std::make_pair(name, command));
+
+	if(name.size() > _longest_name)
+		_longest_name = name.size();
+}
+
+// chan is only turned into a string if some channel actually has its own commands.
+const Command* CommandRegistry::find(const char* chan, const std::string& name) const
+{
+	if(!_channel_commands.empty())
+	{
+		std::unordered_map<std::string, CommandMap>::const_iterator chan_it = _channel_commands.find(std::string(chan));
+		if(chan_it != _channel_commands.end())
+		{
+			CommandMap::const_iterator it = chan_it->second.find(name);
+			if(it != chan_it->second.end())
+				return &it->second;
+		}
+	}
+
+	CommandMap::const_iterator it = _commands.find(name);
+	if(it != _commands.end())
+		return &it->second;
+
+	return 0;
+}
+
+// Anything longer than this can't be a command, whatever channel it's in.
+size_t CommandRegistry::longestName() const
+{
+	return _longest_name;
+}
+
+}
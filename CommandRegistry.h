@@ -0,0 +1,60 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "StringHelpers.h"
+
+namespace IRCOptotron
+{
+
+enum CommandPermission
+{
+	PERMISSION_ANYONE,
+	PERMISSION_AUTHORIZED
+};
+
+class IrcNetwork;
+
+/* network is the connection the command arrived on, and where replies go. params
+   point into the line libircclient handed us and are only valid during the call. */
+typedef std::function<void(IrcNetwork& network, const std::string& chan, const std::string& host, const std::vector<StringSlice>& params)> CommandHandler;
+
+struct Command
+{
+	CommandHandler handler;
+	unsigned min_params;         // including the command itself
+	CommandPermission permission;
+	char delimiter;              // how the whole line is split into params
+	std::string usage;           // sent when fewer than min_params are given
+	unsigned cost;               // rate limit weight, roughly what it costs the DB
+
+	Command(CommandHandler handler, unsigned min_params, CommandPermission permission, char delimiter, const std::string& usage, unsigned cost = 1)
+		: handler(handler), min_params(min_params), permission(permission), delimiter(delimiter), usage(usage), cost(cost) {}
+};
+
+/* CommandRegistry maps lowercase command names to their Command. A name can also
+   be registered for one channel only, which takes precedence there over the
+   global entry. Lookups are one hash probe (two if per-channel commands exist). */
+class CommandRegistry
+{
+private:
+	typedef std::unordered_map<std::string, Command> CommandMap;
+
+	CommandMap _commands;
+	std::unordered_map<std::string, CommandMap> _channel_commands;
+	size_t _longest_name;
+
+public:
+	void add(const std::string& name, const Command& command);
+	void addForChannel(const std::string& chan, const std::string& name, const Command& command);
+
+	const Command* find(const char* chan, const std::string& name) const;
+	size_t longestName() const;
+
+	CommandRegistry();
+};
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+/* DbAwait<T> is a DB step a command is waiting on: work that runs on the DB
+   worker and produces a T. Nothing is posted until then() gives the rest of the
+   command, which is called on the IRC thread with the result and fills in the
+   lines to reply with. Meanwhile the IRC thread goes on serving every other
+   channel, so a handler reads top to bottom as "look this up, then answer",
+   the way it would with co_await, without C++20. */
+template <typename T>
+class DbAwait
+{
+public:
+	typedef std::function<void(const T& result, std::vector<std::string>& replies)> Then;
+	typedef std::function<void()> Work;
+	typedef std::function<void(std::vector<std::string>& replies)> Reply;
+	typedef std::function<void(const Work& work, const Reply& reply)> Post;
+
+private:
+	std::function<T()> _work;
+	Post _post;
+
+public:
+	void then(const Then& next) const
+	{
+		// Written on the worker, read on the IRC thread once the job's completion runs.
+		std::shared_ptr<T> result(new T());
+		std::function<T()> work = _work;
+
+		_post([result, work]{ *result = work(); },
+			[result, next](std::vector<std::string>& replies){ next(*result, replies); });
+	}
+
+	DbAwait(const std::function<T()>& work, const Post& post) : _work(work), _post(post) {}
+};
+
+}
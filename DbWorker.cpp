@@ -0,0 +1,267 @@
+#include "DbWorker.h"
+
+namespace IRCOptotron
+{
+
+// Which of its worker's threads this is, or -1 off every worker.
+static thread_local int t_thread_index = -1;
+
+DbWorker::DbWorker(unsigned threads)
+{
+	_in_flight = 0;
+	_running = 0;
+	_exclusive_running = false;
+	_stopping = false;
+	_max_batch = 1;
+	_batch_window = std::chrono::milliseconds(0);
+
+	if(threads == 0)
+		threads = 1;
+
+	for(unsigned i = 0; i < threads; i++)
+		_threads.push_back(std::thread(&DbWorker::run, this, (int) i));
+}
+
+// Lets already queued work finish before the threads go away.
+DbWorker::~DbWorker()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+
+	_wake.notify_all();
+
+	for(unsigned i = 0; i < _threads.size(); i++)
+		_threads[i].join();
+}
+
+/* Every thread is woken, not just one: a write batch waiting for more writes has
+   to see the new job, whichever thread the notification would have gone to. */
+void DbWorker::push(const Job& job)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_jobs.push_back(job);
+		_in_flight++;
+	}
+
+	_wake.notify_all();
+}
+
+void DbWorker::post(const Task& work, const Task& done)
+{
+	Job job;
+	job.work = work;
+	job.done = done;
+	job.failed = done;
+	job.write = false;
+	job.concurrent = false;
+
+	push(job);
+}
+
+void DbWorker::postRead(const std::string& strand, const Task& work, const Task& done)
+{
+	Job job;
+	job.work = work;
+	job.done = done;
+	job.failed = done;
+	job.write = false;
+	job.concurrent = true;
+	job.strand = strand;
+
+	push(job);
+}
+
+void DbWorker::postWrite(const Task& work, const Task& done, const Task& failed)
+{
+	Job job;
+	job.work = work;
+	job.done = done;
+	job.failed = failed;
+	job.write = true;
+	job.concurrent = false;
+
+	push(job);
+}
+
+/* begin opens a transaction and commit makes it durable, returning false if it
+   had to be rolled back. Both run on the worker thread. */
+void DbWorker::setGroupCommit(const Task& begin, const CommitTask& commit, unsigned max_batch, unsigned window_ms)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_begin_batch = begin;
+	_commit_batch = commit;
+	_max_batch = max_batch > 0 ? max_batch : 1;
+	_batch_window = std::chrono::milliseconds(window_ms);
+}
+
+/* Finds the first queued job that may start now. A job that runs alone waits for
+   everything before it and holds up everything after it. A read can pass queued
+   reads of other strands, but not an earlier job on its own strand. Called with
+   the lock held. */
+bool DbWorker::nextRunnable(size_t& index) const
+{
+	if(_exclusive_running)
+		return false;
+
+	std::set<std::string> passed;
+
+	for(size_t i = 0; i < _jobs.size(); i++)
+	{
+		const Job& job = _jobs[i];
+
+		if(!job.concurrent)
+		{
+			index = i;
+			return i == 0 && _running == 0;
+		}
+
+		if(!_busy_strands.count(job.strand) && !passed.count(job.strand))
+		{
+			index = i;
+			return true;
+		}
+
+		passed.insert(job.strand);
+	}
+
+	return false;
+}
+
+void DbWorker::run(int index)
+{
+	t_thread_index = index;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	while(true)
+	{
+		size_t next = 0;
+		_wake.wait(lock, [this, &next]{ return (_stopping && _jobs.empty()) || nextRunnable(next); });
+
+		if(_jobs.empty())
+			return;
+
+		Job job = _jobs[next];
+		_jobs.erase(_jobs.begin() + next);
+
+		_running++;
+		if(job.concurrent)
+			_busy_strands.insert(job.strand);
+		else
+			_exclusive_running = true;
+
+		if(job.write && _commit_batch)
+		{
+			runWriteBatch(job, lock);
+		}
+		else
+		{
+			lock.unlock();
+			job.work();
+			lock.lock();
+
+			_completions.push_back(job.done);
+		}
+
+		_running--;
+		if(job.concurrent)
+			_busy_strands.erase(job.strand);
+		else
+			_exclusive_running = false;
+
+		// Whatever was waiting on this job's strand, or on it finishing, may go now.
+		_wake.notify_all();
+	}
+}
+
+/* Runs first and every write queued behind it, up to _max_batch or until the
+   window closes, in one transaction. A read arriving mid-batch ends the batch so
+   it isn't held up behind the window. Called and returns with lock held. */
+void DbWorker::runWriteBatch(Job first, std::unique_lock<std::mutex>& lock)
+{
+	std::vector<Job> batch(1, first);
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + _batch_window;
+
+	Task begin = _begin_batch;
+	CommitTask commit = _commit_batch;
+
+	lock.unlock();
+	begin();
+	first.work();
+	lock.lock();
+
+	while(batch.size() < _max_batch)
+	{
+		if(!_wake.wait_until(lock, deadline, [this]{ return _stopping || !_jobs.empty(); }))
+			break;
+
+		if(_jobs.empty() || !_jobs.front().write)
+			break;
+
+		Job next = _jobs.front();
+		_jobs.pop_front();
+
+		lock.unlock();
+		next.work();
+		lock.lock();
+
+		batch.push_back(next);
+	}
+
+	lock.unlock();
+	bool committed = commit();
+	lock.lock();
+
+	for(unsigned i = 0; i < batch.size(); i++)
+		_completions.push_back(committed ? batch[i].done : batch[i].failed);
+}
+
+/* Called from the IRC thread. Completions are swapped out first so a completion
+   that posts more work doesn't run while we hold the lock. */
+void DbWorker::runCompletions()
+{
+	std::deque<Task> completions;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		completions.swap(_completions);
+		_in_flight -= completions.size();
+	}
+
+	for(unsigned i = 0; i < completions.size(); i++)
+	{
+		if(completions[i])
+			completions[i]();
+	}
+}
+
+// True while any posted job has not had its completion run yet.
+bool DbWorker::busy()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _in_flight > 0;
+}
+
+unsigned DbWorker::inFlight()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _in_flight;
+}
+
+unsigned DbWorker::threadCount() const
+{
+	return (unsigned) _threads.size();
+}
+
+/* The index (from 0 up to threadCount()) of the worker thread calling, so a read
+   job can pick the connection that belongs to it; -1 when not on a worker. */
+int DbWorker::currentThread()
+{
+	return t_thread_index;
+}
+
+}
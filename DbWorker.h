@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+/* DbWorker runs database work on its own threads so the IRC thread never waits on
+   SQLite. Each job's completion is queued back and only runs when the IRC thread
+   calls runCompletions(), so replies are always sent from the thread that owns
+   the session.
+
+   Jobs posted with post() or postWrite() run alone, in the order they were
+   posted: everything before has finished and nothing after starts until they are
+   done. Jobs posted with postRead() run alongside each other on any free thread,
+   except that jobs on the same strand (e.g. a channel) run one at a time in order,
+   so their completions come back in order too. A read job must only use state of
+   its own thread (see currentThread()).
+
+   Writes can be group committed: consecutive write jobs arriving within a short
+   window share one transaction, and their completions only run once it has
+   committed (or their failure handlers, if it couldn't). */
+class DbWorker
+{
+public:
+	typedef std::function<void()> Task;
+	typedef std::function<bool()> CommitTask;
+
+private:
+	struct Job
+	{
+		Task work;
+		Task done;
+		Task failed;
+		bool write;
+		bool concurrent;
+		std::string strand;
+	};
+
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::deque<Job> _jobs;
+	std::deque<Task> _completions;
+	unsigned _in_flight;
+	unsigned _running;
+	bool _exclusive_running;
+	std::set<std::string> _busy_strands;
+	bool _stopping;
+
+	Task _begin_batch;
+	CommitTask _commit_batch;
+	unsigned _max_batch;
+	std::chrono::milliseconds _batch_window;
+
+	void run(int index);
+	void push(const Job& job);
+	bool nextRunnable(size_t& index) const;
+	void runWriteBatch(Job first, std::unique_lock<std::mutex>& lock);
+
+	DbWorker(const DbWorker&);
+	DbWorker& operator=(const DbWorker&);
+
+public:
+	void post(const Task& work, const Task& done = Task());
+	void postRead(const std::string& strand, const Task& work, const Task& done);
+	void postWrite(const Task& work, const Task& done, const Task& failed);
+	void setGroupCommit(const Task& begin, const CommitTask& commit, unsigned max_batch, unsigned window_ms);
+	void runCompletions();
+	bool busy();
+	unsigned inFlight();
+	unsigned threadCount() const;
+
+	static int currentThread();
+
+	DbWorker(unsigned threads = 1);
+	~DbWorker();
+};
+
+}
@@ -6,50 +6,180 @@
 namespace IRCOptotron
 {
 
-HostmaskAuthorizer::HostmaskAuthorizer(std::string db_filename)
+/* PRAGMA user_version of a hostmask DB whose rows say how they are matched.
+   Masks in a version 0 database were all matched as "contains every *-separated
+   part"; a version 1 database had them rewritten to *mask*. */
+static const int HOSTMASK_SCHEMA_VERSION = 2;
+
+HostmaskAuthorizer::HostmaskAuthorizer(std::string db_filename, size_t cache_capacity) : _decision_cache(cache_capacity)
 {
 	_db = 0;
+	_generation = 0;
+	_cache_hits = 0;
+	_cache_misses = 0;
+	_metrics = 0;
 
 	if(sqlite3_open(db_filename.c_str(), &_db) != SQLITE_OK)
 	{
-		// TODO: Autogenerate DB if it's not found.
 		std::cerr << "Error opening database " << db_filename << std::endl;
+		sqlite3_close(_db);
+		_db = 0;
 	}
+	else
+	{
+		createSchema();
+		migrateMasks();
+		prepareStatements();
+		loadHostmasks(HOSTMASK_AUTHORIZED);
+		loadHostmasks(HOSTMASK_BANNED);
 
-	std::cout << "Created";
+		std::cout << "Hostmask database " << db_filename << " opened." << std::endl;
+	}
 }
 
 HostmaskAuthorizer::~HostmaskAuthorizer()
 {
+	_statements.finalizeAll();
+
 	if(_db)
 	{
 		sqlite3_close(_db);
 	}
 }
 
-HostmaskResponse HostmaskAuthorizer::removeHostmaskByID(const int& id, HostmaskType type)
+bool HostmaskAuthorizer::isOpen() const
 {
-	if(!_db)
-		return HOSTMASK_RESPONSE_NODB;
+	return _db != 0;
+}
 
-	std::string table = "";
+std::string HostmaskAuthorizer::getTableName(HostmaskType type)
+{
 	if(type == HOSTMASK_AUTHORIZED)
-		table = "authorized_hostmasks";
+		return "authorized_hostmasks";
 	else
-		table = "banned_hostmasks";
+		return "banned_hostmasks";
+}
 
-	HostmaskResponse ret = HOSTMASK_RESPONSE_NOROW;
+/* Creates both hostmask tables if they're missing, so a new database can be
+   started from nothing. */
+void HostmaskAuthorizer::createSchema()
+{
+	HostmaskType types[] = { HOSTMASK_AUTHORIZED, HOSTMASK_BANNED };
+	for(unsigned i = 0; i < 2; i++)
+	{
+		std::string table = getTableName(types[i]);
+		std::string query =
+			"CREATE TABLE IF NOT EXISTS "+table+" ("
+			"  id INTEGER PRIMARY KEY,"
+			"  nick TEXT,"
+			"  hostmask TEXT,"
+			"  substring_match INTEGER NOT NULL DEFAULT 0"
+			");"
+			"CREATE INDEX IF NOT EXISTS "+table+"_nick ON "+table+" (nick);";
+
+		char* error = 0;
+		if(sqlite3_exec(_db, query.c_str(), 0, 0, &error) != SQLITE_OK)
+		{
+			std::cerr << "Error creating " << table << ": " << (error ? error : "") << std::endl;
+		}
 
-	std::string query = "DELETE FROM "+table+" WHERE id = ?";
+		sqlite3_free(error);
+	}
+}
 
+/* Masks added from now on are whole IRC masks, anchored at both ends, but rows
+   from before masks were compiled only matched as substrings: user@host matched
+   anyone on that host. Rather than rewrite them, upgrading a version 0 database
+   sets substring_match on every row it already has, and those rows are matched
+   the old way (see HostmaskMatcher). */
+void HostmaskAuthorizer::migrateMasks()
+{
 	sqlite3_stmt* stmt = 0;
+	int version = 0;
+	if(sqlite3_prepare_v2(_db, "PRAGMA user_version", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if(version >= HOSTMASK_SCHEMA_VERSION)
+		return;
+
+	std::string query = "BEGIN;";
+	HostmaskType types[] = { HOSTMASK_AUTHORIZED, HOSTMASK_BANNED };
+	for(unsigned i = 0; i < 2; i++)
+	{
+		std::string table = getTableName(types[i]);
+
+		// createSchema only adds the column to tables it creates itself.
+		stmt = 0;
+		bool has_column = sqlite3_prepare_v2(_db, ("SELECT substring_match FROM "+table).c_str(), -1, &stmt, 0) == SQLITE_OK;
+		sqlite3_finalize(stmt);
+
+		if(!has_column)
+			query += "ALTER TABLE "+table+" ADD COLUMN substring_match INTEGER NOT NULL DEFAULT 0;";
+		if(version == 0)
+			query += "UPDATE "+table+" SET substring_match = 1;";
+	}
+	query += "PRAGMA user_version = " + std::to_string(HOSTMASK_SCHEMA_VERSION) + "; COMMIT;";
+
+	char* error = 0;
+	if(sqlite3_exec(_db, query.c_str(), 0, 0, &error) != SQLITE_OK)
+	{
+		std::cerr << "Error upgrading hostmasks: " << (error ? error : "") << std::endl;
+		sqlite3_exec(_db, "ROLLBACK;", 0, 0, 0);
+	}
+	else if(sqlite3_total_changes(_db) > 0)
+	{
+		std::cout << "Existing hostmasks still match anywhere in the host; new ones match the whole host." << std::endl;
+	}
+
+	sqlite3_free(error);
+}
+
+void HostmaskAuthorizer::prepareStatements()
+{
+	_statements.attach(_db);
+
+	HostmaskType types[] = { HOSTMASK_AUTHORIZED, HOSTMASK_BANNED };
+	for(unsigned i = 0; i < 2; i++)
+	{
+		std::string table = getTableName(types[i]);
+
+		_statements.prepare(STMT_DELETE * 2 + i, "DELETE FROM "+table+" WHERE id = ?");
+		_statements.prepare(STMT_INSERT * 2 + i, "INSERT INTO "+table+" (nick, hostmask) VALUES(?,?)");
+		_statements.prepare(STMT_BY_NICK * 2 + i, "SELECT id, hostmask, substring_match FROM "+table+" WHERE nick = ?");
+	}
+}
+
+sqlite3_stmt* HostmaskAuthorizer::getStatement(HostmaskStatement stmt, HostmaskType type) const
+{
+	return _statements.get(stmt * 2 + (type == HOSTMASK_AUTHORIZED ? 0 : 1));
+}
 
+HostmaskMatcher& HostmaskAuthorizer::getMatcher(HostmaskType type)
+{
+	if(type == HOSTMASK_AUTHORIZED)
+		return _authorized;
+	else
+		return _banned;
+}
+
+/* Pulls every mask of the given type into its in-memory matcher. This is the only
+   full-table read; afterwards add/remove keep the matcher in step with the table. */
+void HostmaskAuthorizer::loadHostmasks(HostmaskType type)
+{
+	HostmaskMatcher& matcher = getMatcher(type);
+	matcher.clear();
+
+	std::string query = "SELECT id, hostmask, substring_match FROM "+getTableName(type);
+
+	sqlite3_stmt* stmt = 0;
 	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
 	{
-		sqlite3_bind_int(stmt, 1, id);
-		if(sqlite3_step(stmt) == SQLITE_DONE)
+		while(sqlite3_step(stmt) == SQLITE_ROW)
 		{
-			ret = HOSTMASK_RESPONSE_OK;
+			const unsigned char* mask = sqlite3_column_text(stmt, 1);
+			if(mask)
+				matcher.add(sqlite3_column_int(stmt, 0), std::string((char*) mask), sqlite3_column_int(stmt, 2) != 0);
 		}
 	}
 	else
@@ -58,130 +188,165 @@ HostmaskResponse HostmaskAuthorizer::removeHostmaskByID(const int& id, HostmaskT
 	}
 
 	sqlite3_finalize(stmt);
+}
+
+HostmaskResponse HostmaskAuthorizer::removeHostmaskByID(const int& id, HostmaskType type)
+{
+	ScopedTimer timer(_metrics, "ircoptotron_hostmaskdb_seconds", "method=\"removeHostmaskByID\"");
+
+	if(!_db)
+		return HOSTMASK_RESPONSE_NODB;
+
+	HostmaskResponse ret = HOSTMASK_RESPONSE_NOROW;
+
+	ScopedStatement stmt(getStatement(STMT_DELETE, type));
+
+	if(stmt)
+	{
+		sqlite3_bind_int(stmt, 1, id);
+		if(sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(_db) > 0)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			getMatcher(type).remove(id);
+			_generation++;
+			ret = HOSTMASK_RESPONSE_OK;
+		}
+	}
 
 	return ret;
 }
 
 HostmaskResponse HostmaskAuthorizer::addHostmask(const std::string& nick, const std::string& hostmask, HostmaskType type)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_hostmaskdb_seconds", "method=\"addHostmask\"");
+
 	if(!_db)
 		return HOSTMASK_RESPONSE_NODB;
 
-	std::string table = "";
-	if(type == HOSTMASK_AUTHORIZED)
-		table = "authorized_hostmasks";
-	else
-		table = "banned_hostmasks";
-
 	HostmaskResponse ret = HOSTMASK_RESPONSE_OK;
 
-	std::string query = "INSERT INTO "+table+" (nick, hostmask) VALUES(?,?)";
+	ScopedStatement stmt(getStatement(STMT_INSERT, type));
 
-	sqlite3_stmt* stmt = 0;
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, nick.c_str(), nick.size(), SQLITE_STATIC);
-		sqlite3_bind_text(stmt, 2, hostmask.c_str(), nick.size(), SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, hostmask.c_str(), hostmask.size(), SQLITE_STATIC);
 
 		if(sqlite3_step(stmt) != SQLITE_DONE)
 		{
 			ret = HOSTMASK_RESPONSE_BUSY;
 		}
+		else
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			getMatcher(type).add((int) sqlite3_last_insert_rowid(_db), hostmask);
+			_generation++;
+		}
 	}
-	else
-	{
-		std::cerr << "Error with query: " << query << std::endl;
-	}
-
-	sqlite3_finalize(stmt);
 
 	return ret;
 }
 
 HostmaskResponse HostmaskAuthorizer::getHostmasksByNick(const std::string& nick, const HostmaskType& type, std::vector<std::string>& masks)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_hostmaskdb_seconds", "method=\"getHostmasksByNick\"");
+
 	if(!_db)
 		return HOSTMASK_RESPONSE_NODB;
 
-	std::string table;
-	if(type == HOSTMASK_AUTHORIZED)
-		table = "authorized_hostmasks";
-	else
-		table = "banned_hostmasks";
-
-	std::string query = "SELECT id, hostmask FROM "+table+" WHERE nick = ?";
+	ScopedStatement stmt(getStatement(STMT_BY_NICK, type));
 
-	sqlite3_stmt* stmt = 0;
-	
-	if(sqlite3_prepare(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	if(stmt)
 	{
 		sqlite3_bind_text(stmt, 1, nick.c_str(), nick.size(), SQLITE_STATIC);
 		while(sqlite3_step(stmt) == SQLITE_ROW)
 		{
 			std::string pushme = std::string((char*)sqlite3_column_text(stmt,0)) + ") " + std::string((char*)sqlite3_column_text(stmt, 1));
+			if(sqlite3_column_int(stmt, 2))
+				pushme += " (matches anywhere in the host)";
 			masks.push_back(pushme);
 		}
 	}
-	else
-	{
-		std::cerr << "Error in query: " << query << std::endl;
-	}
 
-	sqlite3_finalize(stmt);
 	return HOSTMASK_RESPONSE_OK;
 }
 
 bool HostmaskAuthorizer::isAuthorized(const std::string& host)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_hostmaskdb_seconds", "method=\"isAuthorized\"");
+
 	if(!_db)
 		return false;
 
-	std::string query = "SELECT hostmask FROM authorized_hostmasks";
-	
-	sqlite3_stmt* stmt = 0;
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
-	{
-		while(sqlite3_step(stmt) == SQLITE_ROW)
-		{
-			std::string mask = std::string((char*) sqlite3_column_text(stmt, 0));
-			if(MiscStringHelpers::stringContainsAllTokens(host, MiscStringHelpers::tokenizeString(mask, '*')))
-			{
-				return true;
-			}
-		}
-	}
-	else
-	{
-		std::cerr << "Error with query: " << query;
-	}
-
-	sqlite3_finalize(stmt);
-
-	return false;
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _authorized.matches(host);
 }
 
 bool HostmaskAuthorizer::isBanned(const std::string& host)
 {
+	ScopedTimer timer(_metrics, "ircoptotron_hostmaskdb_seconds", "method=\"isBanned\"");
+
 	if(!_db)
 		return false;
 
-	std::string query = "SELECT hostmask FROM banned_hostmasks";
-	
-	sqlite3_stmt* stmt = 0;
-	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &stmt, 0) == SQLITE_OK)
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _banned.matches(host);
+}
+
+/* Authorized takes precedence over banned, matching how joins are handled. Only
+   a cache miss or a stale entry touches the matchers. */
+HostmaskDecision HostmaskAuthorizer::getDecision(const std::string& host)
+{
+	ScopedTimer timer(_metrics, "ircoptotron_hostmaskdb_seconds", "method=\"getDecision\"");
+
+	if(!_db)
+		return HOSTMASK_DECISION_NONE;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	CachedDecision cached;
+	if(_decision_cache.get(host, cached) && cached.generation == _generation)
 	{
-		while(sqlite3_step(stmt) == SQLITE_ROW)
-		{
-			std::string mask = std::string((char*) sqlite3_column_text(stmt, 0));
-			if(MiscStringHelpers::stringContainsAllTokens(host, MiscStringHelpers::tokenizeString(mask, '*')))
-			{
-				return true;
-			}
-		}
+		_cache_hits++;
+		return cached.decision;
 	}
 
-	sqlite3_finalize(stmt);
-	return false;
+	_cache_misses++;
+
+	cached.generation = _generation;
+	if(_authorized.matches(host))
+		cached.decision = HOSTMASK_DECISION_AUTHORIZED;
+	else if(_banned.matches(host))
+		cached.decision = HOSTMASK_DECISION_BANNED;
+	else
+		cached.decision = HOSTMASK_DECISION_NONE;
+
+	_decision_cache.put(host, cached);
+	return cached.decision;
+}
+
+void HostmaskAuthorizer::setCacheCapacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_decision_cache.setCapacity(capacity);
+}
+
+unsigned long HostmaskAuthorizer::getCacheHits() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _cache_hits;
+}
+
+unsigned long HostmaskAuthorizer::getCacheMisses() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _cache_misses;
+}
+
+// Metrics must outlive the HostmaskAuthorizer; null turns timing off.
+void HostmaskAuthorizer::setMetrics(Metrics* metrics)
+{
+	_metrics = metrics;
 }
 
 }
\ No newline at end of file
@@ -1,10 +1,16 @@
 #pragma once
 
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <sqlite\sqlite3.h>
 
+#include "HostmaskMatcher.h"
+#include "LruCache.h"
+#include "Metrics.h"
+#include "StatementCache.h"
+
 namespace IRCOptotron
 {
 
@@ -22,20 +28,75 @@ enum HostmaskResponse
 	HOSTMASK_RESPONSE_BUSY
 };
 
+enum HostmaskDecision
+{
+	HOSTMASK_DECISION_NONE,
+	HOSTMASK_DECISION_AUTHORIZED,
+	HOSTMASK_DECISION_BANNED
+};
+
 class HostmaskAuthorizer
 {
 private:
+	// One prepared statement of each kind per hostmask table.
+	enum HostmaskStatement
+	{
+		STMT_DELETE,
+		STMT_INSERT,
+		STMT_BY_NICK
+	};
+
 	sqlite3* _db;
+	StatementCache _statements;
+
+	// Guards the matchers and the decision cache. Lookups come from the IRC thread
+	// while add/remove run on the DB worker.
+	mutable std::mutex _mutex;
+
+	HostmaskMatcher _authorized;
+	HostmaskMatcher _banned;
+
+	// Decisions are stamped with the generation they were computed in; any change
+	// to the hostmask tables bumps _generation, which makes every older entry stale.
+	struct CachedDecision
+	{
+		HostmaskDecision decision;
+		unsigned long generation;
+	};
+
+	LruCache<std::string, CachedDecision> _decision_cache;
+	unsigned long _generation;
+	unsigned long _cache_hits;
+	unsigned long _cache_misses;
+
+	Metrics* _metrics;
+
+	static std::string getTableName(HostmaskType type);
+	HostmaskMatcher& getMatcher(HostmaskType type);
+	void loadHostmasks(HostmaskType type);
+	void createSchema();
+	void migrateMasks();
+	void prepareStatements();
+	sqlite3_stmt* getStatement(HostmaskStatement stmt, HostmaskType type) const;
 
 public:
 	HostmaskResponse removeHostmaskByID(const int& id, HostmaskType type);
 	HostmaskResponse addHostmask(const std::string& nick, const std::string& mask, HostmaskType type);
 	HostmaskResponse getHostmasksByNick(const std::string& nick, const HostmaskType& type, std::vector<std::string>& masks);
 
+	bool isOpen() const;
+
 	bool isAuthorized(const std::string& host);
 	bool isBanned(const std::string& host);
+	HostmaskDecision getDecision(const std::string& host);
+
+	void setCacheCapacity(size_t capacity);
+	unsigned long getCacheHits() const;
+	unsigned long getCacheMisses() const;
+
+	void setMetrics(Metrics* metrics);
 
-	HostmaskAuthorizer(std::string db_filename);
+	HostmaskAuthorizer(std::string db_filename, size_t cache_capacity = 4096);
 	~HostmaskAuthorizer();
 };
 
@@ -0,0 +1,344 @@
+#include "HostmaskMatcher.h"
+#include "StringHelpers.h"
+
+#include <algorithm>
+#include <ctype.h>
+
+namespace IRCOptotron
+{
+
+HostmaskMatcher::HostmaskMatcher()
+{
+	clear();
+}
+
+std::string HostmaskMatcher::foldCase(const std::string& s)
+{
+	std::string folded = s;
+	for(unsigned i = 0; i < folded.length(); i++)
+		folded[i] = tolower((unsigned char) folded[i]);
+
+	return folded;
+}
+
+/* Iterative wildcard match; on a mismatch we only ever backtrack to the most
+   recent '*', which keeps this linear in practice for hostmask-sized input. */
+bool HostmaskMatcher::globMatch(const std::string& pattern, const std::string& str)
+{
+	size_t p = 0, s = 0;
+	size_t star = std::string::npos, mark = 0;
+
+	while(s < str.length())
+	{
+		if(p < pattern.length() && (pattern[p] == '?' || pattern[p] == str[s]))
+		{
+			p++;
+			s++;
+		}
+		else if(p < pattern.length() && pattern[p] == '*')
+		{
+			star = p++;
+			mark = s;
+		}
+		else if(star != std::string::npos)
+		{
+			p = star + 1;
+			s = ++mark;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	while(p < pattern.length() && pattern[p] == '*')
+		p++;
+
+	return p == pattern.length();
+}
+
+bool HostmaskMatcher::containsAllParts(const std::vector<std::string>& parts, const std::string& str)
+{
+	for(unsigned i = 0; i < parts.size(); i++)
+	{
+		if(str.find(parts[i]) == std::string::npos)
+			return false;
+	}
+
+	return true;
+}
+
+// The longest run of pattern with none of wildcards in it; empty if there is none.
+std::string HostmaskMatcher::longestSegment(const std::string& pattern, const char* wildcards)
+{
+	size_t best = 0, best_length = 0;
+	size_t start = 0;
+
+	while(start < pattern.length())
+	{
+		size_t end = pattern.find_first_of(wildcards, start);
+		if(end == std::string::npos)
+			end = pattern.length();
+
+		if(end - start > best_length)
+		{
+			best = start;
+			best_length = end - start;
+		}
+
+		start = end + 1;
+	}
+
+	return pattern.substr(best, best_length);
+}
+
+unsigned HostmaskMatcher::insertPath(Trie& trie, const std::string& path)
+{
+	unsigned node = 0;
+
+	for(unsigned i = 0; i < path.length(); i++)
+	{
+		std::map<char, unsigned>::iterator it = trie.nodes[node].children.find(path[i]);
+		if(it != trie.nodes[node].children.end())
+		{
+			node = it->second;
+			continue;
+		}
+
+		unsigned child;
+		if(!trie.free.empty())
+		{
+			child = trie.free.back();
+			trie.free.pop_back();
+		}
+		else
+		{
+			trie.nodes.push_back(TrieNode());
+			child = trie.nodes.size() - 1;
+		}
+
+		trie.nodes[child].parent = node;
+		trie.nodes[child].edge = path[i];
+		trie.nodes[node].children[path[i]] = child;
+		node = child;
+	}
+
+	return node;
+}
+
+// Takes id off node, then unlinks node and any ancestors it leaves with nothing in them.
+void HostmaskMatcher::removeFromNode(Trie& trie, unsigned node, int id)
+{
+	eraseId(trie.nodes[node].masks, id);
+
+	while(node != 0 && trie.nodes[node].masks.empty() && trie.nodes[node].children.empty())
+	{
+		unsigned parent = trie.nodes[node].parent;
+		trie.nodes[parent].children.erase(trie.nodes[node].edge);
+		trie.free.push_back(node);
+		node = parent;
+	}
+}
+
+void HostmaskMatcher::resetTrie(Trie& trie)
+{
+	trie.nodes.assign(1, TrieNode());
+	trie.nodes[0].parent = 0;
+	trie.nodes[0].edge = 0;
+	trie.free.clear();
+}
+
+void HostmaskMatcher::eraseId(std::vector<int>& ids, int id)
+{
+	std::vector<int>::iterator it = std::find(ids.begin(), ids.end(), id);
+	if(it != ids.end())
+		ids.erase(it);
+}
+
+bool HostmaskMatcher::matchCandidates(const std::vector<int>& ids, const std::string& host) const
+{
+	for(unsigned i = 0; i < ids.size(); i++)
+	{
+		std::map<int, CompiledMask>::const_iterator it = _masks.find(ids[i]);
+		if(it == _masks.end())
+			continue;
+
+		const CompiledMask& compiled = it->second;
+		if(compiled.substring ? containsAllParts(compiled.parts, host) : globMatch(compiled.pattern, host))
+			return true;
+	}
+
+	return false;
+}
+
+void HostmaskMatcher::add(int id, const std::string& mask, bool substring)
+{
+	remove(id);
+
+	CompiledMask compiled;
+	compiled.pattern = foldCase(mask);
+	compiled.substring = substring;
+	compiled.node = 0;
+
+	size_t first_wild = compiled.pattern.find_first_of("*?");
+	size_t last_wild = compiled.pattern.find_last_of("*?");
+
+	if(substring)
+	{
+		// Any part would do as the key, since every one must be in the host; the
+		// longest turns up in the fewest places.
+		compiled.parts = MiscStringHelpers::tokenizeString(compiled.pattern, '*');
+
+		std::string key;
+		for(unsigned i = 0; i < compiled.parts.size(); i++)
+		{
+			if(compiled.parts[i].length() > key.length())
+				key = compiled.parts[i];
+		}
+
+		compiled.index = INDEX_SEGMENT;
+		compiled.node = insertPath(_segment_trie, key);
+		_segment_trie.nodes[compiled.node].masks.push_back(id);
+	}
+	else if(first_wild == std::string::npos)
+	{
+		compiled.index = INDEX_EXACT;
+		_exact[compiled.pattern].push_back(id);
+	}
+	else if(last_wild + 1 < compiled.pattern.length())
+	{
+		// Suffix trie is keyed on the reversed literal tail of the mask.
+		std::string suffix = compiled.pattern.substr(last_wild + 1);
+		std::string reversed(suffix.rbegin(), suffix.rend());
+
+		compiled.index = INDEX_SUFFIX;
+		compiled.node = insertPath(_suffix_trie, reversed);
+		_suffix_trie.nodes[compiled.node].masks.push_back(id);
+	}
+	else if(first_wild > 0)
+	{
+		compiled.index = INDEX_PREFIX;
+		compiled.node = insertPath(_prefix_trie, compiled.pattern.substr(0, first_wild));
+		_prefix_trie.nodes[compiled.node].masks.push_back(id);
+	}
+	else
+	{
+		compiled.index = INDEX_SEGMENT;
+		compiled.node = insertPath(_segment_trie, longestSegment(compiled.pattern, "*?"));
+		_segment_trie.nodes[compiled.node].masks.push_back(id);
+	}
+
+	_masks[id] = compiled;
+}
+
+void HostmaskMatcher::remove(int id)
+{
+	std::map<int, CompiledMask>::iterator it = _masks.find(id);
+	if(it == _masks.end())
+		return;
+
+	CompiledMask& compiled = it->second;
+
+	switch(compiled.index)
+	{
+	case INDEX_EXACT:
+		eraseId(_exact[compiled.pattern], id);
+		if(_exact[compiled.pattern].empty())
+			_exact.erase(compiled.pattern);
+		break;
+	case INDEX_SUFFIX:
+		removeFromNode(_suffix_trie, compiled.node, id);
+		break;
+	case INDEX_PREFIX:
+		removeFromNode(_prefix_trie, compiled.node, id);
+		break;
+	default:
+		removeFromNode(_segment_trie, compiled.node, id);
+		break;
+	}
+
+	_masks.erase(it);
+}
+
+void HostmaskMatcher::clear()
+{
+	_masks.clear();
+	_exact.clear();
+
+	resetTrie(_suffix_trie);
+	resetTrie(_prefix_trie);
+	resetTrie(_segment_trie);
+}
+
+bool HostmaskMatcher::matches(const std::string& host) const
+{
+	if(_masks.empty())
+		return false;
+
+	std::string folded = foldCase(host);
+
+	std::map<std::string, std::vector<int> >::const_iterator exact = _exact.find(folded);
+	if(exact != _exact.end() && !exact->second.empty())
+		return true;
+
+	// Walk the host from the end; every node we pass owns masks whose literal tail agrees.
+	unsigned node = 0;
+	for(size_t i = folded.length(); i > 0; i--)
+	{
+		std::map<char, unsigned>::const_iterator it = _suffix_trie.nodes[node].children.find(folded[i - 1]);
+		if(it == _suffix_trie.nodes[node].children.end())
+			break;
+
+		node = it->second;
+		if(matchCandidates(_suffix_trie.nodes[node].masks, folded))
+			return true;
+	}
+
+	node = 0;
+	for(size_t i = 0; i < folded.length(); i++)
+	{
+		std::map<char, unsigned>::const_iterator it = _prefix_trie.nodes[node].children.find(folded[i]);
+		if(it == _prefix_trie.nodes[node].children.end())
+			break;
+
+		node = it->second;
+		if(matchCandidates(_prefix_trie.nodes[node].masks, folded))
+			return true;
+	}
+
+	// Masks with no literal at all (e.g. *) sit on the root.
+	if(matchCandidates(_segment_trie.nodes[0].masks, folded))
+		return true;
+
+	// Every position the host could contain a mask's key segment from.
+	for(size_t start = 0; start < folded.length(); start++)
+	{
+		node = 0;
+		for(size_t i = start; i < folded.length(); i++)
+		{
+			std::map<char, unsigned>::const_iterator it = _segment_trie.nodes[node].children.find(folded[i]);
+			if(it == _segment_trie.nodes[node].children.end())
+				break;
+
+			node = it->second;
+			if(matchCandidates(_segment_trie.nodes[node].masks, folded))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+size_t HostmaskMatcher::size() const
+{
+	return _masks.size();
+}
+
+// Trie nodes in use, roots included.
+size_t HostmaskMatcher::nodeCount() const
+{
+	return _suffix_trie.nodes.size() - _suffix_trie.free.size() + _prefix_trie.nodes.size() - _prefix_trie.free.size()
+		+ _segment_trie.nodes.size() - _segment_trie.free.size();
+}
+
+}
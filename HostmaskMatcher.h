@@ -0,0 +1,86 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+/* HostmaskMatcher holds a set of compiled IRC hostmasks ('*' and '?' wildcards,
+   case-insensitive) and answers whether a nick!user@host matches any of them.
+   Masks are indexed by their anchored literal suffix (or prefix when the mask
+   ends in a wildcard), so a lookup walks the host string once and only fully
+   matches the handful of masks whose anchored literal already agrees. Masks
+   wildcarded at both ends, and substring masks, are indexed by their longest
+   literal segment instead, which a lookup finds by walking the host from every
+   position. Removing a mask prunes the trie nodes it leaves empty, and their
+   slots are reused.
+
+   A substring mask is matched the way hostmasks were before masks were
+   compiled: the host must contain every *-separated part, in any order, and '?'
+   is an ordinary character. */
+class HostmaskMatcher
+{
+private:
+	struct TrieNode
+	{
+		std::map<char, unsigned> children;
+		std::vector<int> masks;
+		unsigned parent;
+		char edge;   // the character parent reaches this node by
+	};
+
+	struct Trie
+	{
+		std::vector<TrieNode> nodes;   // nodes[0] is the root
+		std::vector<unsigned> free;    // pruned slots, reused before growing nodes
+	};
+
+	struct CompiledMask
+	{
+		std::string pattern;
+		std::vector<std::string> parts;   // substring masks only
+		bool substring;
+		unsigned node;
+		int index;
+	};
+
+	enum IndexType
+	{
+		INDEX_EXACT,
+		INDEX_SUFFIX,
+		INDEX_PREFIX,
+		INDEX_SEGMENT
+	};
+
+	std::map<int, CompiledMask> _masks;
+	std::map<std::string, std::vector<int> > _exact;
+	Trie _suffix_trie;
+	Trie _prefix_trie;
+	Trie _segment_trie;
+
+	static std::string foldCase(const std::string& s);
+	static bool globMatch(const std::string& pattern, const std::string& str);
+	static bool containsAllParts(const std::vector<std::string>& parts, const std::string& str);
+	static std::string longestSegment(const std::string& pattern, const char* wildcards);
+
+	static unsigned insertPath(Trie& trie, const std::string& path);
+	static void removeFromNode(Trie& trie, unsigned node, int id);
+	static void resetTrie(Trie& trie);
+	static void eraseId(std::vector<int>& ids, int id);
+	bool matchCandidates(const std::vector<int>& ids, const std::string& host) const;
+
+public:
+	void add(int id, const std::string& mask, bool substring = false);
+	void remove(int id);
+	void clear();
+
+	bool matches(const std::string& host) const;
+	size_t size() const;
+	size_t nodeCount() const;
+
+	HostmaskMatcher();
+};
+
+}
@@ -0,0 +1,440 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include "IrcConnection.h"
+
+namespace IRCOptotron
+{
+
+// Many times the longest line RFC 1459 allows (512 bytes), so a burst of them
+// can be taken in one recv().
+static const size_t RECEIVE_BUFFER_SIZE = 16384;
+
+// Outgoing lines handed to the kernel per writev call.
+static const unsigned MAX_WRITE_LINES = 64;
+
+// RFC 1459 allows a command and at most 15 params.
+static const unsigned MAX_PARAMS = 15;
+
+static bool wouldBlock()
+{
+#ifdef _WIN32
+	int error = WSAGetLastError();
+	return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == EINTR;
+#endif
+}
+
+static bool setNonBlocking(SOCKET socket)
+{
+#ifdef _WIN32
+	u_long non_blocking = 1;
+	return ioctlsocket(socket, FIONBIO, &non_blocking) == 0;
+#else
+	int flags = fcntl(socket, F_GETFL, 0);
+	return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+IrcConnection::IrcConnection(IrcEventCallbacks* callbacks, void* ctx)
+{
+	_socket = INVALID_SOCKET;
+	_connecting = false;
+	_poller = 0;
+	_callbacks = callbacks;
+	_ctx = ctx;
+	_in.resize(RECEIVE_BUFFER_SIZE);
+	_in_start = 0;
+	_in_end = 0;
+	_out_offset = 0;
+}
+
+IrcConnection::~IrcConnection()
+{
+	closeSocket();
+}
+
+/* Starts connecting and queues our registration; both finish from process(). */
+bool IrcConnection::connect(const std::string& server, unsigned short port, const std::string& nick)
+{
+	disconnect();
+
+	char port_str[8];
+	sprintf(port_str, "%u", port);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* addresses = 0;
+	if(getaddrinfo(server.c_str(), port_str, &hints, &addresses) != 0 || !addresses)
+		return fail("could not resolve " + server);
+
+	_socket = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+	if(_socket == INVALID_SOCKET || !setNonBlocking(_socket))
+	{
+		freeaddrinfo(addresses);
+		return fail("could not create socket");
+	}
+
+	int result = ::connect(_socket, addresses->ai_addr, (int) addresses->ai_addrlen);
+	freeaddrinfo(addresses);
+
+	if(result != 0 && !wouldBlock())
+		return fail("could not connect to " + server);
+
+	_connecting = true;
+	_nick = nick;
+
+	send("NICK " + nick);
+	send("USER " + nick + " 0 * :" + nick);
+
+	return true;
+}
+
+void IrcConnection::disconnect()
+{
+	closeSocket();
+
+	_connecting = false;
+	_in_start = 0;
+	_in_end = 0;
+	_out.clear();
+	_out_offset = 0;
+}
+
+// The poller is told first, as the socket's number may be handed out again at once.
+void IrcConnection::closeSocket()
+{
+	if(_socket != INVALID_SOCKET)
+	{
+		if(_poller)
+			_poller->unwatch(_socket);
+
+		closesocket(_socket);
+	}
+
+	_socket = INVALID_SOCKET;
+}
+
+bool IrcConnection::fail(const std::string& error)
+{
+	_last_error = error;
+	closeSocket();
+	return false;
+}
+
+bool IrcConnection::isConnected() const
+{
+	return _socket != INVALID_SOCKET;
+}
+
+const char* IrcConnection::getLastError() const
+{
+	return _last_error.c_str();
+}
+
+void IrcConnection::watch(IrcPoller& poller)
+{
+	if(_socket == INVALID_SOCKET)
+		return;
+
+	_poller = &poller;
+	poller.watch(_socket, _connecting || !_out.empty());
+}
+
+// False if the connection was lost; getLastError() says why.
+bool IrcConnection::process(IrcPoller& poller)
+{
+	if(_socket == INVALID_SOCKET)
+		return false;
+
+	if(_connecting)
+	{
+		if(!poller.isWritable(_socket))
+			return true;
+
+		if(!finishConnect())
+			return false;
+	}
+
+	if(poller.isReadable(_socket) && !readAvailable())
+		return false;
+
+	if(poller.isWritable(_socket) && !writePending())
+		return false;
+
+	return true;
+}
+
+bool IrcConnection::finishConnect()
+{
+	int error = 0;
+	socklen_t length = sizeof(error);
+
+	if(getsockopt(_socket, SOL_SOCKET, SO_ERROR, (char*) &error, &length) != 0 || error != 0)
+		return fail(std::string("connect failed: ") + strerror(error));
+
+	_connecting = false;
+	return true;
+}
+
+/* Everything queued so far goes out now, in as few calls as possible, rather than
+   waiting for the next pass of the loop. */
+bool IrcConnection::flush()
+{
+	if(_socket == INVALID_SOCKET || _connecting || _out.empty())
+		return true;
+
+	return writePending();
+}
+
+// Writes until the queue is empty or the kernel won't take more.
+bool IrcConnection::writePending()
+{
+	while(!_out.empty())
+	{
+		unsigned count = _out.size() < MAX_WRITE_LINES ? (unsigned) _out.size() : MAX_WRITE_LINES;
+		long written;
+
+#ifdef _WIN32
+		WSABUF buffers[MAX_WRITE_LINES];
+		for(unsigned i = 0; i < count; i++)
+		{
+			size_t skip = (i == 0) ? _out_offset : 0;
+			buffers[i].buf = (char*) _out[i].data() + skip;
+			buffers[i].len = (ULONG) (_out[i].size() - skip);
+		}
+
+		DWORD sent = 0;
+		written = (WSASend(_socket, buffers, count, &sent, 0, 0, 0) == 0) ? (long) sent : -1;
+#else
+		struct iovec buffers[MAX_WRITE_LINES];
+		for(unsigned i = 0; i < count; i++)
+		{
+			size_t skip = (i == 0) ? _out_offset : 0;
+			buffers[i].iov_base = (char*) _out[i].data() + skip;
+			buffers[i].iov_len = _out[i].size() - skip;
+		}
+
+		written = (long) writev(_socket, buffers, count);
+#endif
+
+		if(written < 0)
+			return wouldBlock() ? true : fail("write failed");
+
+		// Drop every line that went out whole; a partial one is resumed next time.
+		size_t remaining = (size_t) written;
+		while(!_out.empty() && remaining >= _out.front().size() - _out_offset)
+		{
+			remaining -= _out.front().size() - _out_offset;
+			_out.pop_front();
+			_out_offset = 0;
+		}
+
+		_out_offset += remaining;
+	}
+
+	return true;
+}
+
+/* Reads all that's waiting and dispatches every complete line. Lines are only
+   moved when the partial one at the end needs the room at the start. */
+bool IrcConnection::readAvailable()
+{
+	while(true)
+	{
+		if(_in_end == _in.size())
+		{
+			if(_in_start == 0)
+			{
+				// A "line" that fills the whole buffer isn't IRC; throw it away.
+				_in_end = 0;
+			}
+			else
+			{
+				memmove(&_in[0], &_in[_in_start], _in_end - _in_start);
+				_in_end -= _in_start;
+				_in_start = 0;
+			}
+		}
+
+		int received = recv(_socket, &_in[_in_end], (int) (_in.size() - _in_end), 0);
+		if(received == 0)
+			return fail("connection closed by server");
+
+		if(received < 0)
+			return wouldBlock() ? true : fail("read failed");
+
+		size_t scan = _in_end;
+		_in_end += received;
+
+		for(size_t i = scan; i < _in_end; i++)
+		{
+			if(_in[i] != '\n')
+				continue;
+
+			size_t line_end = i;
+			if(line_end > _in_start && _in[line_end - 1] == '\r')
+				line_end--;
+
+			_in[line_end] = '\0';
+			char* line = &_in[_in_start];
+			_in_start = i + 1;
+
+			if(*line != '\0')
+				dispatch(line);
+
+			// A callback may have closed us (e.g. on ERROR).
+			if(_socket == INVALID_SOCKET)
+				return false;
+		}
+
+		if(_in_start == _in_end)
+		{
+			_in_start = 0;
+			_in_end = 0;
+		}
+	}
+}
+
+/* [:origin] COMMAND param param ... [:trailing], split in place. */
+void IrcConnection::dispatch(char* line)
+{
+	const char* origin = 0;
+	char* p = line;
+
+	if(*p == ':')
+	{
+		origin = p + 1;
+		while(*p != '\0' && *p != ' ')
+			p++;
+
+		if(*p == '\0')
+			return;
+		*p++ = '\0';
+	}
+
+	while(*p == ' ')
+		p++;
+
+	const char* command = p;
+	while(*p != '\0' && *p != ' ')
+		p++;
+	if(*p != '\0')
+		*p++ = '\0';
+
+	const char* params[MAX_PARAMS + 1];
+	unsigned int count = 0;
+
+	while(*p != '\0' && count < MAX_PARAMS)
+	{
+		while(*p == ' ')
+			p++;
+
+		if(*p == '\0')
+			break;
+
+		if(*p == ':')
+		{
+			params[count++] = p + 1;
+			break;
+		}
+
+		params[count++] = p;
+		while(*p != '\0' && *p != ' ')
+			p++;
+		if(*p != '\0')
+			*p++ = '\0';
+	}
+
+	params[count] = 0;
+
+	if(isdigit((unsigned char) command[0]) && isdigit((unsigned char) command[1]) && isdigit((unsigned char) command[2]) && command[3] == '\0')
+	{
+		unsigned int code = (unsigned int) atoi(command);
+
+		// The server may have changed our nick on the way in.
+		if(code == 1)
+		{
+			if(count > 0)
+				_nick = params[0];
+
+			if(_callbacks->event_connect)
+				_callbacks->event_connect(_ctx, "CONNECT", origin, params, count);
+		}
+
+		if(_callbacks->event_numeric)
+			_callbacks->event_numeric(_ctx, code, origin, params, count);
+	}
+	else if(strcmp(command, "PING") == 0)
+	{
+		send(std::string("PONG :") + (count > 0 ? params[0] : ""));
+	}
+	else if(strcmp(command, "PRIVMSG") == 0)
+	{
+		// CTCP (\x01) isn't for us; libircclient doesn't pass it as a channel message either.
+		bool to_channel = count > 1 && params[0][0] != '\0' && strchr("#&!+", params[0][0]) != 0;
+		if(to_channel && params[1][0] != '\x01' && _callbacks->event_channel)
+			_callbacks->event_channel(_ctx, "CHANNEL", origin, params, count);
+	}
+	else if(strcmp(command, "JOIN") == 0)
+	{
+		if(_callbacks->event_join)
+			_callbacks->event_join(_ctx, "JOIN", origin, params, count);
+	}
+	else if(strcmp(command, "NICK") == 0)
+	{
+		size_t nick_length = origin ? strcspn(origin, "!") : 0;
+		if(count > 0 && nick_length == _nick.size() && strncmp(origin, _nick.c_str(), nick_length) == 0)
+			_nick = params[0];
+	}
+	else if(strcmp(command, "ERROR") == 0)
+	{
+		fail(std::string("server closed the link: ") + (count > 0 ? params[0] : ""));
+	}
+}
+
+void IrcConnection::send(const std::string& line)
+{
+	_out.push_back(line + "\r\n");
+}
+
+void IrcConnection::sendMessage(const std::string& target, const std::string& text)
+{
+	send("PRIVMSG " + target + " :" + text);
+}
+
+void IrcConnection::sendMode(const std::string& chan, const std::string& modes)
+{
+	send("MODE " + chan + " " + modes);
+}
+
+void IrcConnection::sendJoin(const std::string& chan)
+{
+	send("JOIN " + chan);
+}
+
+void IrcConnection::sendPart(const std::string& chan)
+{
+	send("PART " + chan);
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "IrcPoller.h"
+
+namespace IRCOptotron
+{
+
+/* The same callbacks libircclient makes, with the ctx given to IrcConnection in
+   place of the session. origin and params point into the receive buffer and are
+   only valid during the call. */
+typedef void (*IrcEventCallback)(void* ctx, const char* event, const char* origin, const char** params, unsigned int count);
+typedef void (*IrcNumericCallback)(void* ctx, unsigned int event, const char* origin, const char** params, unsigned int count);
+
+struct IrcEventCallbacks
+{
+	IrcEventCallback event_connect;   // the server's welcome (001)
+	IrcEventCallback event_channel;   // PRIVMSG to a channel, CTCP excluded
+	IrcEventCallback event_join;
+	IrcNumericCallback event_numeric;
+};
+
+/* IrcConnection is our own client side of RFC 1459, used instead of libircclient
+   when building with IRCOPTOTRON_NATIVE_IRC. The socket is non-blocking and
+   driven by an IrcPoller. Received lines are parsed where they land in the
+   receive buffer: separators are overwritten with NULs and the callbacks get
+   pointers straight into it, so nothing is copied between recv() and dispatch.
+   The buffer is a ring that only moves data when a partial line reaches its end.
+   Outgoing lines queue up and go out together in one writev (WSASend) call.
+   PINGs are answered here, as libircclient does. */
+class IrcConnection
+{
+private:
+	SOCKET _socket;
+	bool _connecting;
+	IrcPoller* _poller;   // the last poller that watched _socket
+	std::string _nick;
+	std::string _last_error;
+
+	IrcEventCallbacks* _callbacks;
+	void* _ctx;
+
+	std::vector<char> _in;
+	size_t _in_start;
+	size_t _in_end;
+
+	std::deque<std::string> _out;
+	size_t _out_offset;
+
+	bool finishConnect();
+	bool readAvailable();
+	bool writePending();
+	void dispatch(char* line);
+	bool fail(const std::string& error);
+	void closeSocket();
+
+	IrcConnection(const IrcConnection&);
+	IrcConnection& operator=(const IrcConnection&);
+
+public:
+	bool connect(const std::string& server, unsigned short port, const std::string& nick);
+	void disconnect();
+	bool isConnected() const;
+
+	void watch(IrcPoller& poller);
+	bool process(IrcPoller& poller);
+	bool flush();
+
+	void send(const std::string& line);
+	void sendMessage(const std::string& target, const std::string& text);
+	void sendMode(const std::string& chan, const std::string& modes);
+	void sendJoin(const std::string& chan);
+	void sendPart(const std::string& chan);
+
+	const char* getLastError() const;
+
+	IrcConnection(IrcEventCallbacks* callbacks, void* ctx);
+	~IrcConnection();
+};
+
+}
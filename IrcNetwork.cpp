@@ -0,0 +1,505 @@
+#include <ctype.h>
+#include <stdlib.h>
+
+#include <iostream>
+
+#include "IrcNetwork.h"
+#include "StringHelpers.h"
+
+namespace IRCOptotron
+{
+
+// Reconnect backoff, in seconds: doubles after every failed attempt up to the max.
+static const unsigned RECONNECT_MIN_DELAY = 2;
+static const unsigned RECONNECT_MAX_DELAY = 300;
+
+IrcNetwork::IrcNetwork(BotController* controller, IrcCallbacks* callbacks, Metrics* metrics, const std::string& name,
+	const std::string& nick, const std::string& server, unsigned short port, const std::vector<std::string>& chanlist)
+#ifdef IRCOPTOTRON_NATIVE_IRC
+	: _connection(callbacks, this)
+#endif
+{
+	_controller = controller;
+	_metrics = metrics;
+	_metric_labels = Metrics::label("network", name);
+	_name = name;
+	_nick = nick;
+	_server = server;
+	_port = port;
+	_chanlist = chanlist;
+	_welcomed = false;
+	_reconnect_pending = false;
+	_reconnect_delay = RECONNECT_MIN_DELAY;
+
+#ifndef IRCOPTOTRON_NATIVE_IRC
+	_session = irc_create_session(callbacks);
+	irc_set_ctx(_session, this);
+#endif
+}
+
+IrcNetwork::~IrcNetwork()
+{
+#ifndef IRCOPTOTRON_NATIVE_IRC
+	if(_session)
+		irc_destroy_session(_session);
+#endif
+}
+
+// SESSION  ---------------------------------------------------------------
+
+#ifdef IRCOPTOTRON_NATIVE_IRC
+
+bool IrcNetwork::startSession()
+{
+	return _connection.connect(_server, _port, _nick);
+}
+
+void IrcNetwork::endSession()
+{
+	_connection.disconnect();
+}
+
+bool IrcNetwork::isConnected()
+{
+	return _connection.isConnected();
+}
+
+void IrcNetwork::watch(IrcPoller& poller)
+{
+	_connection.watch(poller);
+}
+
+bool IrcNetwork::process(IrcPoller& poller)
+{
+	return _connection.process(poller);
+}
+
+const char* IrcNetwork::getLastError()
+{
+	return _connection.getLastError();
+}
+
+void IrcNetwork::sendRaw(const std::string& line)
+{
+	_connection.send(line);
+}
+
+void IrcNetwork::sendMessage(const std::string& target, const std::string& text)
+{
+	_connection.sendMessage(target, text);
+}
+
+void IrcNetwork::sendMode(const std::string& chan, const std::string& modes)
+{
+	_connection.sendMode(chan, modes);
+}
+
+void IrcNetwork::sendJoin(const std::string& chan)
+{
+	_connection.sendJoin(chan);
+}
+
+void IrcNetwork::sendPart(const std::string& chan)
+{
+	_connection.sendPart(chan);
+}
+
+// Lines queued by the send functions go out together, in one write.
+void IrcNetwork::sendQueued()
+{
+	_connection.flush();
+}
+
+#else
+
+bool IrcNetwork::startSession()
+{
+	return irc_connect(_session, _server.c_str(), _port, NULL, _nick.c_str(), NULL, NULL) == 0;
+}
+
+// Puts the session back in its initial state so it can connect again.
+void IrcNetwork::endSession()
+{
+	irc_disconnect(_session);
+}
+
+bool IrcNetwork::isConnected()
+{
+	return irc_is_connected(_session) != 0;
+}
+
+void IrcNetwork::watch(IrcPoller& poller)
+{
+	irc_add_select_descriptors(_session, poller.getReadSet(), poller.getWriteSet(), poller.getMaxFd());
+}
+
+bool IrcNetwork::process(IrcPoller& poller)
+{
+	return irc_process_select_descriptors(_session, poller.getReadSet(), poller.getWriteSet()) == 0;
+}
+
+const char* IrcNetwork::getLastError()
+{
+	return irc_strerror(irc_errno(_session));
+}
+
+void IrcNetwork::sendRaw(const std::string& line)
+{
+	irc_send_raw(_session, "%s", line.c_str());
+}
+
+void IrcNetwork::sendMessage(const std::string& target, const std::string& text)
+{
+	irc_cmd_msg(_session, target.c_str(), text.c_str());
+}
+
+void IrcNetwork::sendMode(const std::string& chan, const std::string& modes)
+{
+	irc_cmd_channel_mode(_session, chan.c_str(), modes.c_str());
+}
+
+void IrcNetwork::sendJoin(const std::string& chan)
+{
+	irc_cmd_join(_session, chan.c_str(), 0);
+}
+
+void IrcNetwork::sendPart(const std::string& chan)
+{
+	irc_cmd_part(_session, chan.c_str());
+}
+
+// libircclient writes as it goes.
+void IrcNetwork::sendQueued()
+{
+}
+
+#endif
+
+// CONNECTION  ------------------------------------------------------------
+
+bool IrcNetwork::connect()
+{
+	std::cout << "[" << _name << "] Attempting to connect to server " << _server << "." << std::endl;
+	if(!startSession())
+	{
+		std::cout << "[" << _name << "] Could not connect: " << getLastError() << std::endl;
+		return false;
+	}
+
+	// NICK and USER count against the server's flood limit like anything else.
+	_outbound.charge(2);
+	return true;
+}
+
+void IrcNetwork::joinChannels()
+{
+	_welcomed = true;
+	_reconnect_delay = RECONNECT_MIN_DELAY;
+
+	for(unsigned i = 0; i < _chanlist.size(); i++)
+	{
+		std::cout << "[" << _name << "] Attempting to join channel: " << _chanlist[i] << std::endl;
+		_outbound.push(OUTBOUND_JOIN, _chanlist[i], "", PRIORITY_MODE);
+	}
+
+	flushOutbound();
+}
+
+/* Called whenever we find ourselves disconnected; does nothing if a reconnect is
+   already scheduled. Up to a quarter of the delay is added at random so networks
+   that dropped together don't all come back at the same moment. Anything tied to
+   the old session is forgotten; the snapshot is kept for when we're back.
+
+   That includes every line still queued and every batched mode, on purpose rather
+   than replayed after the next welcome: ops and bans were decided from the old
+   session's WHO and are redone from the snapshot and a fresh WHO once we rejoin,
+   replies answer commands from a conversation that has moved on, and JOINs are
+   sent again by joinChannels() for whatever the channel list is by then. */
+void IrcNetwork::scheduleReconnect()
+{
+	if(_reconnect_pending)
+		return;
+
+	unsigned delay_ms = _reconnect_delay * 1000 + rand() % (_reconnect_delay * 250 + 1);
+
+	std::cout << "[" << _name << "] Disconnected, reconnecting in " << delay_ms / 1000 << "s." << std::endl;
+
+	_reconnect_pending = true;
+	_reconnect_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+	_reconnect_delay = _reconnect_delay * 2 < RECONNECT_MAX_DELAY ? _reconnect_delay * 2 : RECONNECT_MAX_DELAY;
+
+	_welcomed = false;
+	_outbound.clear();
+	_mode_batcher.clear();
+	_pending_who.clear();
+	_unverified_ops.clear();
+}
+
+bool IrcNetwork::reconnectDue() const
+{
+	return _reconnect_pending && std::chrono::steady_clock::now() >= _reconnect_at;
+}
+
+bool IrcNetwork::reconnect()
+{
+	_reconnect_pending = false;
+
+	endSession();
+	return connect();
+}
+
+// Nicks and channels are keyed as the server compares them, so a reply in another case still finds its entry.
+static std::string lowerKey(const std::string& name)
+{
+	return MiscStringHelpers::ircLower(name);
+}
+
+/* Replaces the channel list, parting the channels that were dropped and joining
+   the ones that are new. Channels in both lists are left alone, so reloading an
+   unchanged list costs nothing. Modes and lines still queued for a channel we
+   leave are dropped with it. Before the server has welcomed us there is nothing
+   to join or part yet; joinChannels() will use the new list. */
+void IrcNetwork::setChannels(const std::vector<std::string>& chanlist)
+{
+	std::set<std::string> wanted, current;
+	for(unsigned i = 0; i < chanlist.size(); i++)
+		wanted.insert(lowerKey(chanlist[i]));
+	for(unsigned i = 0; i < _chanlist.size(); i++)
+		current.insert(lowerKey(_chanlist[i]));
+
+	bool online = _welcomed && isConnected();
+
+	for(unsigned i = 0; i < _chanlist.size(); i++)
+	{
+		if(wanted.count(lowerKey(_chanlist[i])))
+			continue;
+
+		std::cout << "[" << _name << "] Leaving channel: " << _chanlist[i] << std::endl;
+		_pending_who.erase(lowerKey(_chanlist[i]));
+		_unverified_ops.erase(lowerKey(_chanlist[i]));
+		_snapshot.removeChannel(_chanlist[i]);
+		_mode_batcher.discardChannel(_chanlist[i]);
+		_outbound.discardTarget(_chanlist[i]);
+		if(online)
+			_outbound.push(OUTBOUND_PART, _chanlist[i], "", PRIORITY_MODE);
+	}
+
+	for(unsigned i = 0; i < chanlist.size(); i++)
+	{
+		if(current.count(lowerKey(chanlist[i])))
+			continue;
+
+		std::cout << "[" << _name << "] Attempting to join channel: " << chanlist[i] << std::endl;
+		if(online)
+			_outbound.push(OUTBOUND_JOIN, chanlist[i], "", PRIORITY_MODE);
+	}
+
+	_chanlist = chanlist;
+
+	if(online)
+		flushOutbound();
+}
+
+void IrcNetwork::sendMessageToHost(const std::string& host, const std::string& msg)
+{
+	_outbound.push(OUTBOUND_MSG, MiscStringHelpers::nickFromHost(host), msg, PRIORITY_REPLY);
+}
+
+void IrcNetwork::sendMessageToNick(const std::string& nick, const std::string& msg, OutboundPriority priority)
+{
+	_outbound.push(OUTBOUND_MSG, nick, msg, priority);
+}
+
+/* The lines of one reply may be folded together into fewer lines; lines from
+   different replies never are, so each answer reads as it was written. */
+void IrcNetwork::sendReplyToNick(const std::string& nick, const std::vector<std::string>& lines, OutboundPriority priority)
+{
+	for(unsigned i = 0; i < lines.size(); i++)
+		_outbound.push(OUTBOUND_MSG, nick, lines[i], priority, i > 0);
+}
+
+// A full batch goes out straight away rather than waiting for the debounce.
+void IrcNetwork::queueMode(const std::string& chan, char mode, const std::string& arg)
+{
+	if(_mode_batcher.queue(chan, mode, arg))
+		flushModes();
+}
+
+/* Takes a mode off someone. A matching change still waiting in the batch is just
+   dropped, so it can never go out after this one. */
+void IrcNetwork::removeMode(const std::string& chan, char mode, const std::string& arg)
+{
+	if(_mode_batcher.cancel(chan, mode, arg))
+		return;
+
+	_outbound.push(OUTBOUND_MODE, chan, std::string("-") + mode + " " + arg, PRIORITY_MODE);
+}
+
+void IrcNetwork::sendModeLines(const std::vector<ModeLine>& lines)
+{
+	for(unsigned i = 0; i < lines.size(); i++)
+	{
+		_outbound.push(OUTBOUND_MODE, lines[i].chan, lines[i].modes, PRIORITY_MODE);
+	}
+}
+
+void IrcNetwork::flushModes()
+{
+	if(_mode_batcher.empty())
+		return;
+
+	std::vector<ModeLine> lines;
+	_mode_batcher.takeReady(lines);
+	sendModeLines(lines);
+}
+
+/* Everything we say goes through _outbound, JOINs, PARTs and WHOs included; this is
+   the only place lines actually leave. PING replies are answered by the session
+   itself and never queue. */
+void IrcNetwork::flushOutbound()
+{
+	OutboundLine line;
+	bool sent = false;
+
+	while(_outbound.pop(line))
+	{
+		switch(line.kind)
+		{
+		case OUTBOUND_MODE: sendMode(line.target, line.text); break;
+		case OUTBOUND_JOIN: sendJoin(line.target); break;
+		case OUTBOUND_PART: sendPart(line.target); break;
+		case OUTBOUND_WHO: sendRaw("WHO " + line.target); break;
+		default: sendMessage(line.target, line.text); break;
+		}
+
+		sent = true;
+
+		if(_metrics)
+		{
+			double delay = std::chrono::duration<double>(std::chrono::steady_clock::now() - line.queued).count();
+			_metrics->observe("ircoptotron_outbound_delay_seconds", _metric_labels, delay);
+			_metrics->increment("ircoptotron_lines_sent_total", _metric_labels);
+		}
+	}
+
+	if(sent)
+		sendQueued();
+}
+
+// Milliseconds until the next queued line may go, or -1 if nothing is queued.
+long IrcNetwork::timeUntilNextSend()
+{
+	if(_outbound.depth() == 0)
+		return -1;
+
+	return (long) _outbound.timeUntilNextSend().count();
+}
+
+void IrcNetwork::reportOutboundStats()
+{
+	std::cout << "[" << _name << "] Outbound: depth " << _outbound.depth()
+		<< ", sent " << _outbound.getSentCount()
+		<< ", merged " << _outbound.getMergedCount()
+		<< ", avg delay " << _outbound.getAverageDelayMs() << "ms"
+		<< ", max delay " << _outbound.getMaxDelayMs() << "ms" << std::endl;
+}
+
+void IrcNetwork::updateMetrics()
+{
+	if(!_metrics)
+		return;
+
+	_metrics->setGauge("ircoptotron_outbound_queue_depth", _metric_labels, (double) _outbound.depth());
+	_metrics->setCounter("ircoptotron_lines_merged_total", _metric_labels, (double) _outbound.getMergedCount());
+	_metrics->setGauge("ircoptotron_connected", _metric_labels, isConnected() ? 1 : 0);
+}
+
+/* doWhoChannel resolves the hosts of everyone in a channel with a single WHO once
+   the NAMES list is complete, instead of a WHOIS per nick. Replies carry their
+   channel, so several channels can be resolving at the same time. */
+void IrcNetwork::doWhoChannel(const std::string& chan)
+{
+	if(_pending_who.count(lowerKey(chan)) > 0)
+		return;
+
+	_pending_who.insert(lowerKey(chan));
+	_snapshot.beginRefresh(chan);
+	_outbound.push(OUTBOUND_WHO, chan, "", PRIORITY_MODE);
+	flushOutbound();
+}
+
+void IrcNetwork::doWhoFinished(const std::string& chan)
+{
+	_pending_who.erase(lowerKey(chan));
+	_snapshot.endRefresh(chan);
+
+	// Anyone opped from the snapshot who wasn't in the WHO has left; nothing to check.
+	_unverified_ops.erase(lowerKey(chan));
+
+	// Channel is fully resolved, no point waiting out the debounce.
+	std::vector<ModeLine> lines;
+	_mode_batcher.takeChannel(chan, lines);
+	sendModeLines(lines);
+}
+
+void IrcNetwork::markUnverifiedOp(const std::string& chan, const std::string& nick)
+{
+	_unverified_ops[lowerKey(chan)].insert(lowerKey(nick));
+}
+
+// True (once) if nick was opped in chan from the snapshot and not yet checked.
+bool IrcNetwork::takeUnverifiedOp(const std::string& chan, const std::string& nick)
+{
+	std::map<std::string, std::set<std::string> >::iterator it = _unverified_ops.find(lowerKey(chan));
+	if(it == _unverified_ops.end())
+		return false;
+
+	return it->second.erase(lowerKey(nick)) > 0;
+}
+
+void IrcNetwork::setModesPerLine(unsigned modes_per_line)
+{
+	_mode_batcher.setModesPerLine(modes_per_line);
+}
+
+void IrcNetwork::setFloodControl(double burst, double lines_per_second)
+{
+	_outbound.setFloodControl(burst, lines_per_second);
+}
+
+BotController* IrcNetwork::getController()
+{
+	return _controller;
+}
+
+ChannelSnapshot& IrcNetwork::getSnapshot()
+{
+	return _snapshot;
+}
+
+const std::string& IrcNetwork::getName() const
+{
+	return _name;
+}
+
+const std::vector<std::string>& IrcNetwork::getChanList() const
+{
+	return _chanlist;
+}
+
+const std::string& IrcNetwork::getServer() const
+{
+	return _server;
+}
+
+unsigned short IrcNetwork::getPort() const
+{
+	return _port;
+}
+
+const std::string& IrcNetwork::getNick() const
+{
+	return _nick;
+}
+
+}
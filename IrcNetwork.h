@@ -0,0 +1,130 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <vector>
+#include <string>
+#include <set>
+
+#ifdef IRCOPTOTRON_NATIVE_IRC
+#include "IrcConnection.h"
+#else
+#include <libircclient\libircclient.h>
+#endif
+
+#include "ChannelSnapshot.h"
+#include "IrcPoller.h"
+#include "Metrics.h"
+#include "ModeBatcher.h"
+#include "OutboundQueue.h"
+
+namespace IRCOptotron
+{
+
+#ifdef IRCOPTOTRON_NATIVE_IRC
+typedef IrcEventCallbacks IrcCallbacks;
+#else
+typedef irc_callbacks_t IrcCallbacks;
+#endif
+
+class BotController;
+
+/* IrcNetwork is one connection owned by a BotController: the libircclient session
+   plus everything that only makes sense per server (channels, outbound pacing,
+   pending modes and WHOs). The session's ctx points back here, so event callbacks
+   can find both the network and its controller. A dropped connection is retried
+   with exponential backoff, on the same session. The session is libircclient's,
+   or our own IrcConnection when built with IRCOPTOTRON_NATIVE_IRC; only the
+   send and session functions at the top of IrcNetwork.cpp know which. */
+class IrcNetwork
+{
+private:
+	BotController* _controller;
+#ifdef IRCOPTOTRON_NATIVE_IRC
+	IrcConnection _connection;
+#else
+	irc_session_t* _session;
+#endif
+
+	std::string _name;
+	std::string _server;
+	unsigned short _port;
+	std::string _nick;
+	std::vector<std::string> _chanlist;
+	bool _welcomed;
+
+	std::set<std::string> _pending_who;
+	ChannelSnapshot _snapshot;
+
+	// Ops given from the snapshot that the channel's WHO hasn't confirmed yet, by channel.
+	std::map<std::string, std::set<std::string> > _unverified_ops;
+
+	bool _reconnect_pending;
+	std::chrono::steady_clock::time_point _reconnect_at;
+	unsigned _reconnect_delay;
+	ModeBatcher _mode_batcher;
+	OutboundQueue _outbound;
+
+	Metrics* _metrics;
+	std::string _metric_labels;
+
+	bool startSession();
+	void endSession();
+	void sendRaw(const std::string& line);
+	void sendMessage(const std::string& target, const std::string& text);
+	void sendMode(const std::string& chan, const std::string& modes);
+	void sendJoin(const std::string& chan);
+	void sendPart(const std::string& chan);
+	void sendQueued();
+
+	void sendModeLines(const std::vector<ModeLine>& lines);
+
+	IrcNetwork(const IrcNetwork&);
+	IrcNetwork& operator=(const IrcNetwork&);
+
+public:
+	bool connect();
+	bool isConnected();
+	void joinChannels();
+	void scheduleReconnect();
+	bool reconnectDue() const;
+	bool reconnect();
+	void setChannels(const std::vector<std::string>& chanlist);
+
+	void watch(IrcPoller& poller);
+	bool process(IrcPoller& poller);
+	const char* getLastError();
+
+	void sendMessageToHost(const std::string& host, const std::string& msg);
+	void sendMessageToNick(const std::string& nick, const std::string& msg, OutboundPriority priority = PRIORITY_REPLY);
+	void sendReplyToNick(const std::string& nick, const std::vector<std::string>& lines, OutboundPriority priority = PRIORITY_REPLY);
+	void queueMode(const std::string& chan, char mode, const std::string& arg);
+	void removeMode(const std::string& chan, char mode, const std::string& arg);
+	void flushModes();
+	void flushOutbound();
+	long timeUntilNextSend();
+	void reportOutboundStats();
+	void updateMetrics();
+
+	void doWhoChannel(const std::string& chan);
+	void doWhoFinished(const std::string& chan);
+	void markUnverifiedOp(const std::string& chan, const std::string& nick);
+	bool takeUnverifiedOp(const std::string& chan, const std::string& nick);
+
+	void setModesPerLine(unsigned modes_per_line);
+	void setFloodControl(double burst, double lines_per_second);
+
+	BotController* getController();
+	ChannelSnapshot& getSnapshot();
+	const std::string& getName() const;
+	const std::vector<std::string>& getChanList() const;
+	const std::string& getServer() const;
+	unsigned short getPort() const;
+	const std::string& getNick() const;
+
+	IrcNetwork(BotController* controller, IrcCallbacks* callbacks, Metrics* metrics, const std::string& name,
+		const std::string& nick, const std::string& server, unsigned short port, const std::vector<std::string>& chanlist);
+	~IrcNetwork();
+};
+
+}
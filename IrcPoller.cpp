@@ -0,0 +1,195 @@
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "IrcPoller.h"
+
+namespace IRCOptotron
+{
+
+#ifdef IRCOPTOTRON_EPOLL
+
+// Only a handful of sockets are ever watched, one per network.
+static const int MAX_EVENTS = 16;
+
+IrcPoller::IrcPoller()
+{
+	_epoll = epoll_create1(0);
+	_ready_events.resize(MAX_EVENTS);
+}
+
+IrcPoller::~IrcPoller()
+{
+	if(_epoll >= 0)
+		close(_epoll);
+}
+
+void IrcPoller::begin()
+{
+	_watched.clear();
+	_ready.clear();
+}
+
+/* Registrations persist between passes; the kernel is only told when what we
+   want from a socket changes. That relies on unwatch() being called before a
+   socket closes, since its number may come back as a new socket in the same
+   pass. Should a stale registration slip through anyway, a failed MOD falls
+   back to ADD. */
+void IrcPoller::watch(SOCKET fd, bool want_write)
+{
+	unsigned events = EPOLLIN | (want_write ? (unsigned) EPOLLOUT : 0u);
+	_watched.insert(fd);
+
+	std::map<int, unsigned>::iterator it = _registered.find(fd);
+	if(it != _registered.end() && it->second == events)
+		return;
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.fd = fd;
+
+	if(it == _registered.end() || epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &event) != 0)
+		epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+
+	_registered[fd] = events;
+}
+
+// Forgets fd, which is about to be closed, so a new socket with its number is added afresh.
+void IrcPoller::unwatch(SOCKET fd)
+{
+	if(_registered.erase(fd))
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, 0);
+
+	_watched.erase(fd);
+	_ready.erase(fd);
+}
+
+int IrcPoller::wait(long timeout_ms)
+{
+	// Forget sockets nobody watched this pass, e.g. a network that disconnected.
+	std::map<int, unsigned>::iterator it = _registered.begin();
+	while(it != _registered.end())
+	{
+		if(_watched.count(it->first))
+		{
+			++it;
+			continue;
+		}
+
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, it->first, 0);
+		_registered.erase(it++);
+	}
+
+	int count = epoll_wait(_epoll, &_ready_events[0], MAX_EVENTS, (int) timeout_ms);
+	if(count < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for(int i = 0; i < count; i++)
+		_ready[_ready_events[i].data.fd] |= _ready_events[i].events;
+
+	return count;
+}
+
+// Errors and hangups count as readable, so the read sees them and reports why.
+bool IrcPoller::isReadable(SOCKET fd) const
+{
+	std::map<int, unsigned>::const_iterator it = _ready.find(fd);
+	return it != _ready.end() && (it->second & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+}
+
+bool IrcPoller::isWritable(SOCKET fd) const
+{
+	std::map<int, unsigned>::const_iterator it = _ready.find(fd);
+	return it != _ready.end() && (it->second & EPOLLOUT) != 0;
+}
+
+#else
+
+IrcPoller::IrcPoller()
+{
+	begin();
+}
+
+IrcPoller::~IrcPoller()
+{
+}
+
+void IrcPoller::begin()
+{
+	FD_ZERO(&_in_set);
+	FD_ZERO(&_out_set);
+	_maxfd = 0;
+}
+
+void IrcPoller::watch(SOCKET fd, bool want_write)
+{
+	FD_SET(fd, &_in_set);
+	if(want_write)
+		FD_SET(fd, &_out_set);
+
+	if((int) fd > _maxfd)
+		_maxfd = (int) fd;
+}
+
+// Keeps a new socket that gets fd's number this pass from looking ready.
+void IrcPoller::unwatch(SOCKET fd)
+{
+	FD_CLR(fd, &_in_set);
+	FD_CLR(fd, &_out_set);
+}
+
+int IrcPoller::wait(long timeout_ms)
+{
+	struct timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	int count = select(_maxfd + 1, &_in_set, &_out_set, 0, &tv);
+
+	// A signal isn't a failure; nothing is ready this pass, as irc_run treats it.
+#ifdef _WIN32
+	bool interrupted = count < 0 && WSAGetLastError() == WSAEINTR;
+#else
+	bool interrupted = count < 0 && errno == EINTR;
+#endif
+	if(interrupted)
+	{
+		FD_ZERO(&_in_set);
+		FD_ZERO(&_out_set);
+		return 0;
+	}
+
+	return count;
+}
+
+// winsock's FD_ISSET won't take a const set.
+bool IrcPoller::isReadable(SOCKET fd) const
+{
+	return FD_ISSET(fd, const_cast<fd_set*>(&_in_set)) != 0;
+}
+
+bool IrcPoller::isWritable(SOCKET fd) const
+{
+	return FD_ISSET(fd, const_cast<fd_set*>(&_out_set)) != 0;
+}
+
+fd_set* IrcPoller::getReadSet()
+{
+	return &_in_set;
+}
+
+fd_set* IrcPoller::getWriteSet()
+{
+	return &_out_set;
+}
+
+int* IrcPoller::getMaxFd()
+{
+	return &_maxfd;
+}
+
+#endif
+
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+typedef int SOCKET;
+#endif
+
+/* Building with IRCOPTOTRON_NATIVE_IRC replaces libircclient with our own protocol
+   core (IrcConnection). That core only needs to be told which sockets are ready,
+   so on Linux it is polled with epoll; define IRCOPTOTRON_NO_EPOLL to use select
+   there too. libircclient can only fill in fd_sets, so it always uses select. */
+#if defined(IRCOPTOTRON_NATIVE_IRC) && defined(__linux__) && !defined(IRCOPTOTRON_NO_EPOLL)
+#define IRCOPTOTRON_EPOLL
+#endif
+
+#ifdef IRCOPTOTRON_EPOLL
+#include <map>
+#include <set>
+#include <sys/epoll.h>
+#endif
+
+namespace IRCOptotron
+{
+
+/* IrcPoller waits for any of the networks' sockets to become ready. Each pass of
+   the loop calls begin(), has every network watch() its socket, then wait()s and
+   lets each network check isReadable()/isWritable() for its own. */
+class IrcPoller
+{
+private:
+#ifdef IRCOPTOTRON_EPOLL
+	int _epoll;
+	std::map<int, unsigned> _registered;   // fd -> events it is registered for
+	std::set<int> _watched;                // fds watched since begin()
+	std::vector<struct epoll_event> _ready_events;
+	std::map<int, unsigned> _ready;
+#else
+	fd_set _in_set;
+	fd_set _out_set;
+	int _maxfd;
+#endif
+
+	IrcPoller(const IrcPoller&);
+	IrcPoller& operator=(const IrcPoller&);
+
+public:
+	void begin();
+	void watch(SOCKET fd, bool want_write);
+	void unwatch(SOCKET fd);
+	int wait(long timeout_ms);
+
+	bool isReadable(SOCKET fd) const;
+	bool isWritable(SOCKET fd) const;
+
+#ifndef IRCOPTOTRON_EPOLL
+	// For libircclient, which adds its own descriptors.
+	fd_set* getReadSet();
+	fd_set* getWriteSet();
+	int* getMaxFd();
+#endif
+
+	IrcPoller();
+	~IrcPoller();
+};
+
+}
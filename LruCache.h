@@ -0,0 +1,90 @@
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace IRCOptotron
+{
+
+/* Size-bounded least-recently-used map. Lookups and inserts are one hash probe
+   plus a splice; inserting past capacity evicts the least recently used entry. */
+template <typename K, typename V>
+class LruCache
+{
+private:
+	typedef std::list<std::pair<K, V> > EntryList;
+	typedef std::unordered_map<K, typename EntryList::iterator> EntryIndex;
+
+	EntryList _entries;
+	EntryIndex _index;
+	size_t _capacity;
+
+	void evict()
+	{
+		while(_entries.size() > _capacity)
+		{
+			_index.erase(_entries.back().first);
+			_entries.pop_back();
+		}
+	}
+
+public:
+	bool get(const K& key, V& value)
+	{
+		typename EntryIndex::iterator it = _index.find(key);
+		if(it == _index.end())
+			return false;
+
+		_entries.splice(_entries.begin(), _entries, it->second);
+		value = it->second->second;
+		return true;
+	}
+
+	void put(const K& key, const V& value)
+	{
+		if(_capacity == 0)
+			return;
+
+		typename EntryIndex::iterator it = _index.find(key);
+		if(it != _index.end())
+		{
+			it->second->second = value;
+			_entries.splice(_entries.begin(), _entries, it->second);
+			return;
+		}
+
+		_entries.push_front(std::make_pair(key, value));
+		_index[key] = _entries.begin();
+		evict();
+	}
+
+	void erase(const K& key)
+	{
+		typename EntryIndex::iterator it = _index.find(key);
+		if(it != _index.end())
+		{
+			_entries.erase(it->second);
+			_index.erase(it);
+		}
+	}
+
+	void clear()
+	{
+		_entries.clear();
+		_index.clear();
+	}
+
+	void setCapacity(size_t capacity)
+	{
+		_capacity = capacity;
+		evict();
+	}
+
+	size_t capacity() const { return _capacity; }
+	size_t size() const { return _entries.size(); }
+
+	LruCache(size_t capacity) : _capacity(capacity) {}
+};
+
+}
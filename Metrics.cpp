@@ -0,0 +1,263 @@
+#include <stdio.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "Metrics.h"
+
+namespace IRCOptotron
+{
+
+// Bucket i holds observations up to 10us * 2^i; the last one catches everything else.
+static const double FIRST_BUCKET_SECONDS = 0.00001;
+static const unsigned BUCKET_COUNT = 24;
+
+Metrics::Metrics()
+{
+}
+
+Metrics::Series& Metrics::getSeries(const std::string& name, MetricType type, const std::string& labels)
+{
+	std::map<std::string, Family>::iterator it = _families.find(name);
+	if(it == _families.end())
+	{
+		Family family;
+		family.type = type;
+		it = _families.insert(std::make_pair(name, family)).first;
+	}
+
+	std::map<std::string, Series>::iterator series_it = it->second.series.find(labels);
+	if(series_it == it->second.series.end())
+	{
+		Series series;
+		series.value = 0;
+		series.count = 0;
+		series.sum = 0;
+		series.max = 0;
+		if(type == METRIC_SUMMARY)
+			series.buckets.resize(BUCKET_COUNT + 1, 0);
+
+		series_it = it->second.series.insert(std::make_pair(labels, series)).first;
+	}
+
+	return series_it->second;
+}
+
+void Metrics::describe(const std::string& name, MetricType type, const std::string& help)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	Family& family = _families[name];
+	family.type = type;
+	family.help = help;
+}
+
+void Metrics::increment(const std::string& name, const std::string& labels, double by)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	getSeries(name, METRIC_COUNTER, labels).value += by;
+}
+
+// For counters kept elsewhere (e.g. cache hits) that are copied in periodically.
+void Metrics::setCounter(const std::string& name, const std::string& labels, double value)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	getSeries(name, METRIC_COUNTER, labels).value = value;
+}
+
+void Metrics::setGauge(const std::string& name, const std::string& labels, double value)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	getSeries(name, METRIC_GAUGE, labels).value = value;
+}
+
+void Metrics::observe(const std::string& name, const std::string& labels, double seconds)
+{
+	unsigned bucket = 0;
+	double bound = FIRST_BUCKET_SECONDS;
+	while(bucket < BUCKET_COUNT && seconds > bound)
+	{
+		bucket++;
+		bound *= 2;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	Series& series = getSeries(name, METRIC_SUMMARY, labels);
+	series.buckets[bucket]++;
+	series.count++;
+	series.sum += seconds;
+	if(seconds > series.max)
+		series.max = seconds;
+}
+
+// Upper bound of the bucket the q-th observation fell in, never more than the max.
+double Metrics::quantile(const Series& series, double q)
+{
+	if(series.count == 0)
+		return 0;
+
+	unsigned long rank = (unsigned long) (q * series.count);
+	if(rank >= series.count)
+		rank = series.count - 1;
+
+	unsigned long seen = 0;
+	double bound = FIRST_BUCKET_SECONDS;
+	for(unsigned i = 0; i < series.buckets.size(); i++)
+	{
+		seen += series.buckets[i];
+		if(seen > rank)
+			return bound < series.max ? bound : series.max;
+		bound *= 2;
+	}
+
+	return series.max;
+}
+
+// Every label string recorded under name, e.g. one per command.
+std::vector<std::string> Metrics::getLabels(const std::string& name) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::vector<std::string> labels;
+
+	std::map<std::string, Family>::const_iterator it = _families.find(name);
+	if(it != _families.end())
+	{
+		std::map<std::string, Series>::const_iterator s;
+		for(s = it->second.series.begin(); s != it->second.series.end(); ++s)
+			labels.push_back(s->first);
+	}
+
+	return labels;
+}
+
+bool Metrics::getSummary(const std::string& name, const std::string& labels, unsigned long& count, double& p50, double& p99, double& max) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::map<std::string, Family>::const_iterator it = _families.find(name);
+	if(it == _families.end() || it->second.type != METRIC_SUMMARY)
+		return false;
+
+	std::map<std::string, Series>::const_iterator s = it->second.series.find(labels);
+	if(s == it->second.series.end())
+		return false;
+
+	count = s->second.count;
+	p50 = quantile(s->second, 0.5);
+	p99 = quantile(s->second, 0.99);
+	max = s->second.max;
+
+	return true;
+}
+
+std::string Metrics::seriesName(const std::string& name, const std::string& labels, const std::string& extra)
+{
+	std::string combined = labels;
+	if(!extra.empty())
+		combined += (combined.empty() ? "" : ",") + extra;
+
+	if(combined.empty())
+		return name;
+
+	return name + "{" + combined + "}";
+}
+
+std::string Metrics::format() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::ostringstream out;
+
+	std::map<std::string, Family>::const_iterator it;
+	for(it = _families.begin(); it != _families.end(); ++it)
+	{
+		const std::string& name = it->first;
+		const Family& family = it->second;
+
+		if(family.series.empty())
+			continue;
+
+		if(!family.help.empty())
+			out << "# HELP " << name << " " << family.help << "\n";
+
+		if(family.type == METRIC_COUNTER)
+			out << "# TYPE " << name << " counter\n";
+		else if(family.type == METRIC_GAUGE)
+			out << "# TYPE " << name << " gauge\n";
+		else
+			out << "# TYPE " << name << " summary\n";
+
+		std::map<std::string, Series>::const_iterator s;
+		for(s = family.series.begin(); s != family.series.end(); ++s)
+		{
+			const Series& series = s->second;
+
+			if(family.type != METRIC_SUMMARY)
+			{
+				out << seriesName(name, s->first) << " " << series.value << "\n";
+				continue;
+			}
+
+			out << seriesName(name, s->first, "quantile=\"0.5\"") << " " << quantile(series, 0.5) << "\n";
+			out << seriesName(name, s->first, "quantile=\"0.99\"") << " " << quantile(series, 0.99) << "\n";
+			out << seriesName(name + "_sum", s->first) << " " << series.sum << "\n";
+			out << seriesName(name + "_count", s->first) << " " << series.count << "\n";
+		}
+
+		// Summaries carry no max of their own, so it goes out as a gauge next to them.
+		if(family.type == METRIC_SUMMARY)
+		{
+			out << "# TYPE " << name << "_max gauge\n";
+			for(s = family.series.begin(); s != family.series.end(); ++s)
+				out << seriesName(name + "_max", s->first) << " " << s->second.max << "\n";
+		}
+	}
+
+	return out.str();
+}
+
+/* Writes next to path and renames over it, so a scraper never reads half a file. */
+bool Metrics::writeFile(const std::string& path) const
+{
+	std::string temp_path = path + ".tmp";
+
+	{
+		std::ofstream file(temp_path.c_str(), std::ios::out | std::ios::trunc);
+		if(!file)
+			return false;
+
+		file << format();
+		if(!file)
+			return false;
+	}
+
+#ifdef _WIN32
+	// rename() won't replace an existing file on Windows.
+	remove(path.c_str());
+#endif
+
+	return rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+std::string Metrics::label(const std::string& key, const std::string& value)
+{
+	std::string escaped;
+	escaped.reserve(value.size());
+
+	for(unsigned i = 0; i < value.size(); i++)
+	{
+		if(value[i] == '\\' || value[i] == '"')
+			escaped += '\\';
+
+		if(value[i] == '\n')
+			escaped += "\\n";
+		else
+			escaped += value[i];
+	}
+
+	return key + "=\"" + escaped + "\"";
+}
+
+}
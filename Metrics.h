@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+enum MetricType
+{
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_SUMMARY
+};
+
+/* Metrics collects counters, gauges and latency summaries from any thread and
+   renders them in the Prometheus text format. A series is a metric name plus a
+   label string such as command="calc" (see label()). Latencies go into
+   power-of-two buckets from 10us up, which is enough to report p50/p99 to within
+   a factor of two, alongside the exact count, sum and max. */
+class Metrics
+{
+private:
+	struct Series
+	{
+		double value;
+		std::vector<unsigned long> buckets;
+		unsigned long count;
+		double sum;
+		double max;
+	};
+
+	struct Family
+	{
+		MetricType type;
+		std::string help;
+		std::map<std::string, Series> series;
+	};
+
+	mutable std::mutex _mutex;
+	std::map<std::string, Family> _families;
+
+	Series& getSeries(const std::string& name, MetricType type, const std::string& labels);
+	static double quantile(const Series& series, double q);
+	static std::string seriesName(const std::string& name, const std::string& labels, const std::string& extra = "");
+
+	Metrics(const Metrics&);
+	Metrics& operator=(const Metrics&);
+
+public:
+	void describe(const std::string& name, MetricType type, const std::string& help);
+
+	void increment(const std::string& name, const std::string& labels = "", double by = 1);
+	void setCounter(const std::string& name, const std::string& labels, double value);
+	void setGauge(const std::string& name, const std::string& labels, double value);
+	void observe(const std::string& name, const std::string& labels, double seconds);
+
+	std::vector<std::string> getLabels(const std::string& name) const;
+	bool getSummary(const std::string& name, const std::string& labels, unsigned long& count, double& p50, double& p99, double& max) const;
+
+	std::string format() const;
+	bool writeFile(const std::string& path) const;
+
+	static std::string label(const std::string& key, const std::string& value);
+
+	Metrics();
+};
+
+/* Observes how long the enclosing scope took. Does nothing without a Metrics. */
+class ScopedTimer
+{
+private:
+	Metrics* _metrics;
+	const char* _name;
+	const char* _labels;
+	std::chrono::steady_clock::time_point _start;
+
+public:
+	ScopedTimer(Metrics* metrics, const char* name, const char* labels = "")
+		: _metrics(metrics), _name(name), _labels(labels), _start(std::chrono::steady_clock::now()) {}
+
+	~ScopedTimer()
+	{
+		if(_metrics)
+			_metrics->observe(_name, _labels, std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count());
+	}
+};
+
+}
@@ -0,0 +1,697 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+#include "MockIrcServer.h"
+
+namespace IRCOptotron
+{
+
+static const char* SERVER_NAME = "mock.server";
+
+// NAMES replies are split well before the 512 byte line limit.
+static const size_t NAMES_LINE_LENGTH = 400;
+
+// How long the bot gets to connect and register before we give up on it.
+static const double REGISTER_TIMEOUT_SECONDS = 30;
+
+LoadTestConfig::LoadTestConfig()
+{
+	port = 16667;
+	channel = "#loadtest";
+	clients = 1000;
+	authorized = 100;
+	chat_per_second = 20;
+	calcs_per_second = 1;
+	churn_per_second = 2;
+	duration_seconds = 30;
+	flood_penalty_seconds = 2;
+	flood_allowance_seconds = 10;
+	kill_on_flood = false;
+}
+
+MockIrcServer::MockIrcServer(const LoadTestConfig& config) : _config(config), _random(12345)
+{
+	_listen_socket = INVALID_SOCKET;
+	_bot_socket = INVALID_SOCKET;
+	_registered = false;
+	_finished = false;
+
+	_chat_due = 0;
+	_calcs_due = 0;
+	_churn_due = 0;
+
+	_flood_clock = 0;
+	_flooding = false;
+	_flood_triggers = 0;
+	_flood_lines = 0;
+
+	_next_calc_id = 0;
+	_lines_from_bot = 0;
+	_messages_from_bot = 0;
+	_mode_lines = 0;
+	_ops_granted = 0;
+	_chat_sent = 0;
+	_calcs_sent = 0;
+
+	_bot_in_channel = false;
+	_time_to_full_op = -1;
+
+	for(unsigned i = 0; i < config.clients; i++)
+	{
+		char id[16];
+		sprintf(id, "%u", i);
+
+		SimClient client;
+		client.nick = std::string("user") + id;
+		client.user = std::string("u") + id;
+		client.authorized = i < config.authorized;
+		client.hostname = client.authorized ? "authorized.loadtest" : "guest.loadtest";
+		client.host = client.nick + "!" + client.user + "@" + client.hostname;
+		client.in_channel = true;
+		client.opped = false;
+
+		_client_index[client.nick] = i;
+		_clients.push_back(client);
+	}
+}
+
+MockIrcServer::~MockIrcServer()
+{
+	closeBot();
+
+	if(_listen_socket != INVALID_SOCKET)
+		closesocket(_listen_socket);
+}
+
+bool MockIrcServer::listen()
+{
+	_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if(_listen_socket == INVALID_SOCKET)
+	{
+		std::cerr << "Mock server: could not create socket" << std::endl;
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(_listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(_config.port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(bind(_listen_socket, (struct sockaddr*) &addr, sizeof(addr)) != 0 || ::listen(_listen_socket, 1) != 0)
+	{
+		std::cerr << "Mock server: could not listen on 127.0.0.1:" << _config.port << std::endl;
+		closesocket(_listen_socket);
+		_listen_socket = INVALID_SOCKET;
+		return false;
+	}
+
+	return true;
+}
+
+/* Serves the bot and drives the simulated users until the test is over: the
+   duration has passed since the bot registered, the bot went away, or it never
+   showed up at all. */
+void MockIrcServer::run()
+{
+	_started = Clock::now();
+	_last_tick = _started;
+
+	while(!_finished)
+	{
+		fd_set in_set, out_set;
+		FD_ZERO(&in_set);
+		FD_ZERO(&out_set);
+
+		SOCKET maxfd = _listen_socket;
+		FD_SET(_listen_socket, &in_set);
+
+		if(_bot_socket != INVALID_SOCKET)
+		{
+			FD_SET(_bot_socket, &in_set);
+			if(!_out_buffer.empty())
+				FD_SET(_bot_socket, &out_set);
+
+			if(_bot_socket > maxfd)
+				maxfd = _bot_socket;
+		}
+
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+
+		if(select((int) maxfd + 1, &in_set, &out_set, 0, &tv) < 0)
+			break;
+
+		if(FD_ISSET(_listen_socket, &in_set))
+			acceptBot();
+
+		if(_bot_socket != INVALID_SOCKET && FD_ISSET(_bot_socket, &in_set) && !readFromBot())
+			closeBot();
+
+		if(_bot_socket != INVALID_SOCKET && FD_ISSET(_bot_socket, &out_set) && !writeToBot())
+			closeBot();
+
+		tick();
+	}
+
+	closeBot();
+}
+
+void MockIrcServer::acceptBot()
+{
+	SOCKET client = accept(_listen_socket, 0, 0);
+	if(client == INVALID_SOCKET)
+		return;
+
+	// One bot per test.
+	if(_bot_socket != INVALID_SOCKET)
+	{
+		closesocket(client);
+		return;
+	}
+
+	_bot_socket = client;
+}
+
+bool MockIrcServer::readFromBot()
+{
+	char buffer[4096];
+	int received = recv(_bot_socket, buffer, sizeof(buffer), 0);
+	if(received <= 0)
+		return false;
+
+	_in_buffer.append(buffer, received);
+
+	size_t end;
+	while(_bot_socket != INVALID_SOCKET && (end = _in_buffer.find('\n')) != std::string::npos)
+	{
+		std::string line = _in_buffer.substr(0, end);
+		_in_buffer.erase(0, end + 1);
+
+		if(!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+
+		if(!line.empty())
+			handleLine(line);
+	}
+
+	return true;
+}
+
+bool MockIrcServer::writeToBot()
+{
+	if(_out_buffer.empty())
+		return true;
+
+	int sent = ::send(_bot_socket, _out_buffer.data(), (int) _out_buffer.size(), 0);
+	if(sent < 0)
+		return false;
+
+	_out_buffer.erase(0, sent);
+	return true;
+}
+
+void MockIrcServer::closeBot()
+{
+	if(_bot_socket == INVALID_SOCKET)
+		return;
+
+	closesocket(_bot_socket);
+	_bot_socket = INVALID_SOCKET;
+	_out_buffer.clear();
+}
+
+void MockIrcServer::send(const std::string& line)
+{
+	_out_buffer += line + "\r\n";
+}
+
+void MockIrcServer::sendNumeric(const std::string& numeric, const std::string& rest)
+{
+	send(std::string(":") + SERVER_NAME + " " + numeric + " " + _bot_nick + " " + rest);
+}
+
+double MockIrcServer::elapsedSince(Clock::time_point then) const
+{
+	return std::chrono::duration<double>(Clock::now() - then).count();
+}
+
+unsigned MockIrcServer::randomClient()
+{
+	return std::uniform_int_distribution<unsigned>(0, (unsigned) _clients.size() - 1)(_random);
+}
+
+// EVENTS FROM THE BOT  ---------------------------------------------------
+
+void MockIrcServer::handleLine(const std::string& line)
+{
+	_lines_from_bot++;
+	checkFlood();
+
+	// [:prefix] COMMAND param... [:trailing]
+	size_t pos = 0;
+	if(line[0] == ':')
+	{
+		pos = line.find(' ');
+		if(pos == std::string::npos)
+			return;
+		pos++;
+	}
+
+	std::vector<std::string> params;
+	while(pos < line.size())
+	{
+		if(line[pos] == ':' && !params.empty())
+		{
+			params.push_back(line.substr(pos + 1));
+			break;
+		}
+
+		size_t end = line.find(' ', pos);
+		if(end == std::string::npos)
+			end = line.size();
+
+		if(end > pos)
+			params.push_back(line.substr(pos, end - pos));
+		pos = end + 1;
+	}
+
+	if(params.empty())
+		return;
+
+	std::string command = params[0];
+	params.erase(params.begin());
+	for(unsigned i = 0; i < command.size(); i++)
+		command[i] = toupper(command[i]);
+
+	if(command == "NICK" && !params.empty())
+	{
+		_bot_nick = params[0];
+	}
+	else if(command == "USER" && !params.empty())
+	{
+		_bot_user = params[0];
+	}
+	else if(command == "PING")
+	{
+		send(std::string(":") + SERVER_NAME + " PONG " + SERVER_NAME + " :" + (params.empty() ? "" : params[0]));
+	}
+	else if(command == "JOIN" && !params.empty())
+	{
+		size_t start = 0;
+		while(start <= params[0].size())
+		{
+			size_t comma = params[0].find(',', start);
+			if(comma == std::string::npos)
+				comma = params[0].size();
+
+			handleJoin(params[0].substr(start, comma - start));
+			start = comma + 1;
+		}
+	}
+	else if(command == "WHO" && !params.empty())
+	{
+		handleWho(params[0]);
+	}
+	else if(command == "WHOIS" && !params.empty())
+	{
+		handleWhois(params.back());
+	}
+	else if(command == "MODE" && params.size() > 1)
+	{
+		handleMode(params);
+	}
+	else if((command == "PRIVMSG" || command == "NOTICE") && params.size() > 1)
+	{
+		_messages_from_bot++;
+		handlePrivmsg(params[1]);
+	}
+	else if(command == "QUIT")
+	{
+		closeBot();
+		return;
+	}
+
+	if(!_registered && !_bot_nick.empty() && !_bot_user.empty())
+	{
+		_registered = true;
+		_registered_at = Clock::now();
+
+		sendNumeric("001", ":Welcome to the load test, " + _bot_nick);
+		sendNumeric("005", "MODES=4 CHANTYPES=# PREFIX=(ov)@+ :are supported by this server");
+		sendNumeric("376", ":End of /MOTD command.");
+	}
+}
+
+/* RFC 1459 flood control: every line pushes the client's clock on by the penalty,
+   and a client whose clock gets more than the allowance ahead of real time is
+   flooding. A real server would stop reading from it and eventually kill it. */
+void MockIrcServer::checkFlood()
+{
+	double now = elapsedSince(_started);
+	if(_flood_clock < now)
+		_flood_clock = now;
+
+	_flood_clock += _config.flood_penalty_seconds;
+
+	if(_flood_clock - now <= _config.flood_allowance_seconds)
+	{
+		_flooding = false;
+		return;
+	}
+
+	_flood_lines++;
+	if(_flooding)
+		return;
+
+	_flooding = true;
+	_flood_triggers++;
+
+	if(_config.kill_on_flood)
+	{
+		send("ERROR :Closing Link: 127.0.0.1 (Excess Flood)");
+		writeToBot();
+		closeBot();
+	}
+}
+
+void MockIrcServer::handleJoin(const std::string& chan)
+{
+	std::string prefix = ":" + _bot_nick + "!" + _bot_user + "@127.0.0.1";
+	send(prefix + " JOIN :" + chan);
+
+	std::string names = "@" + _bot_nick;
+
+	if(chan == _config.channel)
+	{
+		_bot_in_channel = true;
+		_bot_joined = Clock::now();
+
+		for(unsigned i = 0; i < _clients.size(); i++)
+		{
+			if(!_clients[i].in_channel)
+				continue;
+
+			// Everyone already here is waiting on the bot from now on.
+			_clients[i].joined = _bot_joined;
+
+			if(names.size() + _clients[i].nick.size() + 2 > NAMES_LINE_LENGTH)
+			{
+				sendNumeric("353", "= " + chan + " :" + names);
+				names.clear();
+			}
+
+			if(!names.empty())
+				names += " ";
+			names += (_clients[i].opped ? "@" : "") + _clients[i].nick;
+		}
+	}
+
+	if(!names.empty())
+		sendNumeric("353", "= " + chan + " :" + names);
+
+	sendNumeric("366", chan + " :End of /NAMES list.");
+}
+
+void MockIrcServer::handleWho(const std::string& target)
+{
+	if(target == _config.channel)
+	{
+		for(unsigned i = 0; i < _clients.size(); i++)
+		{
+			const SimClient& client = _clients[i];
+			if(!client.in_channel)
+				continue;
+
+			sendNumeric("352", target + " " + client.user + " " + client.hostname + " " + SERVER_NAME + " "
+				+ client.nick + (client.opped ? " H@" : " H") + " :0 Simulated user");
+		}
+	}
+
+	sendNumeric("315", target + " :End of /WHO list.");
+}
+
+void MockIrcServer::handleWhois(const std::string& nick)
+{
+	std::map<std::string, unsigned>::iterator it = _client_index.find(nick);
+	if(it == _client_index.end())
+	{
+		sendNumeric("401", nick + " :No such nick/channel");
+		return;
+	}
+
+	const SimClient& client = _clients[it->second];
+	sendNumeric("311", client.nick + " " + client.user + " " + client.hostname + " * :Simulated user");
+	sendNumeric("318", client.nick + " :End of /WHOIS list.");
+}
+
+void MockIrcServer::handleMode(const std::vector<std::string>& params)
+{
+	_mode_lines++;
+
+	const std::string& chan = params[0];
+	const std::string& modes = params[1];
+	unsigned arg = 2;
+	bool adding = true;
+
+	for(unsigned i = 0; i < modes.size(); i++)
+	{
+		char mode = modes[i];
+		if(mode == '+' || mode == '-')
+		{
+			adding = (mode == '+');
+			continue;
+		}
+
+		bool takes_arg = (mode == 'o' || mode == 'v' || mode == 'b' || mode == 'k' || (mode == 'l' && adding));
+		if(!takes_arg || arg >= params.size())
+			continue;
+
+		const std::string& target = params[arg++];
+		if(mode != 'o' || chan != _config.channel)
+			continue;
+
+		std::map<std::string, unsigned>::iterator it = _client_index.find(target);
+		if(it == _client_index.end())
+			continue;
+
+		SimClient& client = _clients[it->second];
+		if(!client.in_channel || client.opped == adding)
+			continue;
+
+		client.opped = adding;
+		if(adding)
+		{
+			_ops_granted++;
+			_op_latencies.push_back(elapsedSince(client.joined));
+		}
+	}
+
+	std::string line = ":" + _bot_nick + "!" + _bot_user + "@127.0.0.1 MODE";
+	for(unsigned i = 0; i < params.size(); i++)
+		line += " " + params[i];
+	send(line);
+
+	checkFullyOpped();
+}
+
+// Matches every ltN calc id mentioned in a reply against the calcs still waiting.
+void MockIrcServer::handlePrivmsg(const std::string& text)
+{
+	size_t pos = 0;
+	while((pos = text.find("lt", pos)) != std::string::npos)
+	{
+		pos += 2;
+		if(pos >= text.size() || !isdigit((unsigned char) text[pos]))
+			continue;
+
+		unsigned long id = strtoul(text.c_str() + pos, 0, 10);
+
+		std::map<unsigned long, Clock::time_point>::iterator it = _pending_calcs.find(id);
+		if(it != _pending_calcs.end())
+		{
+			_calc_latencies.push_back(elapsedSince(it->second));
+			_pending_calcs.erase(it);
+		}
+	}
+}
+
+void MockIrcServer::checkFullyOpped()
+{
+	if(_time_to_full_op >= 0 || !_bot_in_channel)
+		return;
+
+	for(unsigned i = 0; i < _clients.size(); i++)
+	{
+		if(_clients[i].authorized && _clients[i].in_channel && !_clients[i].opped)
+			return;
+	}
+
+	_time_to_full_op = elapsedSince(_bot_joined);
+}
+
+// SIMULATED USERS  -------------------------------------------------------
+
+void MockIrcServer::tick()
+{
+	double dt = elapsedSince(_last_tick);
+	_last_tick = Clock::now();
+
+	if(!_registered)
+	{
+		if(elapsedSince(_started) > REGISTER_TIMEOUT_SECONDS)
+		{
+			std::cerr << "Mock server: the bot never registered" << std::endl;
+			_finished = true;
+		}
+		return;
+	}
+
+	if(_bot_socket == INVALID_SOCKET)
+	{
+		_finished = true;
+		return;
+	}
+
+	if(elapsedSince(_registered_at) >= _config.duration_seconds)
+	{
+		send("ERROR :Closing Link: 127.0.0.1 (Load test finished)");
+		writeToBot();
+		closeBot();
+		_finished = true;
+		return;
+	}
+
+	if(!_bot_in_channel || _clients.empty())
+		return;
+
+	_chat_due += dt * _config.chat_per_second;
+	for(; _chat_due >= 1; _chat_due -= 1)
+		sendChat();
+
+	_calcs_due += dt * _config.calcs_per_second;
+	for(; _calcs_due >= 1; _calcs_due -= 1)
+		sendCalc();
+
+	_churn_due += dt * _config.churn_per_second;
+	for(; _churn_due >= 1; _churn_due -= 1)
+		sendChurn();
+}
+
+void MockIrcServer::sendChat()
+{
+	SimClient& client = _clients[randomClient()];
+	if(!client.in_channel)
+		return;
+
+	_chat_sent++;
+
+	char text[64];
+	sprintf(text, "just chatting, line %lu", _chat_sent);
+	send(":" + client.host + " PRIVMSG " + _config.channel + " :" + text);
+}
+
+void MockIrcServer::sendCalc()
+{
+	if(_config.authorized == 0)
+		return;
+
+	unsigned index = std::uniform_int_distribution<unsigned>(0, _config.authorized - 1)(_random);
+	SimClient& client = _clients[index];
+	if(!client.in_channel)
+		return;
+
+	unsigned long id = _next_calc_id++;
+	_pending_calcs[id] = Clock::now();
+	_calcs_sent++;
+
+	char text[64];
+	sprintf(text, "calc lt%lu", id);
+	send(":" + client.host + " PRIVMSG " + _config.channel + " :" + text);
+}
+
+void MockIrcServer::sendChurn()
+{
+	SimClient& client = _clients[randomClient()];
+
+	if(client.in_channel)
+	{
+		send(":" + client.host + " PART " + _config.channel + " :bye");
+		client.in_channel = false;
+		client.opped = false;
+	}
+	else
+	{
+		send(":" + client.host + " JOIN :" + _config.channel);
+		client.in_channel = true;
+		client.joined = Clock::now();
+	}
+}
+
+// REPORT  ----------------------------------------------------------------
+
+void MockIrcServer::printLatencies(const char* name, std::vector<double>& latencies)
+{
+	if(latencies.empty())
+	{
+		std::cout << "  " << name << ": none" << std::endl;
+		return;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	size_t p99 = (size_t) (latencies.size() * 0.99);
+	if(p99 >= latencies.size())
+		p99 = latencies.size() - 1;
+
+	std::cout << "  " << name << ": p50 " << latencies[latencies.size() / 2] * 1000
+		<< "ms p99 " << latencies[p99] * 1000 << "ms max " << latencies.back() * 1000 << "ms" << std::endl;
+}
+
+void MockIrcServer::printReport()
+{
+	std::cout << "Load test: " << _clients.size() << " users (" << _config.authorized << " authorized) in "
+		<< _config.channel << " for " << _config.duration_seconds << "s" << std::endl;
+
+	std::cout << "  bot sent " << _lines_from_bot << " lines: " << _messages_from_bot << " messages, "
+		<< _mode_lines << " MODE lines granting " << _ops_granted << " ops" << std::endl;
+
+	std::cout << "  flood limit exceeded " << _flood_triggers << " times, " << _flood_lines
+		<< " lines over the limit" << std::endl;
+
+	if(_time_to_full_op >= 0)
+		std::cout << "  every authorized user opped " << _time_to_full_op * 1000 << "ms after the bot joined" << std::endl;
+	else
+		std::cout << "  authorized users were never all opped" << std::endl;
+
+	std::cout << "  " << _chat_sent << " chat lines, " << _calcs_sent << " calcs, "
+		<< _calc_latencies.size() << " answered, " << _pending_calcs.size() << " unanswered" << std::endl;
+
+	printLatencies("calc reply latency", _calc_latencies);
+	printLatencies("op after join latency", _op_latencies);
+}
+
+unsigned long MockIrcServer::getFloodLines() const
+{
+	return _flood_lines;
+}
+
+}
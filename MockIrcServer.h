@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+typedef int SOCKET;
+#endif
+
+namespace IRCOptotron
+{
+
+struct LoadTestConfig
+{
+	unsigned short port;
+	std::string channel;
+	unsigned clients;             // simulated users, all in the channel when the bot joins
+	unsigned authorized;          // how many of them match the bot's authorized hostmask
+	double chat_per_second;       // ordinary channel chatter
+	double calcs_per_second;      // "calc" commands from authorized users
+	double churn_per_second;      // users leaving or (re)joining the channel
+	unsigned duration_seconds;    // how long to run once the bot has registered
+	double flood_penalty_seconds; // RFC 1459 flood control: each line costs this much...
+	double flood_allowance_seconds; // ...and the client may be this far ahead of the clock
+	bool kill_on_flood;           // disconnect ("Excess Flood") rather than just count
+
+	LoadTestConfig();
+};
+
+/* MockIrcServer speaks just enough RFC 1459 to host the bot on localhost:
+   registration, PING, JOIN/NAMES, WHO, WHOIS, MODE and PRIVMSG. Every other
+   user in the channel is simulated inside the server, so thousands of them cost
+   nothing but memory. While it runs, it scripts chatter, calc commands and
+   joins/parts, and measures what the bot does about them: how long calc replies
+   take, how often the bot overruns the flood limit, and how long it takes to op
+   every authorized user after joining. */
+class MockIrcServer
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct SimClient
+	{
+		std::string nick;
+		std::string user;
+		std::string hostname;
+		std::string host;             // nick!user@hostname
+		bool authorized;
+		bool in_channel;
+		bool opped;
+		Clock::time_point joined;
+	};
+
+	LoadTestConfig _config;
+
+	SOCKET _listen_socket;
+	SOCKET _bot_socket;
+	std::string _in_buffer;
+	std::string _out_buffer;
+	std::string _bot_nick;
+	std::string _bot_user;
+	bool _registered;
+	bool _finished;
+	Clock::time_point _registered_at;
+
+	std::vector<SimClient> _clients;
+	std::map<std::string, unsigned> _client_index;
+	std::mt19937 _random;
+
+	Clock::time_point _started;
+	Clock::time_point _last_tick;
+	double _chat_due;
+	double _calcs_due;
+	double _churn_due;
+
+	// Flood control, as a virtual clock that runs ahead of real time.
+	double _flood_clock;
+	bool _flooding;
+	unsigned long _flood_triggers;
+	unsigned long _flood_lines;
+
+	unsigned long _next_calc_id;
+	std::map<unsigned long, Clock::time_point> _pending_calcs;
+	std::vector<double> _calc_latencies;
+	std::vector<double> _op_latencies;
+
+	unsigned long _lines_from_bot;
+	unsigned long _messages_from_bot;
+	unsigned long _mode_lines;
+	unsigned long _ops_granted;
+	unsigned long _chat_sent;
+	unsigned long _calcs_sent;
+
+	bool _bot_in_channel;
+	Clock::time_point _bot_joined;
+	double _time_to_full_op;
+
+	void acceptBot();
+	bool readFromBot();
+	bool writeToBot();
+	void closeBot();
+
+	void handleLine(const std::string& line);
+	void handleJoin(const std::string& chan);
+	void handleWho(const std::string& target);
+	void handleWhois(const std::string& nick);
+	void handleMode(const std::vector<std::string>& params);
+	void handlePrivmsg(const std::string& text);
+	void checkFlood();
+
+	void tick();
+	void sendChat();
+	void sendCalc();
+	void sendChurn();
+	void checkFullyOpped();
+
+	void send(const std::string& line);
+	void sendNumeric(const std::string& numeric, const std::string& rest);
+	double elapsedSince(Clock::time_point then) const;
+	unsigned randomClient();
+	static void printLatencies(const char* name, std::vector<double>& latencies);
+
+	MockIrcServer(const MockIrcServer&);
+	MockIrcServer& operator=(const MockIrcServer&);
+
+public:
+	bool listen();
+	void run();
+	void printReport();
+	unsigned long getFloodLines() const;
+
+	MockIrcServer(const LoadTestConfig& config);
+	~MockIrcServer();
+};
+
+}
@@ -0,0 +1,144 @@
+#include "ModeBatcher.h"
+
+#include <algorithm>
+
+namespace IRCOptotron
+{
+
+ModeBatcher::ModeBatcher(unsigned modes_per_line, unsigned debounce_ms)
+{
+	_modes_per_line = modes_per_line > 0 ? modes_per_line : 1;
+	_debounce = std::chrono::milliseconds(debounce_ms);
+}
+
+/* Queues "+<mode> arg" for chan. Returns true when the channel now holds at least
+   a full line's worth of changes, so the caller may want to flush right away. */
+bool ModeBatcher::queue(const std::string& chan, char mode, const std::string& arg)
+{
+	PendingModes& pending = _pending[chan];
+
+	for(unsigned i = 0; i < pending.args.size(); i++)
+	{
+		if(pending.modes[i] == mode && pending.args[i] == arg)
+			return pending.args.size() >= _modes_per_line;
+	}
+
+	pending.modes += mode;
+	pending.args.push_back(arg);
+	pending.queued.push_back(Clock::now());
+
+	return pending.args.size() >= _modes_per_line;
+}
+
+// Drops a change that hasn't gone out yet. Returns false if there was none.
+bool ModeBatcher::cancel(const std::string& chan, char mode, const std::string& arg)
+{
+	std::map<std::string, PendingModes>::iterator it = _pending.find(chan);
+	if(it == _pending.end())
+		return false;
+
+	PendingModes& pending = it->second;
+	for(unsigned i = 0; i < pending.args.size(); i++)
+	{
+		if(pending.modes[i] == mode && pending.args[i] == arg)
+		{
+			pending.modes.erase(i, 1);
+			pending.args.erase(pending.args.begin() + i);
+			pending.queued.erase(pending.queued.begin() + i);
+
+			if(pending.args.empty())
+				_pending.erase(it);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ModeBatcher::takeLines(const std::string& chan, PendingModes& pending, bool partial, std::vector<ModeLine>& lines)
+{
+	size_t taken = 0;
+
+	while(pending.args.size() - taken >= _modes_per_line || (partial && taken < pending.args.size()))
+	{
+		size_t n = std::min<size_t>(_modes_per_line, pending.args.size() - taken);
+
+		ModeLine line;
+		line.chan = chan;
+		line.modes = "+" + pending.modes.substr(taken, n);
+		for(size_t i = taken; i < taken + n; i++)
+			line.modes += " " + pending.args[i];
+
+		lines.push_back(line);
+		taken += n;
+	}
+
+	// What's left keeps the time it was queued, so it waits out its own debounce.
+	pending.modes.erase(0, taken);
+	pending.args.erase(pending.args.begin(), pending.args.begin() + taken);
+	pending.queued.erase(pending.queued.begin(), pending.queued.begin() + taken);
+}
+
+void ModeBatcher::takeReady(std::vector<ModeLine>& lines)
+{
+	Clock::time_point now = Clock::now();
+
+	std::map<std::string, PendingModes>::iterator it = _pending.begin();
+	while(it != _pending.end())
+	{
+		bool expired = now - it->second.queued.front() >= _debounce;
+		takeLines(it->first, it->second, expired, lines);
+
+		if(it->second.args.empty())
+			_pending.erase(it++);
+		else
+			++it;
+	}
+}
+
+void ModeBatcher::takeChannel(const std::string& chan, std::vector<ModeLine>& lines)
+{
+	std::map<std::string, PendingModes>::iterator it = _pending.find(chan);
+	if(it == _pending.end())
+		return;
+
+	takeLines(it->first, it->second, true, lines);
+	_pending.erase(it);
+}
+
+void ModeBatcher::takeAll(std::vector<ModeLine>& lines)
+{
+	std::map<std::string, PendingModes>::iterator it;
+	for(it = _pending.begin(); it != _pending.end(); ++it)
+		takeLines(it->first, it->second, true, lines);
+
+	_pending.clear();
+}
+
+// Forgets chan's changes without sending them, e.g. because we left it.
+void ModeBatcher::discardChannel(const std::string& chan)
+{
+	_pending.erase(chan);
+}
+
+void ModeBatcher::clear()
+{
+	_pending.clear();
+}
+
+void ModeBatcher::setModesPerLine(unsigned modes_per_line)
+{
+	_modes_per_line = modes_per_line > 0 ? modes_per_line : 1;
+}
+
+unsigned ModeBatcher::getModesPerLine() const
+{
+	return _modes_per_line;
+}
+
+bool ModeBatcher::empty() const
+{
+	return _pending.empty();
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+struct ModeLine
+{
+	std::string chan;
+	std::string modes;
+};
+
+/* ModeBatcher accumulates per-channel mode changes (+o/+b) and packs them into
+   as few MODE lines as the server allows ("+oob a b c"). A channel's batch is
+   released once it is full or once its oldest change has waited the debounce. */
+class ModeBatcher
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct PendingModes
+	{
+		std::string modes;
+		std::vector<std::string> args;
+		std::vector<Clock::time_point> queued;   // when each change was queued
+	};
+
+	std::map<std::string, PendingModes> _pending;
+	unsigned _modes_per_line;
+	std::chrono::milliseconds _debounce;
+
+	void takeLines(const std::string& chan, PendingModes& pending, bool partial, std::vector<ModeLine>& lines);
+
+public:
+	bool queue(const std::string& chan, char mode, const std::string& arg);
+	bool cancel(const std::string& chan, char mode, const std::string& arg);
+	void takeReady(std::vector<ModeLine>& lines);
+	void takeChannel(const std::string& chan, std::vector<ModeLine>& lines);
+	void takeAll(std::vector<ModeLine>& lines);
+	void discardChannel(const std::string& chan);
+	void clear();
+
+	void setModesPerLine(unsigned modes_per_line);
+	unsigned getModesPerLine() const;
+	bool empty() const;
+
+	ModeBatcher(unsigned modes_per_line = 3, unsigned debounce_ms = 250);
+};
+
+}
@@ -0,0 +1,203 @@
+#include "OutboundQueue.h"
+
+namespace IRCOptotron
+{
+
+static const char* MERGE_SEPARATOR = " | ";
+
+OutboundQueue::OutboundQueue(double burst, double lines_per_second, size_t max_merged_length, unsigned priority_streak)
+{
+	_burst = burst;
+	_rate = lines_per_second;
+	_tokens = burst;
+	_last_refill = Clock::now();
+
+	_max_merged_length = max_merged_length;
+	_priority_streak = priority_streak;
+	_streak = 0;
+
+	_sent = 0;
+	_merged = 0;
+	_total_delay_ms = 0;
+	_max_delay_ms = 0;
+}
+
+void OutboundQueue::refill()
+{
+	Clock::time_point now = Clock::now();
+	double elapsed = std::chrono::duration<double>(now - _last_refill).count();
+
+	_tokens += elapsed * _rate;
+	if(_tokens > _burst)
+		_tokens = _burst;
+
+	_last_refill = now;
+}
+
+/* With merge, text may be folded into the last line queued at this priority if it
+   goes to the same target; callers only ask for it for the second and later lines
+   of a single reply, which are pushed one straight after the other. */
+void OutboundQueue::push(OutboundKind kind, const std::string& target, const std::string& text, OutboundPriority priority, bool merge)
+{
+	// JOIN, PART and WHO say everything in their target.
+	if(text.empty() && (kind == OUTBOUND_MSG || kind == OUTBOUND_MODE))
+		return;
+
+	std::deque<OutboundLine>& queue = _queues[priority];
+
+	// Only ever fold into the newest line, so lines to a target keep their order.
+	if(merge && kind == OUTBOUND_MSG && !queue.empty())
+	{
+		OutboundLine& last = queue.back();
+		if(last.kind == OUTBOUND_MSG && last.target == target
+			&& last.text.size() + text.size() + 3 <= _max_merged_length)
+		{
+			last.text += MERGE_SEPARATOR + text;
+			_merged++;
+			return;
+		}
+	}
+
+	OutboundLine line;
+	line.kind = kind;
+	line.target = target;
+	line.text = text;
+	line.queued = Clock::now();
+
+	queue.push_back(line);
+}
+
+bool OutboundQueue::pop(OutboundLine& line)
+{
+	refill();
+
+	if(_tokens < 1)
+		return false;
+
+	unsigned p = 0;
+	while(p < PRIORITY_COUNT && _queues[p].empty())
+		p++;
+
+	if(p == PRIORITY_COUNT)
+		return false;
+
+	unsigned waiting = p + 1;
+	while(waiting < PRIORITY_COUNT && _queues[waiting].empty())
+		waiting++;
+
+	// Something lower has waited out the streak; it goes next.
+	if(waiting < PRIORITY_COUNT && _streak >= _priority_streak)
+	{
+		p = waiting;
+		_streak = 0;
+	}
+	else if(waiting < PRIORITY_COUNT)
+		_streak++;
+	else
+		_streak = 0;
+
+	line = _queues[p].front();
+	_queues[p].pop_front();
+	_tokens -= 1;
+
+	double delay = std::chrono::duration<double, std::milli>(Clock::now() - line.queued).count();
+	_total_delay_ms += delay;
+	if(delay > _max_delay_ms)
+		_max_delay_ms = delay;
+
+	_sent++;
+	return true;
+}
+
+// How long until pop() could hand out a line; zero if one is ready now.
+std::chrono::milliseconds OutboundQueue::timeUntilNextSend()
+{
+	refill();
+
+	if(_tokens >= 1 || _rate <= 0)
+		return std::chrono::milliseconds(0);
+
+	return std::chrono::milliseconds((long long) ((1 - _tokens) / _rate * 1000) + 1);
+}
+
+/* Counts lines that went out without passing through the queue, such as the
+   NICK and USER that open a session, against the budget. */
+void OutboundQueue::charge(unsigned lines)
+{
+	refill();
+
+	_tokens -= lines;
+}
+
+// Drops every queued line addressed to target, at any priority.
+void OutboundQueue::discardTarget(const std::string& target)
+{
+	for(unsigned p = 0; p < PRIORITY_COUNT; p++)
+	{
+		std::deque<OutboundLine>& queue = _queues[p];
+		for(std::deque<OutboundLine>::iterator it = queue.begin(); it != queue.end(); )
+		{
+			if(it->target == target)
+				it = queue.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+// Drops everything still queued; the flood budget is left as it is.
+void OutboundQueue::clear()
+{
+	for(unsigned p = 0; p < PRIORITY_COUNT; p++)
+		_queues[p].clear();
+}
+
+// Lines a class may send in a row while a lower one has something waiting.
+void OutboundQueue::setPriorityStreak(unsigned lines)
+{
+	_priority_streak = lines;
+}
+
+void OutboundQueue::setFloodControl(double burst, double lines_per_second)
+{
+	refill();
+
+	_burst = burst;
+	_rate = lines_per_second;
+	if(_tokens > _burst)
+		_tokens = _burst;
+}
+
+size_t OutboundQueue::depth() const
+{
+	size_t depth = 0;
+	for(unsigned p = 0; p < PRIORITY_COUNT; p++)
+		depth += _queues[p].size();
+
+	return depth;
+}
+
+unsigned long OutboundQueue::getSentCount() const
+{
+	return _sent;
+}
+
+unsigned long OutboundQueue::getMergedCount() const
+{
+	return _merged;
+}
+
+double OutboundQueue::getAverageDelayMs() const
+{
+	if(_sent == 0)
+		return 0;
+
+	return _total_delay_ms / _sent;
+}
+
+double OutboundQueue::getMaxDelayMs() const
+{
+	return _max_delay_ms;
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <string>
+
+namespace IRCOptotron
+{
+
+/* RFC 1459 servers charge each line 2s and cut a client off once it is 10s
+   ahead, i.e. 5 lines at once and then one every 2s. The burst is one short of
+   that so a PING reply, which the session sends without asking us, always fits. */
+static const double DEFAULT_FLOOD_BURST = 4;
+static const double DEFAULT_FLOOD_RATE = 0.5;
+
+// Lower values are sent first.
+enum OutboundPriority
+{
+	PRIORITY_MODE,
+	PRIORITY_REPLY,
+	PRIORITY_BULK,
+	PRIORITY_COUNT
+};
+
+enum OutboundKind
+{
+	OUTBOUND_MSG,
+	OUTBOUND_MODE,
+	OUTBOUND_JOIN,
+	OUTBOUND_PART,
+	OUTBOUND_WHO
+};
+
+// JOIN, PART and WHO only use the target (a channel, or a nick for WHO).
+struct OutboundLine
+{
+	OutboundKind kind;
+	std::string target;
+	std::string text;
+	std::chrono::steady_clock::time_point queued;
+};
+
+/* OutboundQueue paces everything we send with a token bucket so we never trip
+   the server's flood limit: up to `burst` lines at once, then `rate` lines per
+   second. Lines are taken highest priority first, but a class that has gone
+   `priority_streak` lines in a row while a lower one waits lets that one have the
+   next line, so a backlog of modes and WHOs can't starve replies. A message can
+   be folded into the one queued right before it, to the same target, rather than
+   use up another line; only the lines of one reply ask for that. */
+class OutboundQueue
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	std::deque<OutboundLine> _queues[PRIORITY_COUNT];
+
+	double _burst;
+	double _rate;
+	double _tokens;
+	Clock::time_point _last_refill;
+
+	size_t _max_merged_length;
+	unsigned _priority_streak;
+	unsigned _streak;
+
+	unsigned long _sent;
+	unsigned long _merged;
+	double _total_delay_ms;
+	double _max_delay_ms;
+
+	void refill();
+
+public:
+	void push(OutboundKind kind, const std::string& target, const std::string& text, OutboundPriority priority, bool merge = false);
+	bool pop(OutboundLine& line);
+	std::chrono::milliseconds timeUntilNextSend();
+	void charge(unsigned lines);
+	void discardTarget(const std::string& target);
+	void clear();
+
+	void setFloodControl(double burst, double lines_per_second);
+	void setPriorityStreak(unsigned lines);
+
+	size_t depth() const;
+	unsigned long getSentCount() const;
+	unsigned long getMergedCount() const;
+	double getAverageDelayMs() const;
+	double getMaxDelayMs() const;
+
+	OutboundQueue(double burst = DEFAULT_FLOOD_BURST, double lines_per_second = DEFAULT_FLOOD_RATE, size_t max_merged_length = 400,
+		unsigned priority_streak = 2);
+};
+
+}
@@ -0,0 +1,94 @@
+#include "RateLimiter.h"
+
+namespace IRCOptotron
+{
+
+// Past this many keys, buckets that have refilled completely are forgotten.
+static const size_t PRUNE_THRESHOLD = 1024;
+
+RateLimiter::RateLimiter(double burst, double rate)
+{
+	_burst = burst;
+	_rate = rate;
+}
+
+RateLimiter::Bucket& RateLimiter::getBucket(const std::string& key)
+{
+	Clock::time_point now = Clock::now();
+
+	std::unordered_map<std::string, Bucket>::iterator it = _buckets.find(key);
+	if(it == _buckets.end())
+	{
+		if(_buckets.size() >= PRUNE_THRESHOLD)
+			prune();
+
+		Bucket bucket;
+		bucket.tokens = _burst;
+		bucket.last_refill = now;
+		bucket.noticed = false;
+
+		return _buckets.insert(std::make_pair(key, bucket)).first->second;
+	}
+
+	Bucket& bucket = it->second;
+	double elapsed = std::chrono::duration<double>(now - bucket.last_refill).count();
+
+	bucket.tokens += elapsed * _rate;
+	if(bucket.tokens > _burst)
+		bucket.tokens = _burst;
+
+	bucket.last_refill = now;
+
+	return bucket;
+}
+
+// A full bucket is no different from a new one, so it can go.
+void RateLimiter::prune()
+{
+	Clock::time_point now = Clock::now();
+
+	std::unordered_map<std::string, Bucket>::iterator it = _buckets.begin();
+	while(it != _buckets.end())
+	{
+		double elapsed = std::chrono::duration<double>(now - it->second.last_refill).count();
+		if(it->second.tokens + elapsed * _rate >= _burst)
+			it = _buckets.erase(it);
+		else
+			++it;
+	}
+}
+
+RateDecision RateLimiter::check(const std::string& key, unsigned cost)
+{
+	Bucket& bucket = getBucket(key);
+
+	if(bucket.tokens >= cost)
+		return RATE_ALLOWED;
+
+	if(bucket.noticed)
+		return RATE_LIMITED_QUIET;
+
+	bucket.noticed = true;
+	return RATE_LIMITED;
+}
+
+void RateLimiter::charge(const std::string& key, unsigned cost)
+{
+	Bucket& bucket = getBucket(key);
+
+	bucket.tokens -= cost;
+	bucket.noticed = false;
+}
+
+void RateLimiter::setLimits(double burst, double rate)
+{
+	_burst = burst;
+	_rate = rate;
+}
+
+size_t RateLimiter::size() const
+{
+	return _buckets.size();
+}
+
+}
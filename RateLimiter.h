@@ -0,0 +1,51 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+namespace IRCOptotron
+{
+
+enum RateDecision
+{
+	RATE_ALLOWED,
+	RATE_LIMITED,        // refused, and this is the first refusal since the key last got through
+	RATE_LIMITED_QUIET   // refused again; the key has already been told
+};
+
+/* RateLimiter gives every key (a user's host, a channel) its own token bucket
+   holding up to `burst` cost, refilled at `rate` cost per second. Commands weigh
+   what they cost the DB, so a search drains the bucket far faster than a lookup.
+   check() and charge() are separate so a command can be held against several
+   limiters and only charged once all of them allow it. */
+class RateLimiter
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Bucket
+	{
+		double tokens;
+		Clock::time_point last_refill;
+		bool noticed;
+	};
+
+	std::unordered_map<std::string, Bucket> _buckets;
+	double _burst;
+	double _rate;
+
+	Bucket& getBucket(const std::string& key);
+	void prune();
+
+public:
+	RateDecision check(const std::string& key, unsigned cost);
+	void charge(const std::string& key, unsigned cost);
+
+	void setLimits(double burst, double rate);
+	size_t size() const;
+
+	RateLimiter(double burst, double rate);
+};
+
+}
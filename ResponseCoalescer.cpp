@@ -0,0 +1,101 @@
+#include "ResponseCoalescer.h"
+
+namespace IRCOptotron
+{
+
+// Past this many requests, finished ones whose window has closed are forgotten.
+static const size_t PRUNE_THRESHOLD = 256;
+
+ResponseCoalescer::ResponseCoalescer(unsigned window_ms, bool suppress_repeats)
+{
+	_window = std::chrono::milliseconds(window_ms);
+	_suppress_repeats = suppress_repeats;
+}
+
+// Fields are separated by a character that can't appear in any of them on IRC.
+std::string ResponseCoalescer::makeKey(const std::string& network, const std::string& chan, const std::string& command, const std::string& args)
+{
+	return network + '\n' + chan + '\n' + command + '\n' + args;
+}
+
+bool ResponseCoalescer::expired(const CoalescedRequest& request, Clock::time_point now) const
+{
+	return request.done && now - request.completed >= _window;
+}
+
+void ResponseCoalescer::prune()
+{
+	Clock::time_point now = Clock::now();
+
+	std::unordered_map<std::string, std::shared_ptr<CoalescedRequest> >::iterator it = _requests.begin();
+	while(it != _requests.end())
+	{
+		if(expired(*it->second, now))
+			it = _requests.erase(it);
+		else
+			++it;
+	}
+}
+
+// The request a duplicate of key can use, in flight or recently finished, if any.
+std::shared_ptr<CoalescedRequest> ResponseCoalescer::find(const std::string& key)
+{
+	std::unordered_map<std::string, std::shared_ptr<CoalescedRequest> >::iterator it = _requests.find(key);
+	if(it == _requests.end())
+		return std::shared_ptr<CoalescedRequest>();
+
+	if(expired(*it->second, Clock::now()))
+	{
+		_requests.erase(it);
+		return std::shared_ptr<CoalescedRequest>();
+	}
+
+	return it->second;
+}
+
+std::shared_ptr<CoalescedRequest> ResponseCoalescer::start(const std::string& key)
+{
+	if(_requests.size() >= PRUNE_THRESHOLD)
+		prune();
+
+	std::shared_ptr<CoalescedRequest> request(new CoalescedRequest());
+	_requests[key] = request;
+
+	return request;
+}
+
+void ResponseCoalescer::finish(CoalescedRequest& request, const std::vector<std::string>& replies)
+{
+	request.replies = replies;
+	request.done = true;
+	request.completed = Clock::now();
+}
+
+/* Forgets every request. Ones still in flight will answer those already waiting
+   on them, but nothing new joins them, since their result may predate a change. */
+void ResponseCoalescer::invalidate()
+{
+	_requests.clear();
+}
+
+void ResponseCoalescer::setWindow(unsigned window_ms)
+{
+	_window = std::chrono::milliseconds(window_ms);
+}
+
+void ResponseCoalescer::setSuppressRepeats(bool suppress)
+{
+	_suppress_repeats = suppress;
+}
+
+bool ResponseCoalescer::suppressesRepeats() const
+{
+	return _suppress_repeats;
+}
+
+size_t ResponseCoalescer::size() const
+{
+	return _requests.size();
+}
+
+}
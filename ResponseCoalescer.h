@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+/* One distinct lookup: its replies once the DB has answered, and how many
+   identical requests joined it while it was still running. */
+struct CoalescedRequest
+{
+	std::vector<std::string> replies;
+	bool done;
+	unsigned waiters;
+	std::chrono::steady_clock::time_point completed;
+
+	CoalescedRequest() : done(false), waiters(0) {}
+};
+
+/* ResponseCoalescer lets identical read-only lookups share one DB query. A
+   request is keyed by where its reply goes and what it asks (network, channel,
+   command and the arguments as the handler parsed them). A duplicate that
+   arrives while the first is in flight waits on it; one that arrives within the
+   window after it finished is served from its result. With suppression on (the
+   default) duplicates get no reply of their own, since the channel has just seen
+   the answer. Anything that changes the DB must call invalidate(). */
+class ResponseCoalescer
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	std::unordered_map<std::string, std::shared_ptr<CoalescedRequest> > _requests;
+	std::chrono::milliseconds _window;
+	bool _suppress_repeats;
+
+	bool expired(const CoalescedRequest& request, Clock::time_point now) const;
+	void prune();
+
+public:
+	static std::string makeKey(const std::string& network, const std::string& chan, const std::string& command, const std::string& args);
+
+	std::shared_ptr<CoalescedRequest> find(const std::string& key);
+	std::shared_ptr<CoalescedRequest> start(const std::string& key);
+	void finish(CoalescedRequest& request, const std::vector<std::string>& replies);
+	void invalidate();
+
+	void setWindow(unsigned window_ms);
+	void setSuppressRepeats(bool suppress);
+	bool suppressesRepeats() const;
+	size_t size() const;
+
+	ResponseCoalescer(unsigned window_ms = 3000, bool suppress_repeats = true);
+};
+
+}
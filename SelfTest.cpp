@@ -0,0 +1,224 @@
+#include <stdio.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "CalcDB.h"
+#include "HostmaskMatcher.h"
+#include "LruCache.h"
+#include "OutboundQueue.h"
+#include "SelfTest.h"
+
+namespace IRCOptotron
+{
+
+static unsigned checks_run = 0;
+static unsigned checks_failed = 0;
+
+#define CHECK(expr) check((expr), #expr, __FILE__, __LINE__)
+
+static void check(bool passed, const char* expr, const char* file, int line)
+{
+	checks_run++;
+	if(passed)
+		return;
+
+	checks_failed++;
+	std::cout << "  FAILED " << file << ":" << line << ": " << expr << std::endl;
+}
+
+static void testHostmaskMatcher()
+{
+	HostmaskMatcher matcher;
+	size_t empty_nodes = matcher.nodeCount();
+
+	matcher.add(1, "joe!*@host.example");       // literal prefix
+	matcher.add(2, "*!*@*.example.org");        // literal suffix
+	matcher.add(3, "*!*@*.evil.*");             // wildcards at both ends
+	matcher.add(4, "ann!ann@exact.example");    // no wildcards at all
+	matcher.add(5, "b?b!*@*");
+
+	// Masks are anchored at both ends.
+	CHECK(matcher.matches("joe!joe@host.example"));
+	CHECK(!matcher.matches("joe!joe@host.example.net"));
+	CHECK(!matcher.matches("xjoe!joe@host.example"));
+	CHECK(matcher.matches("n!u@a.example.org"));
+	CHECK(!matcher.matches("n!u@a.example.org.uk"));
+	CHECK(matcher.matches("ann!ann@exact.example"));
+	CHECK(!matcher.matches("ann!ann@exact.example2"));
+
+	// Both-ends masks are found through their longest segment.
+	CHECK(matcher.matches("n!u@a.evil.net"));
+	CHECK(!matcher.matches("n!u@a.evilx.net"));
+
+	// '?' is exactly one character, and case never matters.
+	CHECK(matcher.matches("bob!u@h"));
+	CHECK(!matcher.matches("bb!u@h"));
+	CHECK(matcher.matches("JOE!Joe@HOST.example"));
+
+	// Substring masks need every part somewhere, in any order.
+	matcher.add(6, "legacy*user", true);
+	CHECK(matcher.matches("user!x@legacy.host"));
+	CHECK(!matcher.matches("user!x@other.host"));
+
+	// Removing a mask stops it matching and prunes what it left behind.
+	matcher.remove(2);
+	CHECK(!matcher.matches("n!u@a.example.org"));
+
+	for(int id = 1; id <= 6; id++)
+		matcher.remove(id);
+
+	CHECK(matcher.size() == 0);
+	CHECK(matcher.nodeCount() == empty_nodes);
+	CHECK(!matcher.matches("joe!joe@host.example"));
+
+	matcher.add(7, "*");
+	CHECK(matcher.matches("anyone!at@all"));
+}
+
+static void testLruCache()
+{
+	LruCache<std::string, int> cache(2);
+	int value = 0;
+
+	cache.put("a", 1);
+	cache.put("b", 2);
+	CHECK(cache.get("a", value) && value == 1);
+
+	// b is now the least recently used, so it goes first.
+	cache.put("c", 3);
+	CHECK(!cache.get("b", value));
+	CHECK(cache.get("a", value) && value == 1);
+	CHECK(cache.get("c", value) && value == 3);
+
+	cache.put("a", 10);
+	CHECK(cache.get("a", value) && value == 10);
+	CHECK(cache.size() == 2);
+
+	cache.erase("a");
+	CHECK(!cache.get("a", value));
+
+	cache.put("d", 4);
+	cache.setCapacity(1);
+	CHECK(cache.size() == 1);
+	CHECK(cache.get("d", value) && value == 4);
+
+	cache.setCapacity(0);
+	cache.put("e", 5);
+	CHECK(cache.size() == 0);
+}
+
+static void testOutboundQueue()
+{
+	OutboundLine line;
+
+	// A burst of 2, then next to nothing.
+	OutboundQueue paced(2, 0.001);
+	for(unsigned i = 0; i < 3; i++)
+		paced.push(OUTBOUND_MSG, "#chan", "line", PRIORITY_REPLY);
+
+	CHECK(paced.pop(line));
+	CHECK(paced.pop(line));
+	CHECK(!paced.pop(line));
+	CHECK(paced.timeUntilNextSend().count() > 0);
+
+	paced.setFloodControl(2, 1000);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	CHECK(paced.pop(line));
+
+	// Lines sent outside the queue use up the budget too.
+	OutboundQueue charged(2, 0.001);
+	charged.charge(2);
+	charged.push(OUTBOUND_MSG, "#chan", "line", PRIORITY_REPLY);
+	CHECK(!charged.pop(line));
+
+	// Modes go first, but not so many in a row that a reply starves.
+	OutboundQueue priorities(10, 0.001, 400, 2);
+	priorities.push(OUTBOUND_MODE, "#chan", "+o a", PRIORITY_MODE);
+	priorities.push(OUTBOUND_MODE, "#chan", "+o b", PRIORITY_MODE);
+	priorities.push(OUTBOUND_MODE, "#chan", "+o c", PRIORITY_MODE);
+	priorities.push(OUTBOUND_MSG, "#chan", "reply", PRIORITY_REPLY);
+
+	CHECK(priorities.pop(line) && line.text == "+o a");
+	CHECK(priorities.pop(line) && line.text == "+o b");
+	CHECK(priorities.pop(line) && line.text == "reply");
+	CHECK(priorities.pop(line) && line.text == "+o c");
+
+	// Only the lines of one reply are merged, and only to the same target.
+	OutboundQueue merging(10, 0.001);
+	merging.push(OUTBOUND_MSG, "#chan", "first", PRIORITY_REPLY);
+	merging.push(OUTBOUND_MSG, "#chan", "second", PRIORITY_REPLY, true);
+	merging.push(OUTBOUND_MSG, "#chan", "other command", PRIORITY_REPLY);
+	merging.push(OUTBOUND_MSG, "#other", "elsewhere", PRIORITY_REPLY, true);
+
+	CHECK(merging.depth() == 3);
+	CHECK(merging.getMergedCount() == 1);
+	CHECK(merging.pop(line) && line.text == "first | second");
+	CHECK(merging.pop(line) && line.text == "other command");
+	CHECK(merging.pop(line) && line.target == "#other");
+}
+
+static void removeDatabase(const std::string& filename)
+{
+	remove(filename.c_str());
+	remove((filename + "-wal").c_str());
+	remove((filename + "-shm").c_str());
+}
+
+static void testCalcVersions(const std::string& scratch_db)
+{
+	removeDatabase(scratch_db);
+
+	{
+		CalcDB calc_db(scratch_db);
+		CHECK(calc_db.isOpen());
+
+		CHECK(calc_db.makeCalc("k", "zero", "ann") == CALC_RESPONSE_CALCCHANGED);
+		CHECK(calc_db.changeCalc("k", "one", "bob") == CALC_RESPONSE_CALCCHANGED);
+		CHECK(calc_db.changeCalc("k", "two", "cat") == CALC_RESPONSE_CALCCHANGED);
+
+		std::string calc, info;
+
+		// Versions count from 0; negative ones count back from the latest.
+		CHECK(calc_db.getCalc("k", 0, calc) == CALC_RESPONSE_OK && calc == "zero");
+		CHECK(calc_db.getCalc("k", 2, calc) == CALC_RESPONSE_OK && calc == "two");
+		CHECK(calc_db.getCalc("k", -1, calc) == CALC_RESPONSE_OK && calc == "two");
+		CHECK(calc_db.getCalc("k", -2, calc) == CALC_RESPONSE_OK && calc == "one");
+		CHECK(calc_db.getCalc("k", -3, calc) == CALC_RESPONSE_OK && calc == "zero");
+		CHECK(calc_db.getCalc("k", 3, calc) == CALC_RESPONSE_NOCALC);
+		CHECK(calc_db.getCalc("k", -4, calc) == CALC_RESPONSE_NOCALC);
+		CHECK(calc_db.getCalc("missing", -1, calc) == CALC_RESPONSE_NOCALC);
+
+		CHECK(calc_db.getCalcVersion("k", -2, calc, info) == CALC_RESPONSE_OK && calc == "one");
+		CHECK(info.find("by bob") != std::string::npos);
+
+		// Removing a calc looks it up, but that isn't a lookup anyone asked for.
+		CHECK(calc_db.getCalc("k", calc) == CALC_RESPONSE_OK && calc == "two");
+		unsigned long hits = calc_db.getCacheHits();
+		unsigned long misses = calc_db.getCacheMisses();
+
+		CHECK(calc_db.removeCalc("k") == CALC_RESPONSE_OK);
+		CHECK(calc_db.getCacheHits() == hits && calc_db.getCacheMisses() == misses);
+		CHECK(calc_db.getCalc("k", -1, calc) == CALC_RESPONSE_NOCALC);
+	}
+
+	removeDatabase(scratch_db);
+}
+
+bool runSelfTest(const std::string& scratch_db)
+{
+	checks_run = 0;
+	checks_failed = 0;
+
+	testHostmaskMatcher();
+	testLruCache();
+	testOutboundQueue();
+	testCalcVersions(scratch_db);
+
+	std::cout << "Self test: " << checks_run << " checks, " << checks_failed << " failed" << std::endl;
+
+	return checks_failed == 0;
+}
+
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+namespace IRCOptotron
+{
+
+/* Runs the bot's unit checks (hostmask matching, the LRU cache, outbound pacing
+   and calc version lookups) without touching the network. scratch_db is created,
+   used as a calc database and removed again. Every failed check is printed;
+   returns whether they all passed. */
+bool runSelfTest(const std::string& scratch_db);
+
+}
@@ -0,0 +1,81 @@
+#include "StatementCache.h"
+
+#include <iostream>
+
+namespace IRCOptotron
+{
+
+StatementCache::StatementCache()
+{
+	_db = 0;
+}
+
+StatementCache::~StatementCache()
+{
+	finalizeAll();
+}
+
+void StatementCache::attach(sqlite3* db)
+{
+	finalizeAll();
+	_db = db;
+}
+
+bool StatementCache::prepare(unsigned id, const std::string& query)
+{
+	if(!_db)
+		return false;
+
+	if(id >= _statements.size())
+		_statements.resize(id + 1, 0);
+
+	if(_statements[id])
+	{
+		sqlite3_finalize(_statements[id]);
+		_statements[id] = 0;
+	}
+
+	if(sqlite3_prepare_v2(_db, query.c_str(), query.size(), &_statements[id], 0) != SQLITE_OK)
+	{
+		std::cerr << "Error with query: " << query << " (" << sqlite3_errmsg(_db) << ")" << std::endl;
+		_statements[id] = 0;
+		return false;
+	}
+
+	return true;
+}
+
+sqlite3_stmt* StatementCache::get(unsigned id) const
+{
+	if(id >= _statements.size())
+		return 0;
+
+	return _statements[id];
+}
+
+void StatementCache::finalizeAll()
+{
+	for(unsigned i = 0; i < _statements.size(); i++)
+	{
+		if(_statements[i])
+			sqlite3_finalize(_statements[i]);
+	}
+
+	_statements.clear();
+}
+
+ScopedStatement::ScopedStatement(sqlite3_stmt* stmt)
+{
+	_stmt = stmt;
+}
+
+ScopedStatement::~ScopedStatement()
+{
+	if(_stmt)
+	{
+		sqlite3_reset(_stmt);
+		sqlite3_clear_bindings(_stmt);
+	}
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <sqlite\sqlite3.h>
+
+namespace IRCOptotron
+{
+
+/* StatementCache owns a fixed set of prepared statements for one database handle.
+   Statements are compiled once, up front, and must be finalized (finalizeAll)
+   before the handle they were prepared against is closed. */
+class StatementCache
+{
+private:
+	sqlite3* _db;
+	std::vector<sqlite3_stmt*> _statements;
+
+	StatementCache(const StatementCache&);
+	StatementCache& operator=(const StatementCache&);
+
+public:
+	void attach(sqlite3* db);
+	bool prepare(unsigned id, const std::string& query);
+	sqlite3_stmt* get(unsigned id) const;
+	void finalizeAll();
+
+	StatementCache();
+	~StatementCache();
+};
+
+/* ScopedStatement borrows a cached statement for the length of one call and hands
+   it back reset with its bindings cleared, so no half-stepped read is left holding
+   a lock and no SQLITE_STATIC binding outlives the string it pointed at. */
+class ScopedStatement
+{
+private:
+	sqlite3_stmt* _stmt;
+
+	ScopedStatement(const ScopedStatement&);
+	ScopedStatement& operator=(const ScopedStatement&);
+
+public:
+	operator sqlite3_stmt*() const { return _stmt; }
+
+	ScopedStatement(sqlite3_stmt* stmt);
+	~ScopedStatement();
+};
+
+}
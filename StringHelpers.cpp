@@ -1,3 +1,5 @@
+#include <ctype.h>
+
 #include "StringHelpers.h"
 
 namespace IRCOptotron
@@ -23,28 +25,37 @@ namespace IRCOptotron
 
 		std::vector<std::string> tokenizeString(const std::string& s, const char& delimiter)
 		{
-			std::string token = "";
+			std::vector<StringSlice> slices;
+			tokenizeString(StringSlice(s), delimiter, slices);
+
 			std::vector<std::string> tokens;
+			tokens.reserve(slices.size());
+
+			for(unsigned i = 0; i < slices.size(); i++)
+				tokens.push_back(slices[i].str());
 
-			for(unsigned i = 0; i < s.length(); i++)
+			return tokens;
+		}
+
+		/* Splits s into tokens pointing into s itself; empty tokens are skipped. tokens is
+		   cleared first, so a caller reusing the same vector doesn't allocate once it has
+		   grown. Returns the number of tokens. */
+		size_t tokenizeString(const StringSlice& s, const char& delimiter, std::vector<StringSlice>& tokens)
+		{
+			tokens.clear();
+
+			size_t start = 0;
+			for(size_t i = 0; i <= s.length; i++)
 			{
-				if(s.at(i) == delimiter)
-				{
-					if(token.length() > 0){
-						tokens.push_back(token);
-						token = "";
-					}
-				}
-				else
+				if(i == s.length || s.data[i] == delimiter)
 				{
-					token += s.at(i);
+					if(i > start)
+						tokens.push_back(StringSlice(s.data + start, i - start));
+					start = i + 1;
 				}
 			}
 
-			if(token.length() > 0)
-				tokens.push_back(token);
-
-			return tokens;
+			return tokens.size();
 		}
 
 		std::string detokenizeString(const std::vector<std::string>& tokens, const char& combiner, unsigned start)
@@ -61,6 +72,28 @@ namespace IRCOptotron
 			return combined;
 		}
 
+		std::string detokenizeString(const std::vector<StringSlice>& tokens, const char& combiner, unsigned start)
+		{
+			if(tokens.size() == 0 || tokens.size() < start+1)
+				return "";
+
+			size_t length = tokens.size() - start - 1;
+			for(unsigned i = start; i < tokens.size(); i++)
+				length += tokens[i].length;
+
+			std::string combined;
+			combined.reserve(length);
+
+			combined.append(tokens[start].data, tokens[start].length);
+			for(unsigned i = start+1; i < tokens.size(); i++)
+			{
+				combined += combiner;
+				combined.append(tokens[i].data, tokens[i].length);
+			}
+
+			return combined;
+		}
+
 		bool stringContainsAllTokens(const std::string& haystack, const std::vector<std::string>& tokens)
 		{
 			for(size_t i = 0; i < tokens.size(); i++)
@@ -71,5 +104,31 @@ namespace IRCOptotron
 
 			return true;
 		}
+
+		// nick!user@host -> nick, as libircclient's irc_target_get_nick does.
+		std::string nickFromHost(const std::string& host)
+		{
+			return host.substr(0, host.find('!'));
+		}
+
+		/* Folds a nick or channel name with RFC 1459 casemapping, under which []\~
+		   are the upper case of {}|^, so names the server treats as one compare equal. */
+		std::string ircLower(const std::string& name)
+		{
+			std::string lowered = name;
+			for(size_t i = 0; i < lowered.size(); i++)
+			{
+				switch(lowered[i])
+				{
+				case '[': lowered[i] = '{'; break;
+				case ']': lowered[i] = '}'; break;
+				case '\\': lowered[i] = '|'; break;
+				case '~': lowered[i] = '^'; break;
+				default: lowered[i] = tolower((unsigned char) lowered[i]); break;
+				}
+			}
+
+			return lowered;
+		}
 	}
 }
\ No newline at end of file
@@ -10,13 +10,35 @@
 
 namespace IRCOptotron
 {
+	/* StringSlice is a view of length chars at data, which it doesn't own. It lets a
+	   line from libircclient be split and inspected without copying it; anything
+	   kept past the callback that produced the line must be copied out with str(). */
+	struct StringSlice
+	{
+		const char* data;
+		size_t length;
+
+		StringSlice() : data(""), length(0) {}
+		StringSlice(const char* data, size_t length) : data(data), length(length) {}
+		StringSlice(const std::string& s) : data(s.data()), length(s.size()) {}
+
+		size_t size() const { return length; }
+		bool empty() const { return length == 0; }
+		const char& operator[](size_t i) const { return data[i]; }
+		std::string str() const { return std::string(data, length); }
+	};
+
 	namespace MiscStringHelpers
 	{
 		std::string &ltrim(std::string &s);
 		std::string &rtrim(std::string &s);
 		std::string &trim(std::string &s);
 		std::vector<std::string> tokenizeString(const std::string& s, const char& delimiter);
+		size_t tokenizeString(const StringSlice& s, const char& delimiter, std::vector<StringSlice>& tokens);
 		std::string detokenizeString(const std::vector<std::string>& tokens, const char& combiner, unsigned start = 0);
+		std::string detokenizeString(const std::vector<StringSlice>& tokens, const char& combiner, unsigned start = 0);
 		bool stringContainsAllTokens(const std::string& haystack, const std::vector<std::string>& tokens);
+		std::string nickFromHost(const std::string& host);
+		std::string ircLower(const std::string& name);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+
+#include "TrafficLog.h"
+
+namespace IRCOptotron
+{
+
+TrafficRecorder::TrafficRecorder()
+{
+	_recorded = 0;
+}
+
+bool TrafficRecorder::open(const std::string& path)
+{
+	_file.open(path.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+	_started = Clock::now();
+
+	return isOpen();
+}
+
+bool TrafficRecorder::isOpen() const
+{
+	return _file.is_open();
+}
+
+void TrafficRecorder::writeEscaped(std::ofstream& file, const char* s)
+{
+	if(!s)
+		return;
+
+	for(; *s != '\0'; s++)
+	{
+		switch(*s)
+		{
+		case '\t': file << "\\t"; break;
+		case '\n': file << "\\n"; break;
+		case '\r': file << "\\r"; break;
+		case '\\': file << "\\\\"; break;
+		default: file << *s;
+		}
+	}
+}
+
+void TrafficRecorder::record(const std::string& network, const char* event, const char* origin, const char** params, unsigned int count)
+{
+	if(!_file.is_open())
+		return;
+
+	unsigned long offset = (unsigned long) std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - _started).count();
+
+	_file << offset << '\t';
+	writeEscaped(_file, network.c_str());
+	_file << '\t';
+	writeEscaped(_file, event);
+	_file << '\t';
+	writeEscaped(_file, origin);
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		_file << '\t';
+		writeEscaped(_file, params[i]);
+	}
+
+	_file << '\n';
+	_recorded++;
+}
+
+unsigned long TrafficRecorder::getRecordedCount() const
+{
+	return _recorded;
+}
+
+std::string TrafficReader::unescape(const std::string& s, size_t start, size_t end)
+{
+	std::string out;
+	out.reserve(end - start);
+
+	for(size_t i = start; i < end; i++)
+	{
+		if(s[i] != '\\' || i + 1 == end)
+		{
+			out += s[i];
+			continue;
+		}
+
+		i++;
+		switch(s[i])
+		{
+		case 't': out += '\t'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		default: out += s[i];
+		}
+	}
+
+	return out;
+}
+
+bool TrafficReader::parseLine(const std::string& line, TrafficEvent& event)
+{
+	std::vector<std::string> fields;
+
+	size_t start = 0;
+	for(size_t i = 0; i <= line.size(); i++)
+	{
+		if(i == line.size() || line[i] == '\t')
+		{
+			fields.push_back(unescape(line, start, i));
+			start = i + 1;
+		}
+	}
+
+	if(fields.size() < 4)
+		return false;
+
+	event.offset_ms = strtoul(fields[0].c_str(), 0, 10);
+	event.network = fields[1];
+	event.event = fields[2];
+	event.origin = fields[3];
+	event.params.assign(fields.begin() + 4, fields.end());
+
+	return true;
+}
+
+/* Reads a whole log up front so replay timings don't include disk reads.
+   Malformed lines are skipped. */
+bool TrafficReader::readAll(const std::string& path, std::vector<TrafficEvent>& events)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	if(!file)
+		return false;
+
+	std::string line;
+	TrafficEvent event;
+
+	while(std::getline(file, line))
+	{
+		if(!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+
+		if(parseLine(line, event))
+			events.push_back(event);
+	}
+
+	return true;
+}
+
+}
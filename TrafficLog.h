@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace IRCOptotron
+{
+
+/* One IRC event as libircclient handed it to us. event is the callback's event
+   name (CHANNEL, JOIN, CONNECT) or, for numerics, the number. */
+struct TrafficEvent
+{
+	unsigned long offset_ms;     // since recording started
+	std::string network;
+	std::string event;
+	std::string origin;
+	std::vector<std::string> params;
+};
+
+/* The log is one event per line, fields separated by tabs:
+       offset_ms  network  event  origin  param...
+   with tab, newline, CR and backslash escaped as \t \n \r \\. */
+class TrafficRecorder
+{
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	std::ofstream _file;
+	Clock::time_point _started;
+	unsigned long _recorded;
+
+	static void writeEscaped(std::ofstream& file, const char* s);
+
+	TrafficRecorder(const TrafficRecorder&);
+	TrafficRecorder& operator=(const TrafficRecorder&);
+
+public:
+	bool open(const std::string& path);
+	bool isOpen() const;
+	void record(const std::string& network, const char* event, const char* origin, const char** params, unsigned int count);
+	unsigned long getRecordedCount() const;
+
+	TrafficRecorder();
+};
+
+class TrafficReader
+{
+private:
+	static std::string unescape(const std::string& s, size_t start, size_t end);
+
+public:
+	static bool readAll(const std::string& path, std::vector<TrafficEvent>& events);
+	static bool parseLine(const std::string& line, TrafficEvent& event);
+};
+
+}
@@ -1,7 +1,147 @@
+#include <signal.h>
+
+#include <thread>
+
 #include "BotController.h"
+#include "MockIrcServer.h"
+#include "SelfTest.h"
+
+static const char* LOADTEST_CALC_DB = "loadtest_calc.db";
+static const char* LOADTEST_HOSTMASK_DB = "loadtest_hostmasks.db";
+
+// Threads answering calc lookups, each with its own read connection.
+static const unsigned DEFAULT_DB_THREADS = 4;
+
+/* Runs the bot against a MockIrcServer on localhost with fresh databases, in
+   which every simulated user on authorized.loadtest is authorized. */
+static int runLoadTest(const IRCOptotron::LoadTestConfig& config, unsigned db_threads, double flood_burst, double flood_rate)
+{
+	const char* stale[] = { LOADTEST_CALC_DB, "loadtest_calc.db-wal", "loadtest_calc.db-shm", LOADTEST_HOSTMASK_DB };
+	for(unsigned i = 0; i < sizeof(stale) / sizeof(stale[0]); i++)
+		remove(stale[i]);
+
+	{
+		IRCOptotron::HostmaskAuthorizer authorizer(LOADTEST_HOSTMASK_DB);
+		if(authorizer.addHostmask("loadtest", "*!*@authorized.loadtest", IRCOptotron::HOSTMASK_AUTHORIZED) != IRCOptotron::HOSTMASK_RESPONSE_OK)
+		{
+			std::cerr << "could not seed " << LOADTEST_HOSTMASK_DB << std::endl;
+			return 1;
+		}
+	}
+
+	IRCOptotron::MockIrcServer server(config);
+	if(!server.listen())
+		return 1;
+
+	std::thread server_thread(&IRCOptotron::MockIrcServer::run, &server);
+
+	{
+		IRCOptotron::BotController controller(LOADTEST_CALC_DB, LOADTEST_HOSTMASK_DB, db_threads);
+		controller.setStatsFile("");
+		controller.setSnapshotFile("");
+		controller.setReconnect(false);
 
+		std::vector<std::string> chanlist;
+		chanlist.push_back(config.channel);
+
+		controller.addNetwork("loadtest", "bot", "127.0.0.1", chanlist, config.port)->setFloodControl(flood_burst, flood_rate);
+		controller.run();
+	}
+
+	server_thread.join();
+	server.printReport();
+
+	// A real server would have killed the bot for this, so it counts as a failure.
+	if(server.getFloodLines() > 0)
+	{
+		std::cerr << "load test failed: the bot went over the flood limit" << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Usage: bot [--config file] [--calc-db file] [--hostmask-db file] [--record file] [--replay file]
+           [--loadtest clients] [--loadtest-seconds n] [--db-threads n] [--flood-burst n] [--flood-rate n]
+           [--selftest file]
+
+   --config reads the databases and networks from file (see BotConfig.h) instead
+   of the defaults below, and reloads it whenever it changes.
+   --record appends all IRC traffic to file while the bot runs normally.
+   --replay runs a recorded file through the bot offline, without connecting, and
+   prints throughput and per-command latency. Edits in the log are really made, so
+   point --calc-db and --hostmask-db at copies when replaying.
+   --loadtest starts a mock IRC server on localhost with that many simulated users
+   (a tenth of them authorized), runs the bot against it for --loadtest-seconds
+   (default 30) and prints calc latency, flood control hits and time to op. It
+   exits with 1 if any line went over the server's flood limit.
+   --db-threads sets how many calc lookups can run at once (default 4); 1 runs
+   all DB work on a single thread.
+   --flood-burst and --flood-rate set how many lines may go out at once and how
+   many per second after that (default 4 and 0.5, the RFC 1459 limits), for the
+   default network and the load test; networks in a --config file set their own.
+   --selftest runs the unit checks offline, using file as a scratch calc DB, and
+   exits with 1 if any of them fail. */
 int main(int argc, char* argv[])
 {
+	std::string calc_db = "calc.db";
+	std::string hostmask_db = "hostmasks.db";
+	std::string config_file;
+	std::string record_file;
+	std::string replay_file;
+	std::string selftest_db;
+	IRCOptotron::LoadTestConfig loadtest;
+	bool run_loadtest = false;
+	unsigned db_threads = DEFAULT_DB_THREADS;
+	double flood_burst = IRCOptotron::DEFAULT_FLOOD_BURST;
+	double flood_rate = IRCOptotron::DEFAULT_FLOOD_RATE;
+
+	for(int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string option = argv[i];
+
+		if(option == "--config")
+			config_file = argv[i + 1];
+		else if(option == "--calc-db")
+			calc_db = argv[i + 1];
+		else if(option == "--hostmask-db")
+			hostmask_db = argv[i + 1];
+		else if(option == "--record")
+			record_file = argv[i + 1];
+		else if(option == "--replay")
+			replay_file = argv[i + 1];
+		else if(option == "--loadtest")
+		{
+			run_loadtest = true;
+			loadtest.clients = (unsigned) atoi(argv[i + 1]);
+			loadtest.authorized = loadtest.clients / 10;
+		}
+		else if(option == "--loadtest-seconds")
+			loadtest.duration_seconds = (unsigned) atoi(argv[i + 1]);
+		else if(option == "--db-threads")
+			db_threads = (unsigned) atoi(argv[i + 1]);
+		else if(option == "--flood-burst")
+			flood_burst = atof(argv[i + 1]);
+		else if(option == "--flood-rate")
+			flood_rate = atof(argv[i + 1]);
+		else if(option == "--selftest")
+			selftest_db = argv[i + 1];
+		else
+			std::cerr << "unknown option " << option << std::endl;
+	}
+
+	if(!selftest_db.empty())
+	{
+		return IRCOptotron::runSelfTest(selftest_db) ? 0 : 1;
+	}
+
+	if(!replay_file.empty())
+	{
+		IRCOptotron::BotController controller(calc_db, hostmask_db, db_threads);
+		return controller.replayTraffic(replay_file) ? 0 : 1;
+	}
+
+#ifdef _WIN32
 	WORD wVersionRequested = MAKEWORD(1,1);
 	WSADATA wsaData;
 
@@ -9,12 +149,51 @@ int main(int argc, char* argv[])
 	{
 		std::cerr << "error starting winsock";
 	}
+#else
+	// A write to a connection the server has reset should fail with EPIPE and
+	// lead to a reconnect, not kill the process.
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	if(run_loadtest)
+	{
+		return runLoadTest(loadtest, db_threads, flood_burst, flood_rate);
+	}
+
+	IRCOptotron::BotConfig config;
+	if(!config_file.empty())
+	{
+		if(!config.load(config_file))
+			return 1;
+
+		calc_db = config.calc_db;
+		hostmask_db = config.hostmask_db;
+	}
 
-	std::vector<std::string> chanlist;
-	chanlist.push_back("#chan1");
-	chanlist.push_back("#chan2");
+	IRCOptotron::BotController controller(calc_db, hostmask_db, db_threads);
 
-	IRCOptotron::BotController::start("bot", "208.51.40.2", chanlist);
+	if(!record_file.empty())
+	{
+		controller.recordTraffic(record_file);
+	}
+
+	if(!config_file.empty())
+	{
+		controller.watchConfig(config_file);
+	}
+	else
+	{
+		std::vector<std::string> chanlist;
+		chanlist.push_back("#chan1");
+		chanlist.push_back("#chan2");
+
+		controller.addNetwork("efnet", "bot", "208.51.40.2", chanlist)->setFloodControl(flood_burst, flood_rate);
+	}
+
+	if(!controller.run())
+	{
+		std::cerr << "could not connect to any network";
+	}
 
 	return 0;
-}
\ No newline at end of file
+}